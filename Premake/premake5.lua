@@ -10,6 +10,11 @@ _OBJ_DIR = _PREMAKE_DIR.."/../bin/intermediate"
 
 dofile ("external.lua")
 
+newoption {
+    trigger     = "openmp",
+    description = "Build with OpenMP (parallel bvh construction and rendering). Apple clang needs libomp."
+}
+
 
 -------------------------------------------------------
 --  CDRT Workspace
@@ -42,7 +47,14 @@ project ("CDRT")
     }
 
     -- Global
-    -- openmp ("On")    -- not tested
+    filter { "options:openmp", "action:vs*" }
+        openmp ("On")
+
+    filter { "options:openmp", "action:not vs*" }
+        buildoptions { "-fopenmp" }
+        linkoptions { "-fopenmp" }
+
+    filter {}
 
     -- TODO: Windows
     -- TODO: Linux
@@ -3,11 +3,18 @@
 #include "common.h"
 #include "ray.h"
 
+#include <limits>
 #include <math.h>
 
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
 
+// Far slab distances are scaled by 1 + 2 * gamma(3) so that rounding never
+// culls a box that the ray touches ("Physically Based Rendering" 3.9.2).
+static constexpr float  _AABB_ROBUST_SCALE = 1.f + 2.f * (3.f * 0.5f * std::numeric_limits<float>::epsilon());
+
+//----------------------------------------------------
+
 class CAABB
 {
 public:
@@ -85,17 +92,43 @@ public:
 
     inline bool    Hit(const CRay& r) const { float f; return Hit(r, f); }
 
+    // Slab test within the interval of a traversal ray, [tEnter, tExit] is
+    // the part of the interval inside the box. The loop has no early out,
+    // min/max keep their second operand when the first is NaN (0 * inf for
+    // rays in a slab plane), which ignores that slab.
+    inline bool    Hit(const CTraversalRay &r, float &tEnter, float &tExit) const
+    {
+        float   t0 = r.m_tMin, t1 = r.m_tMax;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float tNear = ((*this)[r.m_dirIsNeg[axis]][axis] - r.m_origin[axis]) * r.m_invDir[axis];
+            const float tFar = ((*this)[1 - r.m_dirIsNeg[axis]][axis] - r.m_origin[axis]) * r.m_invDir[axis] * _AABB_ROBUST_SCALE;
+            t0 = (tNear > t0) ? tNear : t0;
+            t1 = (tFar < t1) ? tFar : t1;
+        }
+
+        tEnter = t0;
+        tExit = t1;
+        return t0 <= t1;
+    }
+    inline bool    Hit(const CTraversalRay &r, float &tEnter) const { float tExit; return Hit(r, tEnter, tExit); }
+    inline bool    Hit(const CTraversalRay &r) const { float f; return Hit(r, f); }
+
     //----------------------------------------------------
     // methods
     //
     inline bool    Overlaps(const CAABB &b) const
     {
         bool x = (this->pMax.x >= b.pMin.x) && (this->pMin.x <= b.pMax.x);
-        bool y = (this->pMax.y >= b.pMin.y) && (this->pMin.x <= b.pMax.y);
-        bool z = (this->pMax.z >= b.pMin.z) && (this->pMin.x <= b.pMax.z);
+        bool y = (this->pMax.y >= b.pMin.y) && (this->pMin.y <= b.pMax.y);
+        bool z = (this->pMax.z >= b.pMin.z) && (this->pMin.z <= b.pMax.z);
 
         return (x && y && z);
     }
+    inline bool    IsEmpty() const
+    {
+        return (pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z);
+    }
     inline bool    IsInside(const glm::vec3 &p) const
     {
         return (p.x >= this->pMin.x && p.x <= this->pMax.x &&
@@ -119,6 +152,7 @@ public:
     }
 
     inline CAABB   Expand(float ds) { return CAABB(pMin - glm::vec3(ds), pMax + glm::vec3(ds)); }
+    inline CAABB   Translate(const glm::vec3 &offset) const { return CAABB(pMin + offset, pMax + offset); }
 
     //----------------------------------------------------
     // operators
@@ -128,7 +162,7 @@ public:
     inline glm::vec3&          operator[] (int i) { return i > 0 ? pMax : pMin; }
 
     // union(expand) with input point
-    CAABB   operator+ (const glm::vec3 &p)
+    CAABB   operator+ (const glm::vec3 &p) const
     {
         glm::vec3 newMin(std::min(this->pMin.x, p.x),
                          std::min(this->pMin.y, p.y),
@@ -140,7 +174,7 @@ public:
         return CAABB(newMin, newMax);
     }
     // union(expand) with another bounding box
-    CAABB   operator+ (const CAABB &b)
+    CAABB   operator+ (const CAABB &b) const
     {
         glm::vec3 newMin(std::min(this->pMin.x, b.pMin.x),
                          std::min(this->pMin.y, b.pMin.y),
@@ -151,7 +185,7 @@ public:
 
         return CAABB(newMin, newMax);
     }
-    CAABB   operator- (const CAABB &b)
+    CAABB   operator- (const CAABB &b) const
     {
         glm::vec3 newMin(std::max(this->pMin.x, b.pMin.x),
                          std::max(this->pMin.y, b.pMin.y),
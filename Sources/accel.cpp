@@ -0,0 +1,51 @@
+#include "accel.h"
+#include "hittable.h"
+#include "ray.h"
+
+#include <cstdio>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+void    IAccel::HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs) const
+{
+    SHitRec     hitTmp;
+    for (int i = first; i < packet.Size(); i++)
+    {
+        if (Hit(packet.m_rays[i], packet.m_tMin, packet.m_tMax[i], hitTmp))
+        {
+            hitRecs[i] = hitTmp;
+            packet.m_tMax[i] = hitTmp.t;
+            packet.m_isHit[i] = 1;
+        }
+    }
+}
+
+//----------------------------------------------------
+
+void    IAccel::HitAllPacket(CRayPacket &packet, int first, VHits *hits) const
+{
+    for (int i = first; i < packet.Size(); i++)
+        HitAll(packet.m_rays[i], packet.m_tMin, packet.m_tMax[i], hits[i]);
+}
+
+//----------------------------------------------------
+
+bool    IAccel::WriteStats(const std::string &path) const
+{
+    FILE    *file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+    {
+        printf("[Accel] Error: Failed to open \"%s\" for writing.\n", path.c_str());
+        return false;
+    }
+
+    const std::string   json = GetStatsJson();
+    const bool          isWritten = fwrite(json.data(), 1, json.size(), file) == json.size();
+    fclose(file);
+
+    return isWritten;
+}
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
@@ -0,0 +1,63 @@
+#pragma once
+
+/*************************************************************************
+*
+*		accel.h
+*
+*		Interface of the static acceleration structures that a
+*		CHittableList can be built with: the BVH (bvh.h), the
+*		uniform grid (grid_accel.h) and the SAH kd-tree
+*		(kdtree_accel.h). They are interchangeable at runtime, so
+*		that scenes can pick, and benchmark, the fastest structure.
+*
+**************************************************************************/
+
+#include "common.h"
+
+#include <string>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+struct SHitRec;
+class CRay;
+class CRayPacket;
+typedef std::vector<SHitRec> VHits;
+
+//----------------------------------------------------
+
+enum EAccelType { ACCEL_BVH, ACCEL_GRID, ACCEL_KDTREE };
+
+//----------------------------------------------------
+
+class IAccel
+{
+public:
+    virtual ~IAccel() {}
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const = 0;
+    virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const = 0;
+    // any-hit query, returns at the first intersection within [t_min, t_max]
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const = 0;
+    // closest hits of a coherent packet (IHittable::HitPacket), the default
+    // traces the rays one at a time
+    virtual void    HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs) const;
+    virtual void    HitAllPacket(CRayPacket &packet, int first, VHits *hits) const;
+    virtual bool    IsEmpty() const = 0;
+
+    // Update the structure after the hittables moved. Returns false when it
+    // should be rebuilt instead, which is the default.
+    virtual bool    Refit() { return false; }
+
+    // Measure the traversal between the two calls. What is measured, and
+    // what is done with it at the end, depends on the structure.
+    virtual void    BeginProfile() {}
+    virtual void    EndProfile() {}
+
+    // Build and traversal statistics, as a JSON object
+    virtual std::string GetStatsJson() const = 0;
+    bool            WriteStats(const std::string &path) const;
+};
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
@@ -1,389 +1,3334 @@
 #include "bvh.h"
 #include "hittable.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <numeric>  // accumulate
+#include <queue>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _BVH_USE_SSE
+#include <xmmintrin.h>
+#endif
+#if defined(__AVX__)
+#define _BVH_USE_AVX
+#include <immintrin.h>
+#endif
+
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
 
-CBVHAccel::CBVHAccel()
-{
+// Subtrees with more hittables than this are built as separate tasks.
+static constexpr int    _BVH_TASK_CUTOFF = 4096;
+// Ranges with more hittables than this are scanned in parallel chunks
+// (bounds, SAH buckets). Must be large enough to amortize task overhead.
+static constexpr int    _BVH_PARALLEL_RANGE = 64 * 1024;
+static constexpr int    _BVH_CHUNK_SIZE = 16 * 1024;
+// SBVH only tries spatial splits above this depth, which keeps duplicated
+// references from pushing the tree past the traversal stack.
+static constexpr int    _SBVH_MAX_SPATIAL_DEPTH = 48;
+// Cache file version. Bump this whenever SLinearBVHNode, the cache layout,
+// or a builder changes, so that stale caches are rebuilt.
+static constexpr uint32_t   _BVH_CACHE_VERSION = 2;
+
+// Wide traversal stack: every level pushes at most N - 1 siblings.
+static constexpr int    _BVH_WIDE_STACK_DEPTH = 64;
+
+// Slack of the packet cone test, relative to the distance from the apex. Ray
+// lines pass through the apex only up to the rounding of their directions.
+static constexpr float  _BVH_CONE_MARGIN = 1e-5f;
+
+// Cache file layout: header | SLinearBVHNode[nNodes] | int32_t[nReferences].
+// the header is padded to 64 bytes, which keeps the node array aligned.
+struct SBVHCacheHeader
+{
+    char        magic[4];
+    uint32_t    version;
+    uint64_t    key;
+    uint32_t    nodeSize;
+    int32_t     nNodes;
+    int32_t     nReferences;        // indices into the input hittables, in leaf order
+    int32_t     nHittables;
+    float       buildSAHCost;
+    uint8_t     pad[28];
+};
+static_assert(sizeof(SBVHCacheHeader) == 64, "cache header must keep the nodes aligned");
+
+// morton codes: spread the bits of x so that there are two zero bits between
+// each of them. 10 bits for 30 bit codes, 21 bits for 63 bit codes.
+static inline uint64_t  _LeftShift3(uint64_t x, int nBits)
+{
+    if (nBits <= 10)
+    {
+        x &= 0x3ff;
+        x = (x | (x << 16)) & 0x30000ff;
+        x = (x | (x << 8)) & 0x300f00f;
+        x = (x | (x << 4)) & 0x30c30c3;
+        x = (x | (x << 2)) & 0x9249249;
+        return x;
+    }
+
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffull;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+    x = (x | (x << 8)) & 0x100f00f00f00f00full;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+    x = (x | (x << 2)) & 0x1249249249249249ull;
+    return x;
+}
+
+// interleaves xyz so that bit i of the code belongs to axis i % 3
+static inline uint64_t  _EncodeMorton3(const glm::vec3 &v, int nBitsPerAxis)
+{
+    const float scale = (float)(1 << nBitsPerAxis);
+    const float maxV = scale - 1;
+
+    return (_LeftShift3(glm::clamp(v.z * scale, 0.f, maxV), nBitsPerAxis) << 2) |
+           (_LeftShift3(glm::clamp(v.y * scale, 0.f, maxV), nBitsPerAxis) << 1) |
+            _LeftShift3(glm::clamp(v.x * scale, 0.f, maxV), nBitsPerAxis);
+}
+
+// Slab test of N boxes stored as bounds[6][stride], lanes [0, N). Writes the
+// entry distances and returns a bit mask of the boxes hit within the ray interval.
+// max/min keep their second operand when the first is NaN (0 * inf for rays
+// in a slab plane), which ignores that slab like the SIMD versions.
+template <int N>
+static inline int   _IntersectBoxes(const float *bounds, int stride, const CTraversalRay &ray, float *tNear)
+{
+    int     mask = 0;
+    for (int i = 0; i < N; i++)
+    {
+        float   t0 = ray.m_tMin, t1 = ray.m_tMax;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float tSlabNear = (bounds[(axis + 3 * ray.m_dirIsNeg[axis]) * stride + i] - ray.m_origin[axis]) * ray.m_invDir[axis];
+            const float tSlabFar = (bounds[(axis + 3 * (1 - ray.m_dirIsNeg[axis])) * stride + i] - ray.m_origin[axis]) * ray.m_invDir[axis] * _AABB_ROBUST_SCALE;
+            t0 = (tSlabNear > t0) ? tSlabNear : t0;
+            t1 = (tSlabFar < t1) ? tSlabFar : t1;
+        }
+        tNear[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+    return mask;
+}
+
+#if defined(_BVH_USE_SSE)
+template <>
+inline int  _IntersectBoxes<4>(const float *bounds, int stride, const CTraversalRay &ray, float *tNear)
+{
+    __m128  t0 = _mm_set1_ps(ray.m_tMin);
+    __m128  t1 = _mm_set1_ps(ray.m_tMax);
+    const __m128    robustScale = _mm_set1_ps(_AABB_ROBUST_SCALE);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const __m128    origin = _mm_set1_ps(ray.m_origin[axis]);
+        const __m128    invDir = _mm_set1_ps(ray.m_invDir[axis]);
+        const __m128    slabNear = _mm_loadu_ps(&bounds[(axis + 3 * ray.m_dirIsNeg[axis]) * stride]);
+        const __m128    slabFar = _mm_loadu_ps(&bounds[(axis + 3 * (1 - ray.m_dirIsNeg[axis])) * stride]);
+
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(slabNear, origin), invDir), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(slabFar, origin), invDir), robustScale), t1);
+    }
+
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if defined(_BVH_USE_AVX)
+template <>
+inline int  _IntersectBoxes<8>(const float *bounds, int stride, const CTraversalRay &ray, float *tNear)
+{
+    __m256  t0 = _mm256_set1_ps(ray.m_tMin);
+    __m256  t1 = _mm256_set1_ps(ray.m_tMax);
+    const __m256    robustScale = _mm256_set1_ps(_AABB_ROBUST_SCALE);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const __m256    origin = _mm256_set1_ps(ray.m_origin[axis]);
+        const __m256    invDir = _mm256_set1_ps(ray.m_invDir[axis]);
+        const __m256    slabNear = _mm256_loadu_ps(&bounds[(axis + 3 * ray.m_dirIsNeg[axis]) * stride]);
+        const __m256    slabFar = _mm256_loadu_ps(&bounds[(axis + 3 * (1 - ray.m_dirIsNeg[axis])) * stride]);
+
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(slabNear, origin), invDir), t0);
+        t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(slabFar, origin), invDir), robustScale), t1);
+    }
+
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#elif defined(_BVH_USE_SSE)
+// without AVX, 8-wide nodes are tested as two SSE halves
+template <>
+inline int  _IntersectBoxes<8>(const float *bounds, int stride, const CTraversalRay &ray, float *tNear)
+{
+    return _IntersectBoxes<4>(bounds, stride, ray, tNear) |
+          (_IntersectBoxes<4>(bounds + 4, stride, ray, tNear + 4) << 4);
+}
+#endif
+
+// Slab test of one box against the packet rays [i, i + 4), each within its
+// own [m_tMin, m_tMax[i]]. Returns a bit mask of the rays that hit it. The
+// rays of a packet need not agree in direction signs, so the near slab is
+// picked per lane.
+#if defined(_BVH_USE_SSE)
+static inline int   _IntersectPacket4(const CAABB &bounds, const CRayPacket &packet, int i)
+{
+    __m128  t0 = _mm_set1_ps(packet.m_tMin);
+    __m128  t1 = _mm_load_ps(&packet.m_tMax[i]);
+    const __m128    robustScale = _mm_set1_ps(_AABB_ROBUST_SCALE);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const __m128    origin = _mm_load_ps(&packet.m_origin[axis][i]);
+        const __m128    invDir = _mm_load_ps(&packet.m_invDir[axis][i]);
+        const __m128    isNeg = _mm_cmplt_ps(invDir, _mm_setzero_ps());
+        const __m128    tMinSlab = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMin[axis]), origin), invDir);
+        const __m128    tMaxSlab = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMax[axis]), origin), invDir);
+        const __m128    tSlabNear = _mm_or_ps(_mm_and_ps(isNeg, tMaxSlab), _mm_andnot_ps(isNeg, tMinSlab));
+        const __m128    tSlabFar = _mm_or_ps(_mm_and_ps(isNeg, tMinSlab), _mm_andnot_ps(isNeg, tMaxSlab));
+
+        t0 = _mm_max_ps(tSlabNear, t0);
+        t1 = _mm_min_ps(_mm_mul_ps(tSlabFar, robustScale), t1);
+    }
+
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#else
+static inline int   _IntersectPacket4(const CAABB &bounds, const CRayPacket &packet, int i)
+{
+    int     mask = 0;
+    for (int lane = 0; lane < 4; lane++)
+    {
+        float   t0 = packet.m_tMin, t1 = packet.m_tMax[i + lane];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float invDir = packet.m_invDir[axis][i + lane];
+            const float tMinSlab = (bounds.pMin[axis] - packet.m_origin[axis][i + lane]) * invDir;
+            const float tMaxSlab = (bounds.pMax[axis] - packet.m_origin[axis][i + lane]) * invDir;
+            const float tSlabNear = (invDir < 0) ? tMaxSlab : tMinSlab;
+            const float tSlabFar = ((invDir < 0) ? tMinSlab : tMaxSlab) * _AABB_ROBUST_SCALE;
+            t0 = (tSlabNear > t0) ? tSlabNear : t0;
+            t1 = (tSlabFar < t1) ? tSlabFar : t1;
+        }
+        mask |= (t0 <= t1) << lane;
+    }
+    return mask;
+}
+#endif
+
+// First ray at or after "first" that hits the box, -1 if none does. The
+// padding lanes never hit.
+static inline int   _FirstActiveRay(const CAABB &bounds, const CRayPacket &packet, int first)
+{
+    for (int i = first & ~3; i < packet.Size(); i += 4)
+    {
+        int     mask = _IntersectPacket4(bounds, packet, i);
+        if (i < first)
+            mask &= ~((1 << (first - i)) - 1);
+
+        if (mask != 0)
+        {
+            int     lane = 0;
+            while (((mask >> lane) & 1) == 0)
+                lane++;
+            return i + lane;
+        }
+    }
+    return -1;
+}
+
+// Interval arithmetic bounds of the slab distances of all the rays, from the
+// bounds of their origins and reciprocal directions. True when no ray of the
+// packet can hit the box, which culls it without testing the rays.
+static inline bool  _IsOutsideFrustum(const CAABB &bounds, const CRayPacket &packet)
+{
+    float   t0 = packet.m_tMin, t1 = packet.m_tMaxBound;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float slabNear = packet.m_dirIsNeg[axis] ? bounds.pMax[axis] : bounds.pMin[axis];
+        const float slabFar = packet.m_dirIsNeg[axis] ? bounds.pMin[axis] : bounds.pMax[axis];
+        const float nearMin = slabNear - packet.m_originMax[axis], nearMax = slabNear - packet.m_originMin[axis];
+        const float farMin = slabFar - packet.m_originMax[axis], farMax = slabFar - packet.m_originMin[axis];
+        const float invMin = packet.m_invDirMin[axis], invMax = packet.m_invDirMax[axis];
+
+        const float tNearLower = std::min(std::min(nearMin * invMin, nearMin * invMax), std::min(nearMax * invMin, nearMax * invMax));
+        const float tFarUpper = std::max(std::max(farMin * invMin, farMin * invMax), std::max(farMax * invMin, farMax * invMax));
+        t0 = std::max(t0, tNearLower);
+        t1 = std::min(t1, tFarUpper * _AABB_ROBUST_SCALE);
+    }
+    return t0 > t1;
+}
+
+// Bounding sphere of the box against the double cone of a packet with an apex.
+// In the plane of the cone axis and the sphere center, the distance of the
+// center to the cone surface is dPerp * cos - dAxis * sin.
+static inline bool  _IsOutsideCone(const CAABB &bounds, const CRayPacket &packet)
+{
+    const glm::vec3 v = bounds.Centroid() - packet.m_apex;
+    const float     radius = glm::length(bounds.Diagonal()) * 0.5f;
+    const float     dAxis = std::abs(glm::dot(v, packet.m_coneAxis));
+    const float     dPerp = glm::length(glm::cross(v, packet.m_coneAxis));
+
+    return dPerp * packet.m_coneCos - dAxis * packet.m_coneSin > radius + _BVH_CONE_MARGIN * (glm::length(v) + radius);
+}
+
+// True when no ray of the packet can hit the box
+static inline bool  _IsPacketCulled(const CAABB &bounds, const CRayPacket &packet, bool useFrustum)
+{
+    return (useFrustum && _IsOutsideFrustum(bounds, packet)) ||
+           (packet.m_hasCone && _IsOutsideCone(bounds, packet));
+}
+
+// Quantization step of a node box axis. Shared by the encoder and the
+// traversal, so that both decode the exact same bounds.
+template <typename T>
+static inline float _QuantizationScale(float pMin, float pMax)
+{
+    return (pMax - pMin) * (1.f / std::numeric_limits<T>::max());
+}
+
+template <typename T>
+static inline void  _DecodeQuantizedBounds(const T (&offsets)[2][6], const CAABB &parent, float (&bounds)[6][2])
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float scale = _QuantizationScale<T>(parent.pMin[axis], parent.pMax[axis]);
+        for (int c = 0; c < 2; c++)
+        {
+            bounds[axis][c] = parent.pMin[axis] + offsets[c][axis] * scale;
+            bounds[axis + 3][c] = parent.pMax[axis] - offsets[c][axis + 3] * scale;
+        }
+    }
+}
+
+// Tests the ray against the N triangle lanes of a group. Writes the hit
+// distances and returns a bit mask of the lanes hit within [tMin, tMax].
+// Same arithmetic as CHittableTriangle::Hit(), so both report the same hits.
+template <int N>
+static inline int   _IntersectTriangles(const float (&v0)[3][N], const float (&e1)[3][N], const float (&e2)[3][N], const float (&n)[3][N], const CRay &ray, float tMin, float tMax, float *tHit)
+{
+    int     mask = 0;
+    for (int i = 0; i < N; i++)
+    {
+        const glm::vec3 rov0 = ray.m_origin - glm::vec3(v0[0][i], v0[1][i], v0[2][i]);
+        const glm::vec3 q = glm::cross(rov0, ray.m_dir);
+        const float     d = 1.0f / glm::dot(ray.m_dir, glm::vec3(n[0][i], n[1][i], n[2][i]));
+        const float     u = d * glm::dot(-q, glm::vec3(e2[0][i], e2[1][i], e2[2][i]));
+        const float     v = d * glm::dot(q, glm::vec3(e1[0][i], e1[1][i], e1[2][i]));
+        const float     t = d * glm::dot(-glm::vec3(n[0][i], n[1][i], n[2][i]), rov0);
+
+        tHit[i] = t;
+        mask |= (!(u < 0.0f || v < 0.0f || (u + v) > 1.0f || t < tMin || t > tMax)) << i;
+    }
+    return mask;
+}
+
+#if defined(_BVH_USE_SSE)
+static inline __m128    _Dot4(const __m128 (&a)[3], const __m128 (&b)[3])
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+// Negating a dot product is exact, so -dot(q, e2) and -dot(n, rov0) round
+// like the scalar dot(-q, e2) and dot(-n, rov0).
+template <>
+inline int  _IntersectTriangles<4>(const float (&v0)[3][4], const float (&e1)[3][4], const float (&e2)[3][4], const float (&n)[3][4], const CRay &ray, float tMin, float tMax, float *tHit)
+{
+    const __m128    signBit = _mm_set1_ps(-0.0f);
+    __m128  dir[3], rov0[3], vn[3], ve1[3], ve2[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        dir[axis] = _mm_set1_ps(ray.m_dir[axis]);
+        rov0[axis] = _mm_sub_ps(_mm_set1_ps(ray.m_origin[axis]), _mm_load_ps(v0[axis]));
+        vn[axis] = _mm_load_ps(n[axis]);
+        ve1[axis] = _mm_load_ps(e1[axis]);
+        ve2[axis] = _mm_load_ps(e2[axis]);
+    }
+
+    const __m128    q[3] = {
+        _mm_sub_ps(_mm_mul_ps(rov0[1], dir[2]), _mm_mul_ps(dir[1], rov0[2])),
+        _mm_sub_ps(_mm_mul_ps(rov0[2], dir[0]), _mm_mul_ps(dir[2], rov0[0])),
+        _mm_sub_ps(_mm_mul_ps(rov0[0], dir[1]), _mm_mul_ps(dir[0], rov0[1])) };
+    const __m128    d = _mm_div_ps(_mm_set1_ps(1.0f), _Dot4(dir, vn));
+    const __m128    u = _mm_mul_ps(d, _mm_xor_ps(_Dot4(q, ve2), signBit));
+    const __m128    v = _mm_mul_ps(d, _Dot4(q, ve1));
+    const __m128    t = _mm_mul_ps(d, _mm_xor_ps(_Dot4(vn, rov0), signBit));
+
+    const __m128    zero = _mm_setzero_ps();
+    const __m128    miss = _mm_or_ps(
+        _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)),
+        _mm_or_ps(_mm_cmpgt_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)),
+                  _mm_or_ps(_mm_cmplt_ps(t, _mm_set1_ps(tMin)), _mm_cmpgt_ps(t, _mm_set1_ps(tMax)))));
+
+    _mm_storeu_ps(tHit, t);
+    return ~_mm_movemask_ps(miss) & 0xf;
+}
+#endif
+
+// Hit()/HitAll() of hittables that are all of type T. The qualified calls
+// are bound at compile time, so leaves of a single type skip the vtable.
+template <typename T>
+static inline bool  _HitHittables(const std::shared_ptr<IHittable> *hittables, int nHittables, const CRay &ray, float t_min, float &tClosest, SHitRec &hitRec)
+{
+    SHitRec     hitTmp;
+    bool        isHit = false;
+    for (int i = 0; i < nHittables; i++)
+    {
+        T       *hittable = static_cast<T*>(hittables[i].get());
+        bool    isHittableHit;
+        if constexpr (std::is_same<T, IHittable>::value)
+            isHittableHit = hittable->Hit(ray, t_min, tClosest, hitTmp);
+        else
+            isHittableHit = hittable->T::Hit(ray, t_min, tClosest, hitTmp);
+
+        if (isHittableHit)
+        {
+            hitRec = hitTmp;
+            tClosest = hitTmp.t;
+            isHit = true;
+        }
+    }
+    return isHit;
+}
+
+template <typename T>
+static inline void  _HitAllHittables(const std::shared_ptr<IHittable> *hittables, int nHittables, const CRay &ray, float t_min, float t_max, VHits &hits)
+{
+    for (int i = 0; i < nHittables; i++)
+    {
+        T   *hittable = static_cast<T*>(hittables[i].get());
+        if constexpr (std::is_same<T, IHittable>::value)
+            hittable->HitAll(ray, t_min, t_max, hits);
+        else
+            hittable->T::HitAll(ray, t_min, t_max, hits);
+    }
+}
+
+template <typename T>
+static inline bool  _OccludedHittables(const std::shared_ptr<IHittable> *hittables, int nHittables, const CRay &ray, float t_min, float t_max)
+{
+    for (int i = 0; i < nHittables; i++)
+    {
+        T   *hittable = static_cast<T*>(hittables[i].get());
+        bool    isOccluded;
+        if constexpr (std::is_same<T, IHittable>::value)
+            isOccluded = hittable->Occluded(ray, t_min, t_max);
+        else
+            isOccluded = hittable->T::Occluded(ray, t_min, t_max);
+
+        if (isOccluded)
+            return true;
+    }
+    return false;
+}
+
+// SAH bucket of a centroid, given its offset [0, 1] inside the centroid bounds
+static inline int   _BucketIndex(int nBuckets, float offset)
+{
+    const int b = nBuckets * offset;
+    return (b >= nBuckets) ? nBuckets - 1 : b;
+}
+
+//----------------------------------------------------
+
+CBVHAccel::CBVHAccel()
+{
+}
+
+//----------------------------------------------------
+
+CBVHAccel::CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, int maxHittablesInNode, EPartitionType partitionType)
+: m_hittables(hittables)
+{
+    m_setting.maxHittablesInNode = std::min(255, maxHittablesInNode);
+    m_setting.partitionMethod = partitionType;
+    _BuildTree();
+}
+
+//----------------------------------------------------
+
+CBVHAccel::CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const SBuildSetting &setting)
+: m_setting(setting)
+, m_hittables(hittables)
+{
+    m_setting.maxHittablesInNode = std::min(255, m_setting.maxHittablesInNode);
+    m_setting.nBuckets = std::max(2, m_setting.nBuckets);
+    _BuildTree();
+}
+
+//----------------------------------------------------
+
+CBVHAccel::~CBVHAccel()
+{
+}
+
+//----------------------------------------------------
+
+CBVHAccel::CBVHAccel(CBVHAccel &&other)
+{
+    *this = std::move(other);
+}
+
+//----------------------------------------------------
+
+CBVHAccel& CBVHAccel::operator=(CBVHAccel &&other)
+{
+    if (this == &other)
+        return *this;
+
+    // the node arrays go before "m_cacheFile", which may own their memory
+    m_setting = std::move(other.m_setting);
+    m_hittables = std::move(other.m_hittables);
+    m_nodes = std::move(other.m_nodes);
+    m_nNodes = other.m_nNodes;
+    m_wideNodes4 = std::move(other.m_wideNodes4);
+    m_wideNodes8 = std::move(other.m_wideNodes8);
+    m_nWideNodes = other.m_nWideNodes;
+    m_triangleGroups = std::move(other.m_triangleGroups);
+    m_leafGroups = std::move(other.m_leafGroups);
+    m_leafTypes = std::move(other.m_leafTypes);
+    m_quantizedNodes8 = std::move(other.m_quantizedNodes8);
+    m_quantizedNodes16 = std::move(other.m_quantizedNodes16);
+    m_nQuantizedNodes = other.m_nQuantizedNodes;
+    m_quantizedRootBounds = other.m_quantizedRootBounds;
+    m_quantizedRootChild = other.m_quantizedRootChild;
+    m_quantizedRootHittables = other.m_quantizedRootHittables;
+    m_buildSAHCost = other.m_buildSAHCost;
+    m_buildArena = std::move(other.m_buildArena);
+    m_cacheFile = std::move(other.m_cacheFile);
+    m_visitCounts = std::move(other.m_visitCounts);
+    m_wideVisitCounts = std::move(other.m_wideVisitCounts);
+
+    // leave "other" empty, with counts that match its (now null) arrays
+    other.Clear();
+    other.m_quantizedRootChild = 0;
+    other.m_quantizedRootHittables = 0;
+    other.m_buildSAHCost = 0;
+    return *this;
+}
+
+//----------------------------------------------------
+// Query policies of the traversal kernels. A kernel walks the tree and calls
+// Leaf() on every leaf the ray reaches, Leaf() returning true ends the walk.
+// Ordered queries visit the nearer children first and skip the entries past
+// t_max, which their Leaf() shrinks. The policy is a template parameter, so
+// every query gets its own loop with the leaf action inlined.
+
+struct CBVHAccel::SClosestHitQuery
+{
+    static constexpr bool   kIsOrdered = true;
+
+    SHitRec     &hitRec;
+    bool        isHit = false;
+
+    inline bool Leaf(const CBVHAccel &bvh, int offset, int nHittables, const CRay &ray, float t_min, float &t_max)
+    {
+        if (bvh._HitLeaf(offset, nHittables, ray, t_min, t_max, hitRec))
+            isHit = true;
+        return false;
+    }
+};
+
+// the first leaf with an intersection ends the walk, leaves are tested as
+// soon as their box is hit
+struct CBVHAccel::SAnyHitQuery
+{
+    static constexpr bool   kIsOrdered = false;
+
+    bool        isOccluded = false;
+
+    inline bool Leaf(const CBVHAccel &bvh, int offset, int nHittables, const CRay &ray, float t_min, float &t_max)
+    {
+        isOccluded = bvh._OccludedLeaf(offset, nHittables, ray, t_min, t_max);
+        return isOccluded;
+    }
+};
+
+struct CBVHAccel::SAllHitsQuery
+{
+    static constexpr bool   kIsOrdered = false;
+
+    VHits       &hits;
+
+    inline bool Leaf(const CBVHAccel &bvh, int offset, int nHittables, const CRay &ray, float t_min, float &t_max)
+    {
+        bvh._HitAllLeaf(offset, nHittables, ray, t_min, t_max, hits);
+        return false;
+    }
+};
+
+struct CBVHAccel::SCountCrossingsQuery
+{
+    static constexpr bool   kIsOrdered = false;
+
+    int         nCrossings = 0;
+
+    inline void AddCrossing(float, bool) { nCrossings++; }
+
+    inline bool Leaf(const CBVHAccel &bvh, int offset, int nHittables, const CRay &ray, float t_min, float &t_max)
+    {
+        bvh._CrossingsLeaf(offset, nHittables, ray, t_min, t_max, [this](float t, bool isEntering) { AddCrossing(t, isEntering); });
+        return false;
+    }
+};
+
+// Integral of the number of surfaces around the ray over [tMin, tEnd]. A
+// crossing before tEnd adds its distance to tMin when exiting and subtracts
+// it when entering, so the crossings can come in any order. The geometry
+// still around the ray at tEnd is the exits minus the entries past it.
+struct CBVHAccel::SThicknessQuery
+{
+    static constexpr bool   kIsOrdered = false;
+
+    float       tMin;
+    float       tEnd;
+    float       thickness = 0;
+    int         nInsideAtEnd = 0;
+
+    inline void AddCrossing(float t, bool isEntering)
+    {
+        if (t > tEnd)
+            nInsideAtEnd += isEntering ? -1 : 1;
+        else
+            thickness += isEntering ? tMin - t : t - tMin;
+    }
+
+    inline bool Leaf(const CBVHAccel &bvh, int offset, int nHittables, const CRay &ray, float t_min, float &t_max)
+    {
+        bvh._CrossingsLeaf(offset, nHittables, ray, t_min, t_max, [this](float t, bool isEntering) { AddCrossing(t, isEntering); });
+        return false;
+    }
+};
+
+//----------------------------------------------------
+
+bool CBVHAccel::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
+{
+    SClosestHitQuery    query{ hitRec };
+    _Traverse(ray, t_min, t_max, query);
+    return query.isHit;
+}
+
+//----------------------------------------------------
+
+bool CBVHAccel::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const
+{
+    const size_t    firstNewHit = hits.size();
+
+    SAllHitsQuery   query{ hits };
+    _Traverse(ray, t_min, t_max, query);
+
+    _RemoveDuplicateHits(hits, firstNewHit);
+    return hits.size() > 0;
+}
+
+//----------------------------------------------------
+
+bool CBVHAccel::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    SAnyHitQuery    query;
+    _Traverse(ray, t_min, t_max, query);
+    return query.isOccluded;
+}
+
+//----------------------------------------------------
+
+int     CBVHAccel::CountCrossings(const CRay &ray, float t_min, float t_max) const
+{
+    SCountCrossingsQuery    query;
+
+    // spatial splits report a crossing once per leaf referencing its hittable
+    if (m_setting.partitionMethod == SBVH)
+    {
+        VHits   hits;
+        HitAll(ray, t_min, t_max, hits);
+        for (const SHitRec &hit : hits)
+            query.AddCrossing(hit.t, hit.frontFace);
+    }
+    else
+        _Traverse(ray, t_min, t_max, query);
+
+    return query.nCrossings;
+}
+
+//----------------------------------------------------
+
+// The ray is traced past t_max, where it leaves all the geometry, so that
+// the crossings behind t_max tell what the segment ends inside of.
+float   CBVHAccel::Thickness(const CRay &ray, float t_min, float t_max) const
+{
+    SThicknessQuery query{ t_min, t_max };
+
+    if (m_setting.partitionMethod == SBVH)
+    {
+        VHits   hits;
+        HitAll(ray, t_min, _INFINITY, hits);
+        for (const SHitRec &hit : hits)
+            query.AddCrossing(hit.t, hit.frontFace);
+    }
+    else
+        _Traverse(ray, t_min, _INFINITY, query);
+
+    if (query.nInsideAtEnd == 0)
+        return query.thickness;
+    return query.thickness + query.nInsideAtEnd * (t_max - t_min);
+}
+//----------------------------------------------------
+
+void    CBVHAccel::HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs) const
+{
+    if (m_nodes == nullptr || m_nNodes == 0)
+    {
+        IAccel::HitPacket(packet, first, hitRecs);
+        return;
+    }
+
+    const bool  useFrustum = packet.m_hasFrustum && packet.Size() > CRayPacket::kMaxSIMDRays;
+
+    // nodes to visit, with the first ray that may hit them
+    int                     toVisitOffset = 0;
+    int                     currentNodeIndex = 0;
+    int                     firstActive = first;
+    std::pair<int, int>     nodesToVisit[64];
+
+    while (true) {
+        const SLinearBVHNode    *node = &m_nodes[currentNodeIndex];
+
+        if (m_visitCounts)
+            m_visitCounts[currentNodeIndex].fetch_add(1, std::memory_order_relaxed);
+
+        // rays before the first active one missed an ancestor, they stay inactive below it
+        if (_IsPacketCulled(node->bounds, packet, useFrustum))
+            firstActive = -1;
+        else
+            firstActive = _FirstActiveRay(node->bounds, packet, firstActive);
+
+        if (firstActive >= 0) {
+            if (node->nHittables == 0)
+            {
+                // near child first, along the first active ray
+                if (packet.m_invDir[node->axis][firstActive] < 0)
+                {
+                    nodesToVisit[toVisitOffset++] = { currentNodeIndex + 1, firstActive };
+                    currentNodeIndex = node->secondChildOffset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = { node->secondChildOffset, firstActive };
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                continue;
+            }
+
+            _HitPacketLeaf(*node, packet, firstActive, hitRecs);
+        }
+
+        if (toVisitOffset == 0)
+            break;
+        --toVisitOffset;
+        currentNodeIndex = nodesToVisit[toVisitOffset].first;
+        firstActive = nodesToVisit[toVisitOffset].second;
+    }
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::HitAllPacket(CRayPacket &packet, int first, VHits *hits) const
+{
+    if (m_nodes == nullptr || m_nNodes == 0)
+    {
+        IAccel::HitAllPacket(packet, first, hits);
+        return;
+    }
+
+    const bool  useFrustum = packet.m_hasFrustum && packet.Size() > CRayPacket::kMaxSIMDRays;
+
+    size_t  firstNewHit[CRayPacket::kMaxRays];
+    for (int i = first; i < packet.Size(); i++)
+        firstNewHit[i] = hits[i].size();
+
+    // nodes to visit, with the first ray that may hit them
+    int                     toVisitOffset = 0;
+    std::pair<int, int>     nodesToVisit[64];
+    nodesToVisit[toVisitOffset++] = { 0, first };
+
+    while (toVisitOffset > 0)
+    {
+        const int               nodeIndex = nodesToVisit[--toVisitOffset].first;
+        const SLinearBVHNode    *node = &m_nodes[nodeIndex];
+
+        if (m_visitCounts)
+            m_visitCounts[nodeIndex].fetch_add(1, std::memory_order_relaxed);
+
+        if (_IsPacketCulled(node->bounds, packet, useFrustum))
+            continue;
+        const int   firstActive = _FirstActiveRay(node->bounds, packet, nodesToVisit[toVisitOffset].second);
+        if (firstActive < 0)
+            continue;
+
+        if (node->nHittables > 0)
+            _HitAllPacketLeaf(*node, packet, firstActive, hits);
+        else
+        {
+            nodesToVisit[toVisitOffset++] = { node->secondChildOffset, firstActive };
+            nodesToVisit[toVisitOffset++] = { nodeIndex + 1, firstActive };
+        }
+    }
+
+    for (int i = first; i < packet.Size(); i++)
+        _RemoveDuplicateHits(hits[i], firstNewHit[i]);
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_RemoveDuplicateHits(VHits &hits, size_t firstNewHit) const
+{
+    // spatial splits reference a hittable from several leaves, which
+    // reports its intersections more than once.
+    if (m_setting.partitionMethod != SBVH)
+        return;
+
+    auto    cmp = [](const SHitRec &a, const SHitRec &b) {
+        return (a.p_hittable != b.p_hittable) ? a.p_hittable < b.p_hittable : a.t < b.t; };
+    auto    isSame = [](const SHitRec &a, const SHitRec &b) {
+        return a.p_hittable == b.p_hittable && a.t == b.t; };
+
+    std::sort(hits.begin() + firstNewHit, hits.end(), cmp);
+    hits.erase(std::unique(hits.begin() + firstNewHit, hits.end(), isSame), hits.end());
+}
+
+//----------------------------------------------------
+
+// Closest hit among the hittables [offset, offset + nHittables). Leaves of a
+// single type are dispatched once, triangle leaves test their groups four
+// triangles at a time and only build the hit record of the closest one.
+bool    CBVHAccel::_HitLeaf(int offset, int nHittables, const CRay &ray, float t_min, float &tClosest, SHitRec &hitRec) const
+{
+    const std::shared_ptr<IHittable>    *hittables = &m_hittables[offset];
+
+    switch (m_leafTypes.empty() ? HITTABLE_OTHER : (EHittableType)m_leafTypes[offset])
+    {
+    case HITTABLE_TRIANGLE:
+    {
+        if (m_triangleGroups.empty())
+            return _HitHittables<CHittableTriangle>(hittables, nHittables, ray, t_min, tClosest, hitRec);
+
+        int     closestTriangle = -1;
+        for (int g = m_leafGroups[offset]; g < m_leafGroups[offset + nHittables]; g++)
+        {
+            const STriangleGroup    &group = m_triangleGroups[g];
+            float   tHit[kTriangleGroupSize];
+            int     mask = _IntersectTriangles<kTriangleGroupSize>(group.v0, group.e1, group.e2, group.n, ray, t_min, tClosest, tHit);
+
+            for (int lane = 0; mask != 0; lane++, mask >>= 1)
+            {
+                if ((mask & 1) == 0)
+                    continue;
+                if (group.hittables[lane] >= 0 && tHit[lane] < tClosest)
+                {
+                    tClosest = tHit[lane];
+                    closestTriangle = group.hittables[lane];
+                }
+            }
+        }
+
+        if (closestTriangle < 0)
+            return false;
+
+        _FillTriangleHit(closestTriangle, ray, tClosest, hitRec);
+        return true;
+    }
+    case HITTABLE_SPHERE:
+        return _HitHittables<CHittableSphere>(hittables, nHittables, ray, t_min, tClosest, hitRec);
+    case HITTABLE_PLANE:
+        return _HitHittables<CHittablePlane>(hittables, nHittables, ray, t_min, tClosest, hitRec);
+    case HITTABLE_MESH:
+        return _HitHittables<CHittableMesh>(hittables, nHittables, ray, t_min, tClosest, hitRec);
+    case HITTABLE_INSTANCE:
+        return _HitHittables<CHittableInstance>(hittables, nHittables, ray, t_min, tClosest, hitRec);
+    default:
+        return _HitHittables<IHittable>(hittables, nHittables, ray, t_min, tClosest, hitRec);
+    }
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_HitAllLeaf(int offset, int nHittables, const CRay &ray, float t_min, float t_max, VHits &hits) const
+{
+    const std::shared_ptr<IHittable>    *hittables = &m_hittables[offset];
+
+    switch (m_leafTypes.empty() ? HITTABLE_OTHER : (EHittableType)m_leafTypes[offset])
+    {
+    case HITTABLE_TRIANGLE:
+    {
+        if (m_triangleGroups.empty())
+            return _HitAllHittables<CHittableTriangle>(hittables, nHittables, ray, t_min, t_max, hits);
+
+        for (int g = m_leafGroups[offset]; g < m_leafGroups[offset + nHittables]; g++)
+        {
+            const STriangleGroup    &group = m_triangleGroups[g];
+            float   tHit[kTriangleGroupSize];
+            int     mask = _IntersectTriangles<kTriangleGroupSize>(group.v0, group.e1, group.e2, group.n, ray, t_min, t_max, tHit);
+
+            for (int lane = 0; mask != 0; lane++, mask >>= 1)
+            {
+                if ((mask & 1) == 0 || group.hittables[lane] < 0)
+                    continue;
+                hits.emplace_back();
+                _FillTriangleHit(group.hittables[lane], ray, tHit[lane], hits.back());
+            }
+        }
+        return;
+    }
+    case HITTABLE_SPHERE:
+        return _HitAllHittables<CHittableSphere>(hittables, nHittables, ray, t_min, t_max, hits);
+    case HITTABLE_PLANE:
+        return _HitAllHittables<CHittablePlane>(hittables, nHittables, ray, t_min, t_max, hits);
+    case HITTABLE_MESH:
+        return _HitAllHittables<CHittableMesh>(hittables, nHittables, ray, t_min, t_max, hits);
+    case HITTABLE_INSTANCE:
+        return _HitAllHittables<CHittableInstance>(hittables, nHittables, ray, t_min, t_max, hits);
+    default:
+        return _HitAllHittables<IHittable>(hittables, nHittables, ray, t_min, t_max, hits);
+    }
+}
+
+//----------------------------------------------------
+
+// Any intersection among the hittables [offset, offset + nHittables). Nothing
+// is filled in, triangle groups only need a valid lane in the hit mask.
+bool    CBVHAccel::_OccludedLeaf(int offset, int nHittables, const CRay &ray, float t_min, float t_max) const
+{
+    const std::shared_ptr<IHittable>    *hittables = &m_hittables[offset];
+
+    switch (m_leafTypes.empty() ? HITTABLE_OTHER : (EHittableType)m_leafTypes[offset])
+    {
+    case HITTABLE_TRIANGLE:
+    {
+        if (m_triangleGroups.empty())
+            return _OccludedHittables<CHittableTriangle>(hittables, nHittables, ray, t_min, t_max);
+
+        for (int g = m_leafGroups[offset]; g < m_leafGroups[offset + nHittables]; g++)
+        {
+            const STriangleGroup    &group = m_triangleGroups[g];
+            float   tHit[kTriangleGroupSize];
+            int     mask = _IntersectTriangles<kTriangleGroupSize>(group.v0, group.e1, group.e2, group.n, ray, t_min, t_max, tHit);
+
+            for (int lane = 0; mask != 0; lane++, mask >>= 1)
+            {
+                if ((mask & 1) != 0 && group.hittables[lane] >= 0)
+                    return true;
+            }
+        }
+        return false;
+    }
+    case HITTABLE_SPHERE:
+        return _OccludedHittables<CHittableSphere>(hittables, nHittables, ray, t_min, t_max);
+    case HITTABLE_PLANE:
+        return _OccludedHittables<CHittablePlane>(hittables, nHittables, ray, t_min, t_max);
+    case HITTABLE_MESH:
+        return _OccludedHittables<CHittableMesh>(hittables, nHittables, ray, t_min, t_max);
+    case HITTABLE_INSTANCE:
+        return _OccludedHittables<CHittableInstance>(hittables, nHittables, ray, t_min, t_max);
+    default:
+        return _OccludedHittables<IHittable>(hittables, nHittables, ray, t_min, t_max);
+    }
+}
+
+//----------------------------------------------------
+
+// Calls onCrossing(t, isEntering) for every surface of the hittables
+// [offset, offset + nHittables) the ray crosses within [t_min, t_max]. A ray
+// enters against the hit normal, like SHitRec::frontFace.
+template <typename F>
+void    CBVHAccel::_CrossingsLeaf(int offset, int nHittables, const CRay &ray, float t_min, float t_max, F &&onCrossing) const
+{
+    if (!m_triangleGroups.empty() && !m_leafTypes.empty() && m_leafTypes[offset] == HITTABLE_TRIANGLE)
+    {
+        for (int g = m_leafGroups[offset]; g < m_leafGroups[offset + nHittables]; g++)
+        {
+            const STriangleGroup    &group = m_triangleGroups[g];
+            float   tHit[kTriangleGroupSize];
+            int     mask = _IntersectTriangles<kTriangleGroupSize>(group.v0, group.e1, group.e2, group.n, ray, t_min, t_max, tHit);
+
+            for (int lane = 0; mask != 0; lane++, mask >>= 1)
+            {
+                if ((mask & 1) == 0 || group.hittables[lane] < 0)
+                    continue;
+
+                // the group normal is cross(e1, e2), the opposite of CHittableTriangle::m_n
+                const glm::vec3 n(group.n[0][lane], group.n[1][lane], group.n[2][lane]);
+                onCrossing(tHit[lane], glm::dot(ray.m_dir, -n) < 0);
+            }
+        }
+        return;
+    }
+
+    VHits   hits;
+    _HitAllLeaf(offset, nHittables, ray, t_min, t_max, hits);
+    for (const SHitRec &hit : hits)
+        onCrossing(hit.t, hit.frontFace);
+}
+//----------------------------------------------------
+
+// Leaf of a packet traversal. Mesh leaves hand the packet on to the bvh-trees
+// of the meshes, other leaves trace every active ray that hits the leaf box.
+void    CBVHAccel::_HitPacketLeaf(const SLinearBVHNode &node, CRayPacket &packet, int first, SHitRec *hitRecs) const
+{
+    const int   offset = node.hittablesOffset;
+
+    if (!m_leafTypes.empty() && m_leafTypes[offset] == HITTABLE_MESH)
+    {
+        for (int i = offset; i < offset + node.nHittables; i++)
+            static_cast<CHittableMesh*>(m_hittables[i].get())->CHittableMesh::HitPacket(packet, first, hitRecs);
+        return;
+    }
+
+    for (int i = first & ~3; i < packet.Size(); i += 4)
+    {
+        int     mask = _IntersectPacket4(node.bounds, packet, i);
+        if (i < first)
+            mask &= ~((1 << (first - i)) - 1);
+
+        for (int lane = 0; mask != 0; lane++, mask >>= 1)
+        {
+            if ((mask & 1) && _HitLeaf(offset, node.nHittables, packet.m_rays[i + lane], packet.m_tMin, packet.m_tMax[i + lane], hitRecs[i + lane]))
+                packet.m_isHit[i + lane] = 1;
+        }
+    }
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_HitAllPacketLeaf(const SLinearBVHNode &node, CRayPacket &packet, int first, VHits *hits) const
+{
+    const int   offset = node.hittablesOffset;
+
+    if (!m_leafTypes.empty() && m_leafTypes[offset] == HITTABLE_MESH)
+    {
+        for (int i = offset; i < offset + node.nHittables; i++)
+            static_cast<CHittableMesh*>(m_hittables[i].get())->CHittableMesh::HitAllPacket(packet, first, hits);
+        return;
+    }
+
+    for (int i = first & ~3; i < packet.Size(); i += 4)
+    {
+        int     mask = _IntersectPacket4(node.bounds, packet, i);
+        if (i < first)
+            mask &= ~((1 << (first - i)) - 1);
+
+        for (int lane = 0; mask != 0; lane++, mask >>= 1)
+        {
+            if (mask & 1)
+                _HitAllLeaf(offset, node.nHittables, packet.m_rays[i + lane], packet.m_tMin, packet.m_tMax[i + lane], hits[i + lane]);
+        }
+    }
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_FillTriangleHit(int index, const CRay &ray, float t, SHitRec &hitRec) const
+{
+    const CHittableTriangle *triangle = static_cast<const CHittableTriangle*>(m_hittables[index].get());
+
+    hitRec.t = t;
+    hitRec.p = ray.At(t);
+    hitRec.n = triangle->m_n;
+    hitRec.setFaceNormal(ray);
+    hitRec.p_hittable = m_hittables[index];
+    hitRec.p_material = triangle->m_material;
+}
+
+//----------------------------------------------------
+
+// Tags every leaf with the type of its hittables and packs the triangles of
+// triangle leaves into groups of kTriangleGroupSize lanes. Needs the float
+// nodes, so it runs before quantization.
+void    CBVHAccel::_PackLeaves()
+{
+    m_triangleGroups.clear();
+    m_leafGroups.clear();
+    m_leafTypes.clear();
+
+    if (m_nodes == nullptr || m_hittables.empty())
+        return;
+
+    // leaves in hittable order; every layout shares the binary leaf ranges
+    std::vector<std::pair<int, int>>    leaves;
+    for (int i = 0; i < m_nNodes; i++)
+    {
+        if (m_nodes[i].nHittables > 0)
+            leaves.emplace_back(m_nodes[i].hittablesOffset, m_nodes[i].nHittables);
+    }
+    std::sort(leaves.begin(), leaves.end());
+
+    std::vector<uint8_t>    leafTypes(m_hittables.size(), HITTABLE_OTHER);
+    std::vector<int>        leafGroups(m_hittables.size() + 1, 0);
+    std::vector<int>        leafFirstGroup(leaves.size());
+    int                     nGroups = 0;
+    int                     end = 0;
+    for (size_t l = 0; l < leaves.size(); l++)
+    {
+        const int   offset = leaves[l].first;
+        const int   nHittables = leaves[l].second;
+
+        // the leaf ranges tile m_hittables, otherwise there is no leaf order to pack in
+        if (offset != end)
+            return;
+        end = offset + nHittables;
+
+        EHittableType   type = m_hittables[offset]->Type();
+        for (int i = offset + 1; i < end && type != HITTABLE_OTHER; i++)
+        {
+            if (m_hittables[i]->Type() != type)
+                type = HITTABLE_OTHER;
+        }
+        leafTypes[offset] = type;
+
+        leafFirstGroup[l] = nGroups;
+        for (int i = offset; i < end; i++)
+            leafGroups[i] = nGroups;
+        if (type == HITTABLE_TRIANGLE && m_setting.packTriangles)
+            nGroups += (nHittables + kTriangleGroupSize - 1) / kTriangleGroupSize;
+    }
+    if (end != (int)m_hittables.size())
+        return;
+    leafGroups[end] = nGroups;
+
+    m_leafTypes.swap(leafTypes);
+    if (nGroups == 0)
+        return;
+
+    std::vector<STriangleGroup> triangleGroups(nGroups);
+
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int l = 0; l < (int)leaves.size(); l++)
+    {
+        const int   offset = leaves[l].first;
+        const int   nHittables = leaves[l].second;
+        const int   firstGroup = leafFirstGroup[l];
+        if (leafGroups[offset + nHittables] == firstGroup)
+            continue;
+
+        for (int i = 0; i < nHittables; i++)
+        {
+            const CHittableTriangle *triangle = static_cast<const CHittableTriangle*>(m_hittables[offset + i].get());
+            STriangleGroup  &group = triangleGroups[firstGroup + i / kTriangleGroupSize];
+            const int       lane = i % kTriangleGroupSize;
+            const glm::vec3 e1 = triangle->m_v1 - triangle->m_v0;
+            const glm::vec3 e2 = triangle->m_v2 - triangle->m_v0;
+            const glm::vec3 n = glm::cross(e1, e2);
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                group.v0[axis][lane] = triangle->m_v0[axis];
+                group.e1[axis][lane] = e1[axis];
+                group.e2[axis][lane] = e2[axis];
+                group.n[axis][lane] = n[axis];
+            }
+            group.hittables[lane] = offset + i;
+        }
+
+        // empty lanes are degenerate and masked out by their index
+        for (int i = nHittables; i % kTriangleGroupSize != 0; i++)
+        {
+            STriangleGroup  &group = triangleGroups[firstGroup + i / kTriangleGroupSize];
+            const int       lane = i % kTriangleGroupSize;
+            for (int axis = 0; axis < 3; axis++)
+                group.v0[axis][lane] = group.e1[axis][lane] = group.e2[axis][lane] = group.n[axis][lane] = 0;
+            group.hittables[lane] = -1;
+        }
+    }
+
+    m_triangleGroups.swap(triangleGroups);
+    m_leafGroups.swap(leafGroups);
+}
+
+//----------------------------------------------------
+
+// Picks the kernel of the node layout the tree was built with
+template <typename Q>
+void    CBVHAccel::_Traverse(const CRay &ray, float t_min, float t_max, Q &query) const
+{
+    if (this->IsEmpty())
+        return;
+
+    if (m_quantizedNodes8)
+        _TraverseQuantized(m_quantizedNodes8.get(), ray, t_min, t_max, query);
+    else if (m_quantizedNodes16)
+        _TraverseQuantized(m_quantizedNodes16.get(), ray, t_min, t_max, query);
+    else if (m_wideNodes8)
+        _TraverseWide(m_wideNodes8.get(), ray, t_min, t_max, query);
+    else if (m_wideNodes4)
+        _TraverseWide(m_wideNodes4.get(), ray, t_min, t_max, query);
+    else
+        _TraverseBinary(ray, t_min, t_max, query);
+}
+
+//----------------------------------------------------
+
+template <typename Q>
+void    CBVHAccel::_TraverseBinary(const CRay &ray, float t_min, float t_max, Q &query) const
+{
+    CTraversalRay   traversalRay(ray, t_min, t_max);
+
+    // follow ray through BVH nodes to find primitive intersections
+    int     toVisitOffset = 0;
+    int     currentNodeIndex = 0;
+    int     nodesToVisit[64];
+
+    while (true) {
+        const SLinearBVHNode    *node = &m_nodes[currentNodeIndex];
+
+        if (m_visitCounts)
+            m_visitCounts[currentNodeIndex].fetch_add(1, std::memory_order_relaxed);
+
+        // check ray against BVH node, nodes behind the closest hit are culled
+        if (node->bounds.Hit(traversalRay)) {
+            if (node->nHittables > 0)
+            {
+                // intersect ray with primitives in leaf BVH node
+                if (query.Leaf(*this, node->hittablesOffset, node->nHittables, ray, t_min, traversalRay.m_tMax))
+                    return;
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else 
+            {
+                // put far BVH node on nodesToVisit stack, advance to near node
+                if (traversalRay.m_dirIsNeg[node->axis])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+}
+
+//----------------------------------------------------
+
+// Ordered queries push the hit children far to near, leaves included, and
+// test a leaf when it is popped. Unordered queries test the leaves right away
+// and only push the interior children.
+template <int N, typename Q>
+void    CBVHAccel::_TraverseWide(const SWideBVHNode<N> *nodes, const CRay &ray, float t_min, float t_max, Q &query) const
+{
+    struct SStackEntry
+    {
+        int     index;          // node index or hittable offset
+        int     nHittables;     // 0 -> interior node
+        float   tNear;
+    };
+
+    CTraversalRay   traversalRay(ray, t_min, t_max);
+
+    int             toVisitOffset = 0;
+    SStackEntry     nodesToVisit[_BVH_WIDE_STACK_DEPTH * (N - 1) + 1];
+    nodesToVisit[toVisitOffset++] = { 0, 0, t_min };
+
+    while (toVisitOffset > 0)
+    {
+        const SStackEntry   entry = nodesToVisit[--toVisitOffset];
+
+        if constexpr (Q::kIsOrdered)
+        {
+            // a closer hit was found since this entry was pushed
+            if (entry.tNear > traversalRay.m_tMax)
+                continue;
+
+            if (entry.nHittables > 0)
+            {
+                if (query.Leaf(*this, entry.index, entry.nHittables, ray, t_min, traversalRay.m_tMax))
+                    return;
+                continue;
+            }
+        }
+
+        if (m_wideVisitCounts)
+            m_wideVisitCounts[entry.index].fetch_add(1, std::memory_order_relaxed);
+
+        // test all children at once
+        const SWideBVHNode<N>   &node = nodes[entry.index];
+        float   tNear[N];
+        int     mask = _IntersectBoxes<N>(&node.bounds[0][0], N, traversalRay, tNear);
+
+        if constexpr (Q::kIsOrdered)
+        {
+            int     nHit = 0;
+            int     order[N];
+            for (; mask != 0; mask &= mask - 1)
+            {
+                int     child = 0;
+                while (((mask >> child) & 1) == 0)
+                    child++;
+
+                // insertion sort by entry distance, nearest last
+                int     j = nHit++;
+                for (; j > 0 && tNear[order[j - 1]] < tNear[child]; j--)
+                    order[j] = order[j - 1];
+                order[j] = child;
+            }
+
+            for (int i = 0; i < nHit; i++)
+                nodesToVisit[toVisitOffset++] = { node.children[order[i]], node.nHittables[order[i]], tNear[order[i]] };
+        }
+        else
+        {
+            for (; mask != 0; mask &= mask - 1)
+            {
+                int     child = 0;
+                while (((mask >> child) & 1) == 0)
+                    child++;
+
+                if (node.nHittables[child] > 0)
+                {
+                    if (query.Leaf(*this, node.children[child], node.nHittables[child], ray, t_min, traversalRay.m_tMax))
+                        return;
+                }
+                else
+                    nodesToVisit[toVisitOffset++] = { node.children[child], 0, tNear[child] };
+            }
+        }
+    }
+}
+
+//----------------------------------------------------
+
+// Same visiting order as _TraverseWide(). The entries carry the decoded box
+// of their node, which the child offsets are relative to.
+template <typename T, typename Q>
+void    CBVHAccel::_TraverseQuantized(const SQuantizedBVHNode<T> *nodes, const CRay &ray, float t_min, float t_max, Q &query) const
+{
+    struct SStackEntry
+    {
+        int     index;          // node index or hittable offset
+        int     nHittables;     // 0 -> interior node
+        float   tNear;
+        CAABB   bounds;         // decoded bounds of the node
+    };
+
+    CTraversalRay   traversalRay(ray, t_min, t_max);
+
+    int             toVisitOffset = 0;
+    SStackEntry     nodesToVisit[_BVH_WIDE_STACK_DEPTH + 1];
+    nodesToVisit[toVisitOffset++] = { m_quantizedRootChild, m_quantizedRootHittables, t_min, m_quantizedRootBounds };
+
+    while (toVisitOffset > 0)
+    {
+        const SStackEntry   entry = nodesToVisit[--toVisitOffset];
+
+        if (Q::kIsOrdered && entry.tNear > traversalRay.m_tMax)
+            continue;
+
+        // only the root is pushed as a leaf by unordered queries
+        if (entry.nHittables > 0)
+        {
+            if (query.Leaf(*this, entry.index, entry.nHittables, ray, t_min, traversalRay.m_tMax))
+                return;
+            continue;
+        }
+
+        if (m_wideVisitCounts)
+            m_wideVisitCounts[entry.index].fetch_add(1, std::memory_order_relaxed);
+
+        // decode and test both children
+        const SQuantizedBVHNode<T>  &node = nodes[entry.index];
+        float   bounds[6][2];
+        float   tNear[2];
+        _DecodeQuantizedBounds(node.offsets, entry.bounds, bounds);
+        const int   mask = _IntersectBoxes<2>(&bounds[0][0], 2, traversalRay, tNear);
+
+        // far to near, unordered queries keep the child order
+        const int   near = Q::kIsOrdered ? ((tNear[1] < tNear[0]) ? 1 : 0) : 1;
+        for (int c : { 1 - near, near })
+        {
+            if ((mask & (1 << c)) == 0)
+                continue;
+
+            if (!Q::kIsOrdered && node.nHittables[c] > 0)
+            {
+                if (query.Leaf(*this, node.children[c], node.nHittables[c], ray, t_min, traversalRay.m_tMax))
+                    return;
+                continue;
+            }
+
+            const CAABB     childBounds(glm::vec3(bounds[0][c], bounds[1][c], bounds[2][c]), glm::vec3(bounds[3][c], bounds[4][c], bounds[5][c]));
+            nodesToVisit[toVisitOffset++] = { node.children[c], node.nHittables[c], tNear[c], childBounds };
+        }
+    }
+}
+//----------------------------------------------------
+
+void    CBVHAccel::Clear()
+{
+    m_hittables.clear();
+    m_nodes.reset();
+    m_cacheFile.reset();
+    m_nNodes = 0;
+    m_wideNodes4.reset();
+    m_wideNodes8.reset();
+    m_nWideNodes = 0;
+    m_quantizedNodes8.reset();
+    m_quantizedNodes16.reset();
+    m_nQuantizedNodes = 0;
+    m_triangleGroups.clear();
+    m_leafGroups.clear();
+    m_leafTypes.clear();
+    m_visitCounts.reset();
+    m_wideVisitCounts.reset();
+}
+
+//----------------------------------------------------
+
+bool    CBVHAccel::Refit()
+{
+    if (this->IsEmpty())
+        return true;
+
+    // the float bounds of quantized trees are gone
+    if (m_nodes == nullptr)
+        return false;
+
+    // children are always stored after their parent, so a backwards pass
+    // visits every node after its children.
+    for (int i = m_nNodes - 1; i >= 0; i--)
+    {
+        SLinearBVHNode  *node = &m_nodes[i];
+
+        if (node->nHittables > 0)
+        {
+            CAABB   bounds;
+            for (int j = 0; j < node->nHittables; j++)
+                bounds = bounds + m_hittables[node->hittablesOffset + j]->m_aabb;
+            node->bounds = bounds;
+        }
+        else
+            node->bounds = m_nodes[i + 1].bounds + m_nodes[node->secondChildOffset].bounds;
+    }
+
+    // the wide tree and the packed triangles hold copies of the geometry.
+    // the wide nodes are refitted in place to keep their layout (Relayout).
+    if (m_wideNodes4)
+        _RefitWideTree(m_wideNodes4.get());
+    else if (m_wideNodes8)
+        _RefitWideTree(m_wideNodes8.get());
+    _PackLeaves();
+
+    return GetSAHCost() <= m_buildSAHCost * m_setting.refitRebuildRatio;
+}
+
+//----------------------------------------------------
+
+// SAH cost of the tree relative to the root area, with the same unit costs
+// as the builder (1 per traversal step, 1 per hittable intersection).
+float   CBVHAccel::GetSAHCost() const
+{
+    if (m_nodes == nullptr)
+        return 0;
+
+    double  cost = 0;
+    for (int i = 0; i < m_nNodes; i++)
+    {
+        const SLinearBVHNode    *node = &m_nodes[i];
+        cost += node->bounds.SurfaceArea() * (node->nHittables > 0 ? node->nHittables : 1);
+    }
+
+    const float rootArea = m_nodes[0].bounds.SurfaceArea();
+    return (rootArea > 0) ? cost / rootArea : 0;
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::BeginProfile()
+{
+    auto    resetCounts = [](std::unique_ptr<std::atomic<uint32_t>[]> &counts, int nNodes) {
+        counts.reset(new std::atomic<uint32_t>[nNodes]);
+        for (int i = 0; i < nNodes; i++)
+            counts[i].store(0, std::memory_order_relaxed);
+    };
+
+    // the packet queries still traverse the binary nodes of a wide tree
+    if (m_nodes != nullptr)
+        resetCounts(m_visitCounts, m_nNodes);
+
+    const int   nWideNodes = (m_wideNodes4 || m_wideNodes8) ? m_nWideNodes : m_nQuantizedNodes;
+    if (nWideNodes > 0)
+        resetCounts(m_wideVisitCounts, nWideNodes);
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::EndProfile()
+{
+    auto    takeCounts = [](std::unique_ptr<std::atomic<uint32_t>[]> &counts, int nNodes) {
+        std::vector<uint32_t>   visitCounts;
+        if (counts)
+        {
+            visitCounts.resize(nNodes);
+            for (int i = 0; i < nNodes; i++)
+                visitCounts[i] = counts[i].load(std::memory_order_relaxed);
+            counts.reset();
+        }
+        return visitCounts;
+    };
+
+    const int   nWideNodes = (m_wideNodes4 || m_wideNodes8) ? m_nWideNodes : m_nQuantizedNodes;
+    const std::vector<uint32_t> visitCounts = takeCounts(m_visitCounts, m_nNodes);
+    const std::vector<uint32_t> wideVisitCounts = takeCounts(m_wideVisitCounts, nWideNodes);
+
+    // an empty profile says nothing about the access pattern
+    if (!visitCounts.empty() && visitCounts[0] > 0)
+        Relayout(visitCounts.data());
+
+    if (wideVisitCounts.empty() || wideVisitCounts[0] == 0)
+        return;
+
+    if (m_wideNodes4)
+        _RelayoutNodes<4>(m_wideNodes4, m_nWideNodes, wideVisitCounts.data());
+    else if (m_wideNodes8)
+        _RelayoutNodes<8>(m_wideNodes8, m_nWideNodes, wideVisitCounts.data());
+    else if (m_quantizedNodes8)
+        _RelayoutNodes<2>(m_quantizedNodes8, m_nQuantizedNodes, wideVisitCounts.data());
+    else if (m_quantizedNodes16)
+        _RelayoutNodes<2>(m_quantizedNodes16, m_nQuantizedNodes, wideVisitCounts.data());
+
+    printf("[BVH] Relayout %d %s nodes by visit counts\n", nWideNodes, m_nQuantizedNodes > 0 ? "quantized" : "wide");
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::Relayout(const uint32_t *visitCounts)
+{
+    if (m_nodes == nullptr)
+        return;
+
+    // visit counts are indexed by the current layout, so a running profile is stale
+    m_visitCounts.reset();
+
+    auto    heat = [&](int index) {
+        return visitCounts ? (float)visitCounts[index] : m_nodes[index].bounds.SurfaceArea();
+    };
+
+    // chain heads by heat, ties broken by the depth-first index to stay deterministic
+    typedef std::pair<float, int>   SChainHead;
+    auto    isColder = [](const SChainHead &a, const SChainHead &b) {
+        return (a.first < b.first) || (a.first == b.first && a.second > b.second);
+    };
+    std::priority_queue<SChainHead, std::vector<SChainHead>, decltype(isColder)>    chainHeads(isColder);
+
+    // 1. new position of every node. a second child is only queued once its
+    // parent is placed, so children still come after their parent (Refit).
+    std::vector<int>    newIndex(m_nNodes);
+    int                 nPlaced = 0;
+
+    chainHeads.push({ heat(0), 0 });
+    while (!chainHeads.empty())
+    {
+        int     index = chainHeads.top().second;
+        chainHeads.pop();
+
+        while (true)
+        {
+            newIndex[index] = nPlaced++;
+            if (m_nodes[index].nHittables > 0)
+                break;
+
+            const int   secondChild = m_nodes[index].secondChildOffset;
+            chainHeads.push({ heat(secondChild), secondChild });
+            index++;
+        }
+    }
+
+    // 2. move the nodes
+    std::unique_ptr<SLinearBVHNode[], SAlignedDeleter>  nodes(AllocAligned<SLinearBVHNode>(m_nNodes));
+
+#pragma omp parallel for
+    for (int i = 0; i < m_nNodes; i++)
+    {
+        SLinearBVHNode  &node = nodes[newIndex[i]];
+        node = m_nodes[i];
+        if (node.nHittables == 0)
+            node.secondChildOffset = newIndex[node.secondChildOffset];
+    }
+
+    m_nodes = std::move(nodes);
+    m_cacheFile.reset();
+
+    printf("[BVH] Relayout %d nodes by %s\n", m_nNodes, visitCounts ? "visit counts" : "surface area");
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SStats   CBVHAccel::GetStats(bool computeEPO) const
+{
+    SStats  stats;
+    if (this->IsEmpty())
+        return stats;
+
+    // quantized trees only report their memory
+    if (m_nodes == nullptr)
+    {
+        stats.nodeBytes = m_nQuantizedNodes * (m_quantizedNodes8 ? sizeof(SQuantizedBVHNode<uint8_t>) : sizeof(SQuantizedBVHNode<uint16_t>));
+        stats.hittableBytes = m_hittables.size() * sizeof(std::shared_ptr<IHittable>);
+        stats.packedTriangleBytes = m_triangleGroups.size() * sizeof(STriangleGroup) + m_leafGroups.size() * sizeof(int) + m_leafTypes.size();
+        return stats;
+    }
+
+    stats.nNodes = m_nNodes;
+    stats.sahCost = GetSAHCost();
+    stats.nodeBytes = m_nNodes * sizeof(SLinearBVHNode);
+    stats.nWideNodes = m_nWideNodes;
+    stats.wideNodeBytes = m_nWideNodes * (m_wideNodes8 ? sizeof(SWideBVHNode<8>) : sizeof(SWideBVHNode<4>));
+    stats.hittableBytes = m_hittables.size() * sizeof(std::shared_ptr<IHittable>);
+    stats.packedTriangleBytes = m_triangleGroups.size() * sizeof(STriangleGroup) + m_leafGroups.size() * sizeof(int) + m_leafTypes.size();
+
+    // depth-first walk, the root is at depth 0
+    double                              depthSum = 0;
+    std::vector<std::pair<int, int>>    stack = { { 0, 0 } };
+    while (!stack.empty())
+    {
+        const auto  [index, depth] = stack.back();
+        stack.pop_back();
+
+        const SLinearBVHNode    *node = &m_nodes[index];
+        stats.maxDepth = std::max(stats.maxDepth, depth);
+
+        if (node->nHittables > 0)
+        {
+            if ((int)stats.leafSizeHistogram.size() <= node->nHittables)
+                stats.leafSizeHistogram.resize(node->nHittables + 1, 0);
+            stats.leafSizeHistogram[node->nHittables]++;
+            stats.nLeaves++;
+            stats.nReferences += node->nHittables;
+            depthSum += depth;
+        }
+        else
+        {
+            stats.nInteriors++;
+            stack.push_back({ node->secondChildOffset, depth + 1 });
+            stack.push_back({ index + 1, depth + 1 });
+        }
+    }
+    stats.avgLeafDepth = (stats.nLeaves > 0) ? depthSum / stats.nLeaves : 0;
+
+    if (computeEPO)
+        stats.epo = _ComputeEPO();
+
+    return stats;
+}
+
+//----------------------------------------------------
+
+std::string CBVHAccel::SStats::ToJson() const
+{
+    char    buffer[1024];
+    snprintf(buffer, sizeof(buffer),
+        "{\n"
+        "  \"accel\": \"bvh\",\n"
+        "  \"nodes\": %d,\n"
+        "  \"interiors\": %d,\n"
+        "  \"leaves\": %d,\n"
+        "  \"references\": %d,\n"
+        "  \"maxDepth\": %d,\n"
+        "  \"avgLeafDepth\": %.3f,\n"
+        "  \"sahCost\": %.4f,\n"
+        "  \"epo\": %.4f,\n"
+        "  \"nodeBytes\": %zu,\n"
+        "  \"wideNodes\": %d,\n"
+        "  \"wideNodeBytes\": %zu,\n"
+        "  \"hittableBytes\": %zu,\n"
+        "  \"packedTriangleBytes\": %zu,\n"
+        "  \"leafSizeHistogram\": [",
+        nNodes, nInteriors, nLeaves, nReferences, maxDepth, avgLeafDepth, sahCost, epo, nodeBytes, nWideNodes, wideNodeBytes, hittableBytes, packedTriangleBytes);
+
+    std::string json = buffer;
+    for (size_t i = 0; i < leafSizeHistogram.size(); i++)
+        json += (i > 0 ? ", " : "") + std::to_string(leafSizeHistogram[i]);
+    json += "]\n}\n";
+
+    return json;
+}
+
+//----------------------------------------------------
+
+bool    CBVHAccel::WriteStats(const std::string &path, bool computeEPO) const
+{
+    FILE    *file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+    {
+        printf("[BVH] Error: Failed to open \"%s\" for writing.\n", path.c_str());
+        return false;
+    }
+
+    const std::string   json = GetStats(computeEPO).ToJson();
+    const bool          isWritten = fwrite(json.data(), 1, json.size(), file) == json.size();
+    fclose(file);
+
+    return isWritten;
+}
+
+//----------------------------------------------------
+
+// Effective parent overlap, "On Quality Metrics of Bounding Volume
+// Hierarchies" (Aila et al. 2013): the surface area of geometry outside a
+// node's subtree that lies inside its box, weighted by the node cost and
+// relative to the total surface area. Hittable bounding boxes stand in for
+// the actual surfaces, so the value is an upper-bound style approximation.
+float   CBVHAccel::_ComputeEPO() const
+{
+    double  totalArea = 0;
+    for (const auto &hittable : m_hittables)
+        totalArea += hittable->m_aabb.SurfaceArea();
+
+    if (totalArea <= 0)
+        return 0;
+
+    double  epo = 0;
+
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:epo)
+    for (int i = 0; i < m_nNodes; i++)
+    {
+        const SLinearBVHNode    *node = &m_nodes[i];
+        const CAABB             &bounds = node->bounds;
+        const float             nodeCost = (node->nHittables > 0) ? node->nHittables : 1;
+
+        // query the tree with the node box, skipping the node's own subtree
+        double              overlap = 0;
+        std::vector<int>    stack = { 0 };
+        while (!stack.empty())
+        {
+            const int               index = stack.back();
+            const SLinearBVHNode    *other = &m_nodes[index];
+            stack.pop_back();
+
+            if (index == i || !other->bounds.Overlaps(bounds))
+                continue;
+
+            if (other->nHittables > 0)
+            {
+                for (int j = 0; j < other->nHittables; j++)
+                {
+                    const CAABB &hittableBounds = m_hittables[other->hittablesOffset + j]->m_aabb;
+                    if (hittableBounds.Overlaps(bounds))
+                        overlap += (hittableBounds - bounds).SurfaceArea();
+                }
+            }
+            else
+            {
+                stack.push_back(other->secondChildOffset);
+                stack.push_back(index + 1);
+            }
+        }
+
+        epo += nodeCost * overlap;
+    }
+
+    return epo / totalArea;
+}
+
+//----------------------------------------------------
+
+bool   CBVHAccel:: _BuildTree()
+{
+    if (m_hittables.size() == 0)
+        return true;
+
+    // 0. try the cache first
+    std::string     cachePath;
+    uint64_t        cacheKey = 0;
+
+    if (!m_setting.cacheDirectory.empty())
+    {
+        char    fileName[32];
+        cacheKey = _ComputeCacheKey();
+        snprintf(fileName, sizeof(fileName), "%016llx.bvh", (unsigned long long)cacheKey);
+        cachePath = m_setting.cacheDirectory + "/" + fileName;
+
+        if (_LoadCache(cachePath, cacheKey))
+        {
+            printf("[BVH] Loaded bvh-tree from cache \"%s\"\n", cachePath.c_str());
+            _BuildWideTree();
+            _PackLeaves();
+            _QuantizeTree();
+            return true;
+        }
+    }
+
+    // BVH-Tree construction
+    printf("[BVH] Start bvh-tree construction...\n");
+
+    // 1. initialize primitive info
+    std::vector<SHittableInfo>     hittableInfo(m_hittables.size());
+    for (size_t i = 0; i < hittableInfo.size(); i++)
+    {
+        hittableInfo[i] = { i, m_hittables[i]->m_aabb };
+    };
+
+    // 2. build BVH tree
+    // each leaf writes its hittables into the slots [start, end) of the range
+    // it was built from, so the ordering does not depend on the task schedule.
+    std::vector<std::shared_ptr<IHittable>>     orderedHittables(m_hittables.size());
+    SBVHBuildNode                               *root = nullptr;
+
+    m_buildArena = std::make_unique<CMemoryArena>(1024 * 1024);
+
+    if (m_setting.partitionMethod == SBVH)
+    {
+        // spatial splits duplicate references, so leaves are appended as they
+        // are created instead. this build runs serially.
+        int             nSplitBudget = (int)(m_hittables.size() * std::max(0.f, m_setting.sbvhMaxGrowth - 1.f));
+        const float     rootArea = std::accumulate(hittableInfo.begin(), hittableInfo.end(), CAABB(),
+                                    [](const CAABB &b, const SHittableInfo &h) { return b + h.bounds; }).SurfaceArea();
+
+        orderedHittables.clear();
+        root = _RecursiveBuildSBVH(hittableInfo, 0, rootArea, nSplitBudget, orderedHittables);
+        printf("[BVH] SBVH references: %zu (%zu hittables)\n", orderedHittables.size(), m_hittables.size());
+    }
+    else if (m_setting.partitionMethod == LBVH)
+    {
+        root = _BuildLBVH(hittableInfo, orderedHittables);
+    }
+    else
+    {
+#pragma omp parallel
+#pragma omp single
+        root = _RecursiveBuild(hittableInfo, 0, m_hittables.size(), orderedHittables);
+    }
+
+    m_hittables.swap(orderedHittables);
+    std::vector<SHittableInfo>().swap(hittableInfo);
+
+    // 3. optionally restructure treelets into their SAH-optimal topology
+    if (m_setting.treeletPasses > 0 && root->nHittables == 0)
+    {
+        const float rootArea = root->bounds.SurfaceArea();
+        const float costBefore = _ComputeSubtreeCost(root);
+
+        for (int pass = 0; pass < m_setting.treeletPasses; pass++)
+        {
+#pragma omp parallel
+#pragma omp single
+            _OptimizeTreelets(root);
+        }
+
+        if (rootArea > 0)
+            printf("[BVH] Treelet optimization: SAH cost %.2f -> %.2f\n", costBefore / rootArea, root->sahCost / rootArea);
+    }
+    
+    // 4. compute representation of depth-first traversal
+    m_nNodes = root->nNodes;
+    m_nodes = std::unique_ptr<SLinearBVHNode[], SAlignedDeleter>(AllocAligned<SLinearBVHNode>(m_nNodes));
+
+#pragma omp parallel
+#pragma omp single
+    _FlattenBVHTree(root, 0);
+
+    // the build nodes are not needed anymore, release them in one go
+    m_buildArena.reset();
+
+    m_buildSAHCost = GetSAHCost();
+
+    // 5. collapse into a wide tree
+    _BuildWideTree();
+
+    if (this->IsEmpty())
+    {
+        printf("[BVH] Error: Failed to construct bvh-tree.\n");
+        return false;
+    }
+
+    const SStats    stats = GetStats(false);
+    printf("[BVH] Done. nodes: %d, leaves: %d, max depth: %d, avg. leaf depth: %.1f, SAH cost: %.2f\n",
+            stats.nNodes, stats.nLeaves, stats.maxDepth, stats.avgLeafDepth, stats.sahCost);
+
+    // "orderedHittables" holds the input order after the swap
+    if (!cachePath.empty() && !_SaveCache(cachePath, cacheKey, orderedHittables))
+        printf("[BVH] Warn: Failed to write cache \"%s\"\n", cachePath.c_str());
+
+    // 6. quantize last, the cache and the triangle packing read the float nodes
+    _PackLeaves();
+    _QuantizeTree();
+
+    return true;
+}
+
+//----------------------------------------------------
+
+uint64_t    CBVHAccel::_ComputeCacheKey() const
+{
+    auto    hashValue = [](uint64_t hash, auto value) { return HashBytes(&value, sizeof(value), hash); };
+
+    uint64_t    hash = hashValue(HashBytes(nullptr, 0), _BVH_CACHE_VERSION);
+    hash = hashValue(hash, (uint32_t)sizeof(SLinearBVHNode));
+
+    // every setting except the cache directory
+    hash = hashValue(hash, m_setting.maxHittablesInNode);
+    hash = hashValue(hash, (int)m_setting.partitionMethod);
+    hash = hashValue(hash, m_setting.nBuckets);
+    hash = hashValue(hash, m_setting.nFullSweepThreshold);
+    hash = hashValue(hash, m_setting.typedLeaves);
+    hash = hashValue(hash, m_setting.sbvhAlpha);
+    hash = hashValue(hash, m_setting.sbvhMaxGrowth);
+    hash = hashValue(hash, m_setting.lbvhMortonBits);
+    hash = hashValue(hash, m_setting.lbvhUpperSAH);
+    hash = hashValue(hash, m_setting.treeletPasses);
+    hash = hashValue(hash, m_setting.treeletSize);
+
+    hash = hashValue(hash, (uint64_t)m_hittables.size());
+    for (const auto &hittable : m_hittables)
+        hash = hashValue(hittable->HashGeometry(hash), hittable->Type());
+
+    return hash;
+}
+
+//----------------------------------------------------
+
+bool    CBVHAccel::_LoadCache(const std::string &path, uint64_t key)
+{
+    auto    file = std::make_unique<CMappedFile>();
+    if (!file->Open(path) || file->Size() < sizeof(SBVHCacheHeader))
+        return false;
+
+    const SBVHCacheHeader   *header = reinterpret_cast<const SBVHCacheHeader*>(file->Data());
+    const size_t            expectedSize = sizeof(SBVHCacheHeader) + (size_t)header->nNodes * sizeof(SLinearBVHNode) + (size_t)header->nReferences * sizeof(int32_t);
+
+    if (memcmp(header->magic, "CDBV", 4) != 0 || header->version != _BVH_CACHE_VERSION || header->key != key ||
+        header->nodeSize != sizeof(SLinearBVHNode) || header->nHittables != (int)m_hittables.size() ||
+        header->nNodes <= 0 || header->nReferences < 0 || file->Size() != expectedSize)
+    {
+        printf("[BVH] Warn: Ignoring invalid cache \"%s\"\n", path.c_str());
+        return false;
+    }
+
+    // the nodes are used in place, the mapping is copy-on-write so Refit() still works
+    SLinearBVHNode  *nodes = reinterpret_cast<SLinearBVHNode*>(file->Data() + sizeof(SBVHCacheHeader));
+    const int32_t   *indices = reinterpret_cast<const int32_t*>(nodes + header->nNodes);
+
+    // a stale or damaged cache must not send the traversal out of bounds
+    for (int i = 0; i < header->nNodes; i++)
+    {
+        const SLinearBVHNode    &node = nodes[i];
+        const bool              isValid = (node.nHittables > 0) ? (node.hittablesOffset >= 0 && node.hittablesOffset + node.nHittables <= header->nReferences)
+                                                                : (node.secondChildOffset > i + 1 && node.secondChildOffset < header->nNodes && node.axis < 3);
+        if (!isValid)
+        {
+            printf("[BVH] Warn: Ignoring invalid cache \"%s\"\n", path.c_str());
+            return false;
+        }
+    }
+
+    std::vector<std::shared_ptr<IHittable>>     orderedHittables(header->nReferences);
+    for (int i = 0; i < header->nReferences; i++)
+    {
+        if (indices[i] < 0 || indices[i] >= header->nHittables)
+            return false;
+        orderedHittables[i] = m_hittables[indices[i]];
+    }
+
+    m_hittables.swap(orderedHittables);
+    m_nNodes = header->nNodes;
+    m_buildSAHCost = header->buildSAHCost;
+    m_nodes = std::unique_ptr<SLinearBVHNode[], SAlignedDeleter>(nodes, SAlignedDeleter{ false });
+    m_cacheFile = std::move(file);
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CBVHAccel::_SaveCache(const std::string &path, uint64_t key, const std::vector<std::shared_ptr<IHittable>> &inputHittables) const
+{
+    // primitive ordering as indices into the input hittables
+    std::unordered_map<const IHittable*, int32_t>   inputIndex;
+    inputIndex.reserve(inputHittables.size());
+    for (size_t i = 0; i < inputHittables.size(); i++)
+        inputIndex.emplace(inputHittables[i].get(), (int32_t)i);
+
+    std::vector<int32_t>    indices(m_hittables.size());
+    for (size_t i = 0; i < m_hittables.size(); i++)
+        indices[i] = inputIndex[m_hittables[i].get()];
+
+    SBVHCacheHeader     header = {};
+    memcpy(header.magic, "CDBV", 4);
+    header.version = _BVH_CACHE_VERSION;
+    header.key = key;
+    header.nodeSize = sizeof(SLinearBVHNode);
+    header.nNodes = m_nNodes;
+    header.nReferences = (int32_t)indices.size();
+    header.nHittables = (int32_t)inputHittables.size();
+    header.buildSAHCost = m_buildSAHCost;
+
+    // write to a temporary file first, so that concurrent readers never see a
+    // partial cache. the rename replaces a file another process wrote for the
+    // same key, which is harmless as both hold the same tree (on Windows the
+    // rename fails instead and the existing file is kept).
+    const std::string   tmpPath = path + ".tmp" + std::to_string(std::random_device()());
+    FILE                *file = fopen(tmpPath.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    bool    isWritten = fwrite(&header, sizeof(header), 1, file) == 1;
+    isWritten = isWritten && fwrite(m_nodes.get(), sizeof(SLinearBVHNode), m_nNodes, file) == (size_t)m_nNodes;
+    isWritten = isWritten && fwrite(indices.data(), sizeof(int32_t), indices.size(), file) == indices.size();
+    isWritten = (fclose(file) == 0) && isWritten;
+
+    if (!isWritten || std::rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmpPath.c_str());
+        return isWritten;
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_RecursiveBuild(std::vector<SHittableInfo> &bvHHittableInfo, int start, int end, std::vector<std::shared_ptr<IHittable>> &orderedHittables)
+{
+    // create node
+    SBVHBuildNode   *node = _AllocBuildNode();
+    
+    // compute bounds for all hittables in BVH node, and bound of hittable centroids
+    CAABB   topBound, centroidBounds;
+    _ComputeRangeBounds(bvHHittableInfo, start, end, topBound, centroidBounds);
+    
+    int nHittables = end - start;
+
+    if (nHittables == 1)
+    {
+        // create leaf node
+        _InitLeaf(node, bvHHittableInfo, start, end, topBound, orderedHittables);
+        return node;
+    }
+    else
+    {
+        // choose split dimension dim
+        // the split axis is chosen by axis with the largest extent
+        int dim = centroidBounds.MaxExtent();
+
+        // partition hittables into two sets and build children
+        int mid = (start + end) / 2;
+        if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+            // create leaf node
+            _InitLeaf(node, bvHHittableInfo, start, end, topBound, orderedHittables);
+            return node;
+        }
+        else 
+        {
+            // partition by method
+            switch (m_setting.partitionMethod) 
+            {
+                // partition hittables using midpoints
+            case MIDPOINT:
+            {
+                float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
+                SHittableInfo *midPtr =
+                    std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1, [dim, pmid](const SHittableInfo &pi) { return pi.centroid[dim] < pmid; });
+                mid = midPtr - &bvHHittableInfo[0];
+
+                // if there is too many overlapping boxes, it may fail to construct.
+                // in that case, we split using equally subset method.
+                if (mid != start && mid != end) break;
+            }
+            case EQUALSUBSET:
+            {
+                mid = (start + end) / 2;
+                std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
+                    [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; }
+                );
+                break;
+            }
+            case SAH:
+            default:
+            {
+                // find the cheapest split over all three axes. small ranges are
+                // swept exactly, bigger ones are binned.
+                const bool  isSweep = nHittables <= m_setting.nFullSweepThreshold;
+                SSAHSplit   split = isSweep ? _SweepSAHSplit(bvHHittableInfo, start, end, topBound)
+                                            : _FindBinnedSAHSplit(bvHHittableInfo, start, end, topBound, centroidBounds);
+
+                // Either create leaf or split primitives at selected SAH split
+                float   leafCost = nHittables;
+                if (nHittables <= m_setting.maxHittablesInNode && !(split.cost < leafCost))
+                {
+                    // a leaf that would mix hittable types is split by type instead
+                    if (!m_setting.typedLeaves || !_PartitionByType(bvHHittableInfo, start, end, mid))
+                    {
+                        _InitLeaf(node, bvHHittableInfo, start, end, topBound, orderedHittables);
+                        return node;
+                    }
+                }
+                else if (split.axis < 0)
+                {
+                    // no usable split (degenerate bounds), fall back to equally sized subsets
+                    mid = (start + end) / 2;
+                    std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
+                        [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; });
+                }
+                else if (isSweep)
+                {
+                    // the sweep left the range sorted along the split axis
+                    dim = split.axis;
+                    mid = start + split.index;
+                }
+                else
+                {
+                    dim = split.axis;
+                    const int   nBuckets = m_setting.nBuckets;
+                    SHittableInfo *pmid = std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1,
+                        [&](const SHittableInfo &pi) { return _BucketIndex(nBuckets, centroidBounds.Offset(pi.centroid)[dim]) <= split.index; });
+                    mid = pmid - &bvHHittableInfo[0];
+                }
+                break;
+            }}
+
+            // build nodes
+            // large subtrees are handed to other threads, the rest recurse in place
+            SBVHBuildNode   *children[2];
+            if (nHittables > _BVH_TASK_CUTOFF)
+            {
+#pragma omp task shared(children, bvHHittableInfo, orderedHittables)
+                children[0] = _RecursiveBuild(bvHHittableInfo, start, mid, orderedHittables);
+                children[1] = _RecursiveBuild(bvHHittableInfo, mid, end, orderedHittables);
+#pragma omp taskwait
+            }
+            else
+            {
+                children[0] = _RecursiveBuild(bvHHittableInfo, start, mid, orderedHittables);
+                children[1] = _RecursiveBuild(bvHHittableInfo, mid, end, orderedHittables);
+            }
+            node->InitInterior(dim, children[0], children[1]);
+        }
+    }
+
+    return node;
+};
+
+//----------------------------------------------------
+
+void    CBVHAccel::_ComputeRangeBounds(const std::vector<SHittableInfo> &hittableInfo, int start, int end, CAABB &bounds, CAABB &centroidBounds) const
+{
+    bounds = CAABB();
+    centroidBounds = CAABB();
+
+    const int   n = end - start;
+    if (n < _BVH_PARALLEL_RANGE)
+    {
+        for (int i = start; i < end; i++)
+        {
+            bounds = bounds + hittableInfo[i].bounds;
+            centroidBounds = centroidBounds + hittableInfo[i].centroid;
+        }
+        return;
+    }
+
+    // min/max are exact, so reducing per-chunk bounds gives the same result
+    const int           nChunks = (n + _BVH_CHUNK_SIZE - 1) / _BVH_CHUNK_SIZE;
+    std::vector<CAABB>  chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+
+#pragma omp taskloop shared(hittableInfo, chunkBounds, chunkCentroidBounds)
+    for (int c = 0; c < nChunks; c++)
+    {
+        const int   cEnd = std::min(end, start + (c + 1) * _BVH_CHUNK_SIZE);
+        for (int i = start + c * _BVH_CHUNK_SIZE; i < cEnd; i++)
+        {
+            chunkBounds[c] = chunkBounds[c] + hittableInfo[i].bounds;
+            chunkCentroidBounds[c] = chunkCentroidBounds[c] + hittableInfo[i].centroid;
+        }
+    }
+
+    for (int c = 0; c < nChunks; c++)
+    {
+        bounds = bounds + chunkBounds[c];
+        centroidBounds = centroidBounds + chunkCentroidBounds[c];
+    }
+}
+
+//----------------------------------------------------
+
+// Moves the hittables of the first hittable's type to the front of [start, end).
+// Returns false if the range holds a single type, and the split index otherwise.
+bool    CBVHAccel::_PartitionByType(std::vector<SHittableInfo> &hittableInfo, int start, int end, int &mid) const
+{
+    const EHittableType type = m_hittables[hittableInfo[start].hittableNum]->Type();
+    auto    isSameType = [&](const SHittableInfo &info) { return m_hittables[info.hittableNum]->Type() == type; };
+
+    if (std::all_of(&hittableInfo[start], &hittableInfo[end - 1] + 1, isSameType))
+        return false;
+
+    mid = std::stable_partition(&hittableInfo[start], &hittableInfo[end - 1] + 1, isSameType) - &hittableInfo[0];
+    return true;
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_InitLeaf(SBVHBuildNode *node, const std::vector<SHittableInfo> &hittableInfo, int start, int end, const CAABB &bounds, std::vector<std::shared_ptr<IHittable>> &orderedHittables) const
+{
+    // the hittables of [start, end) are in their final place, which is the
+    // same as appending them in depth-first order.
+    for (int i = start; i < end; i++)
+        orderedHittables[i] = m_hittables[hittableInfo[i].hittableNum];
+
+    node->InitLeaf(start, end - start, bounds);
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SSAHSplit    CBVHAccel::_FindBinnedSAHSplit(const std::vector<SHittableInfo> &hittableInfo, int start, int end, const CAABB &bounds, const CAABB &centroidBounds) const
+{
+    const int   nBuckets = m_setting.nBuckets;
+    const int   nHittables = end - start;
+
+    // bin the centroids along all three axes in a single pass
+    auto    binRange = [&](SBucketInfo *buckets, int from, int to) {
+        for (int i = from; i < to; i++)
+        {
+            const glm::vec3 offset = centroidBounds.Offset(hittableInfo[i].centroid);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                SBucketInfo &b = buckets[axis * nBuckets + _BucketIndex(nBuckets, offset[axis])];
+                b.count++;
+                b.bounds = b.bounds + hittableInfo[i].bounds;
+            }
+        }
+    };
+
+    std::vector<SBucketInfo>    buckets(3 * nBuckets);
+    if (nHittables < _BVH_PARALLEL_RANGE)
+    {
+        binRange(buckets.data(), start, end);
+    }
+    else
+    {
+        // bin each chunk separately, then merge. count and bounds union are
+        // order independent, so this matches the serial result.
+        const int   nChunks = (nHittables + _BVH_CHUNK_SIZE - 1) / _BVH_CHUNK_SIZE;
+        std::vector<SBucketInfo>    chunkBuckets(nChunks * 3 * nBuckets);
+
+#pragma omp taskloop shared(chunkBuckets, binRange)
+        for (int c = 0; c < nChunks; c++)
+            binRange(&chunkBuckets[c * 3 * nBuckets], start + c * _BVH_CHUNK_SIZE, std::min(end, start + (c + 1) * _BVH_CHUNK_SIZE));
+
+        for (int c = 0; c < nChunks; c++)
+        {
+            for (int b = 0; b < 3 * nBuckets; b++)
+            {
+                buckets[b].count += chunkBuckets[c * 3 * nBuckets + b].count;
+                buckets[b].bounds = buckets[b].bounds + chunkBuckets[c * 3 * nBuckets + b].bounds;
+            }
+        }
+    }
+
+    // sweep the buckets from both ends, so each axis costs O(nBuckets).
+    // split i puts buckets [0, i] on the left and the rest on the right.
+    SSAHSplit           best;
+    std::vector<float>  rightCost(nBuckets - 1);
+    std::vector<int>    rightCount(nBuckets - 1);
+    const float         invArea = 1.f / bounds.SurfaceArea();
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (centroidBounds.pMax[axis] == centroidBounds.pMin[axis])
+            continue;
+
+        const SBucketInfo   *b = &buckets[axis * nBuckets];
+
+        CAABB   rightBounds;
+        int     count = 0;
+        for (int i = nBuckets - 1; i > 0; i--)
+        {
+            rightBounds = rightBounds + b[i].bounds;
+            count += b[i].count;
+            rightCount[i - 1] = count;
+            rightCost[i - 1] = count > 0 ? count * rightBounds.SurfaceArea() : 0;
+        }
+
+        CAABB   leftBounds;
+        count = 0;
+        for (int i = 0; i < nBuckets - 1; i++)
+        {
+            leftBounds = leftBounds + b[i].bounds;
+            count += b[i].count;
+            if (count == 0 || rightCount[i] == 0)
+                continue;
+
+            const float cost = 1 + (count * leftBounds.SurfaceArea() + rightCost[i]) * invArea;
+            if (cost < best.cost)
+                best = { axis, i, cost };
+        }
+    }
+
+    return best;
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SSAHSplit    CBVHAccel::_SweepSAHSplit(std::vector<SHittableInfo> &hittableInfo, int start, int end, const CAABB &bounds) const
+{
+    const int   nHittables = end - start;
+
+    // sort the range along each axis and evaluate every split between two
+    // consecutive hittables. split i puts the first i hittables on the left.
+    SSAHSplit                   best;
+    std::vector<SHittableInfo>  sorted, bestSorted;
+    std::vector<float>          rightCost(nHittables);
+    const float                 invArea = 1.f / bounds.SurfaceArea();
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        sorted.assign(&hittableInfo[start], &hittableInfo[end - 1] + 1);
+        std::sort(sorted.begin(), sorted.end(),
+            [axis](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[axis] < b.centroid[axis]; });
+
+        CAABB   rightBounds;
+        for (int i = nHittables - 1; i > 0; i--)
+        {
+            rightBounds = rightBounds + sorted[i].bounds;
+            rightCost[i] = (nHittables - i) * rightBounds.SurfaceArea();
+        }
+
+        CAABB   leftBounds;
+        bool    isImproved = false;
+        for (int i = 1; i < nHittables; i++)
+        {
+            leftBounds = leftBounds + sorted[i - 1].bounds;
+
+            const float cost = 1 + (i * leftBounds.SurfaceArea() + rightCost[i]) * invArea;
+            if (cost < best.cost)
+            {
+                best = { axis, i, cost };
+                isImproved = true;
+            }
+        }
+
+        if (isImproved)
+            bestSorted.swap(sorted);
+    }
+
+    // leave the range ordered along the chosen axis
+    if (best.axis >= 0)
+        std::copy(bestSorted.begin(), bestSorted.end(), &hittableInfo[start]);
+
+    return best;
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_RecursiveBuildSBVH(std::vector<SHittableInfo> &refs, int depth, float rootArea, int &nSplitBudget, std::vector<std::shared_ptr<IHittable>> &orderedHittables)
+{
+    SBVHBuildNode   *node = _AllocBuildNode();
+    const int       nRefs = refs.size();
+
+    CAABB   bounds, centroidBounds;
+    _ComputeRangeBounds(refs, 0, nRefs, bounds, centroidBounds);
+
+    auto    initLeaf = [&]() {
+        const int   firstOffset = orderedHittables.size();
+        for (const SHittableInfo &ref : refs)
+            orderedHittables.push_back(m_hittables[ref.hittableNum]);
+        node->InitLeaf(firstOffset, nRefs, bounds);
+        return node;
+    };
+
+    if (nRefs == 1)
+        return initLeaf();
+
+    // 1. object split, same as SAH
+    SSAHSplit   objectSplit;
+    int         objectMid = -1;
+    CAABB       objectBounds[2];
+
+    if (centroidBounds.Diagonal() != glm::vec3(0))
+    {
+        if (nRefs <= m_setting.nFullSweepThreshold)
+        {
+            objectSplit = _SweepSAHSplit(refs, 0, nRefs, bounds);
+            objectMid = objectSplit.index;
+        }
+        else
+        {
+            objectSplit = _FindBinnedSAHSplit(refs, 0, nRefs, bounds, centroidBounds);
+            if (objectSplit.axis >= 0)
+            {
+                const int   nBuckets = m_setting.nBuckets;
+                const int   axis = objectSplit.axis;
+                objectMid = std::partition(refs.begin(), refs.end(), [&](const SHittableInfo &ref) {
+                    return _BucketIndex(nBuckets, centroidBounds.Offset(ref.centroid)[axis]) <= objectSplit.index; }) - refs.begin();
+            }
+        }
+
+        if (objectSplit.axis >= 0)
+        {
+            for (int i = 0; i < nRefs; i++)
+                objectBounds[i >= objectMid] = objectBounds[i >= objectMid] + refs[i].bounds;
+        }
+    }
+
+    // 2. spatial split, only where the object split children overlap noticeably
+    SSAHSplit   spatialSplit;
+    if (nSplitBudget > 0 && depth < _SBVH_MAX_SPATIAL_DEPTH)
+    {
+        const CAABB overlap = objectBounds[0] - objectBounds[1];
+        const float overlapArea = (objectSplit.axis < 0) ? bounds.SurfaceArea() :
+                                  overlap.IsEmpty() ? 0.f : overlap.SurfaceArea();
+
+        if (overlapArea > m_setting.sbvhAlpha * rootArea)
+            spatialSplit = _FindSpatialSplit(refs, bounds);
+    }
+
+    // 3. leaf, if that is cheaper than both splits
+    const float leafCost = nRefs;
+    const float splitCost = std::min(objectSplit.cost, spatialSplit.cost);
+    if (nRefs <= m_setting.maxHittablesInNode && !(splitCost < leafCost))
+    {
+        // a leaf that would mix hittable types is split by type instead
+        if (!m_setting.typedLeaves || !_PartitionByType(refs, 0, nRefs, objectMid))
+            return initLeaf();
+
+        objectSplit.axis = bounds.MaxExtent();
+        spatialSplit = SSAHSplit();
+    }
+
+    std::vector<SHittableInfo>  childRefs[2];
+    int                         axis;
+
+    if (spatialSplit.axis >= 0 && spatialSplit.cost < objectSplit.cost)
+    {
+        axis = spatialSplit.axis;
+
+        const int   nBins = m_setting.nBuckets;
+        const float pos = bounds.pMin[axis] + (spatialSplit.index + 1) * (bounds.pMax[axis] - bounds.pMin[axis]) / nBins;
+
+        for (const SHittableInfo &ref : refs)
+        {
+            if (ref.bounds.pMax[axis] <= pos)
+                childRefs[0].push_back(ref);
+            else if (ref.bounds.pMin[axis] >= pos)
+                childRefs[1].push_back(ref);
+            else
+            {
+                // straddling reference, clip it into both halves
+                CAABB   half[2] = { ref.bounds, ref.bounds };
+                half[0].pMax[axis] = pos;
+                half[1].pMin[axis] = pos;
+
+                const IHittable *hittable = m_hittables[ref.hittableNum].get();
+                const CAABB     clipped[2] = { hittable->ClipBounds(half[0]), hittable->ClipBounds(half[1]) };
+
+                if (nSplitBudget > 0 && !clipped[0].IsEmpty() && !clipped[1].IsEmpty())
+                {
+                    childRefs[0].push_back({ ref.hittableNum, clipped[0] });
+                    childRefs[1].push_back({ ref.hittableNum, clipped[1] });
+                    nSplitBudget--;
+                }
+                else
+                {
+                    // out of budget, or it only touches the plane: keep it whole
+                    const int   side = clipped[0].IsEmpty() ? 1 :
+                                       clipped[1].IsEmpty() ? 0 : (ref.centroid[axis] >= pos);
+                    childRefs[side].push_back(ref);
+                }
+            }
+        }
+
+        // clipping can leave a side empty in degenerate cases
+        if (childRefs[0].empty() || childRefs[1].empty())
+        {
+            std::vector<SHittableInfo>  all;
+            all.swap(childRefs[childRefs[0].empty() ? 1 : 0]);
+
+            const int   mid = all.size() / 2;
+            std::nth_element(all.begin(), all.begin() + mid, all.end(),
+                [axis](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[axis] < b.centroid[axis]; });
+            childRefs[0].assign(all.begin(), all.begin() + mid);
+            childRefs[1].assign(all.begin() + mid, all.end());
+        }
+    }
+    else if (objectSplit.axis >= 0)
+    {
+        axis = objectSplit.axis;
+        childRefs[0].assign(refs.begin(), refs.begin() + objectMid);
+        childRefs[1].assign(refs.begin() + objectMid, refs.end());
+    }
+    else
+    {
+        // all centroids coincide and spatial splits did not help, split equally
+        axis = bounds.MaxExtent();
+        childRefs[0].assign(refs.begin(), refs.begin() + nRefs / 2);
+        childRefs[1].assign(refs.begin() + nRefs / 2, refs.end());
+    }
+
+    // the references now live in the children
+    std::vector<SHittableInfo>().swap(refs);
+
+    SBVHBuildNode   *c0 = _RecursiveBuildSBVH(childRefs[0], depth + 1, rootArea, nSplitBudget, orderedHittables);
+    SBVHBuildNode   *c1 = _RecursiveBuildSBVH(childRefs[1], depth + 1, rootArea, nSplitBudget, orderedHittables);
+    node->InitInterior(axis, c0, c1);
+
+    return node;
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SSAHSplit    CBVHAccel::_FindSpatialSplit(const std::vector<SHittableInfo> &refs, const CAABB &bounds) const
+{
+    // bin the node bounds uniformly. a reference is clipped into every bin it
+    // overlaps, and counted as entering its first bin and exiting its last.
+    const int   nBins = m_setting.nBuckets;
+
+    std::vector<CAABB>  binBounds(nBins);
+    std::vector<int>    nEnter(nBins), nExit(nBins);
+    std::vector<float>  rightCost(nBins - 1);
+    std::vector<int>    rightCount(nBins - 1);
+    const float         invArea = 1.f / bounds.SurfaceArea();
+    SSAHSplit           best;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float extent = bounds.pMax[axis] - bounds.pMin[axis];
+        if (extent <= 0)
+            continue;
+
+        std::fill(binBounds.begin(), binBounds.end(), CAABB());
+        std::fill(nEnter.begin(), nEnter.end(), 0);
+        std::fill(nExit.begin(), nExit.end(), 0);
+
+        for (const SHittableInfo &ref : refs)
+        {
+            const int   first = _BucketIndex(nBins, (ref.bounds.pMin[axis] - bounds.pMin[axis]) / extent);
+            const int   last = _BucketIndex(nBins, (ref.bounds.pMax[axis] - bounds.pMin[axis]) / extent);
+
+            nEnter[first]++;
+            nExit[last]++;
+
+            if (first == last)
+            {
+                binBounds[first] = binBounds[first] + ref.bounds;
+                continue;
+            }
+
+            const IHittable *hittable = m_hittables[ref.hittableNum].get();
+            for (int b = first; b <= last; b++)
+            {
+                CAABB   slab = ref.bounds;
+                slab.pMin[axis] = std::max(slab.pMin[axis], bounds.pMin[axis] + extent * b / nBins);
+                slab.pMax[axis] = std::min(slab.pMax[axis], bounds.pMin[axis] + extent * (b + 1) / nBins);
+                binBounds[b] = binBounds[b] + hittable->ClipBounds(slab);
+            }
+        }
+
+        // sweep like the binned object split. split i puts bins [0, i] on the left.
+        CAABB   rightBounds;
+        int     count = 0;
+        for (int i = nBins - 1; i > 0; i--)
+        {
+            rightBounds = rightBounds + binBounds[i];
+            count += nExit[i];
+            rightCount[i - 1] = count;
+            rightCost[i - 1] = count > 0 ? count * rightBounds.SurfaceArea() : 0;
+        }
+
+        CAABB   leftBounds;
+        count = 0;
+        for (int i = 0; i < nBins - 1; i++)
+        {
+            leftBounds = leftBounds + binBounds[i];
+            count += nEnter[i];
+            if (count == 0 || rightCount[i] == 0)
+                continue;
+
+            const float cost = 1 + (count * leftBounds.SurfaceArea() + rightCost[i]) * invArea;
+            if (cost < best.cost)
+                best = { axis, i, cost };
+        }
+    }
+
+    return best;
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_BuildLBVH(const std::vector<SHittableInfo> &hittableInfo, std::vector<std::shared_ptr<IHittable>> &orderedHittables)
+{
+    const int   nHittables = hittableInfo.size();
+    const int   nBitsPerAxis = (m_setting.lbvhMortonBits > 30) ? 21 : 10;
+    const int   nBits = 3 * nBitsPerAxis;
+
+    // 1. compute morton codes of the centroids
+    CAABB   bounds, centroidBounds;
+#pragma omp parallel
+#pragma omp single
+    _ComputeRangeBounds(hittableInfo, 0, nHittables, bounds, centroidBounds);
+
+    std::vector<SMortonHittable>    mortonHittables(nHittables);
+#pragma omp parallel for
+    for (int i = 0; i < nHittables; i++)
+    {
+        mortonHittables[i].hittableIndex = i;
+        mortonHittables[i].mortonCode = _EncodeMorton3(centroidBounds.Offset(hittableInfo[i].centroid), nBitsPerAxis);
+    }
+
+    // 2. sort along the curve
+    _RadixSort(mortonHittables, nBits);
+
+    // 3. emit the hierarchy from the code bits. each leaf is a range of the
+    // sorted hittables, which is also where they are placed in the ordered list.
+    if (!m_setting.lbvhUpperSAH)
+    {
+        SBVHBuildNode   *root = nullptr;
+#pragma omp parallel
+#pragma omp single
+        root = _EmitLBVH(hittableInfo, mortonHittables, 0, nHittables, nBits - 1, orderedHittables);
+        return root;
+    }
+
+    // 3-1. emit a treelet for each cluster sharing the upper 12 bits of the
+    // code, then rebuild the levels above the treelets with SAH (HLBVH).
+    constexpr int       nClusterBits = 12;
+    const uint64_t      clusterMask = ~((1ull << (nBits - nClusterBits)) - 1);
+    std::vector<int>    clusterStarts;
+    for (int i = 0; i < nHittables; i++)
+    {
+        if (i == 0 || (mortonHittables[i].mortonCode & clusterMask) != (mortonHittables[i - 1].mortonCode & clusterMask))
+            clusterStarts.push_back(i);
+    }
+    clusterStarts.push_back(nHittables);
+
+    const int                       nClusters = clusterStarts.size() - 1;
+    std::vector<SBVHBuildNode*>     treeletRoots(nClusters);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < nClusters; c++)
+        treeletRoots[c] = _EmitLBVH(hittableInfo, mortonHittables, clusterStarts[c], clusterStarts[c + 1], nBits - nClusterBits - 1, orderedHittables);
+
+    std::vector<SHittableInfo>  treeletInfo(nClusters);
+    for (int c = 0; c < nClusters; c++)
+        treeletInfo[c] = { (size_t)c, treeletRoots[c]->bounds };
+
+    return _BuildUpperSAH(treeletInfo, 0, nClusters, treeletRoots);
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_EmitLBVH(const std::vector<SHittableInfo> &hittableInfo, const std::vector<SMortonHittable> &mortonHittables, int start, int end, int bitIndex, std::vector<std::shared_ptr<IHittable>> &orderedHittables)
+{
+    SBVHBuildNode   *node = _AllocBuildNode();
+    const int       nHittables = end - start;
+
+    if (nHittables <= m_setting.maxHittablesInNode)
+    {
+        // create leaf node
+        CAABB   bounds;
+        for (int i = start; i < end; i++)
+        {
+            const int   hittableIndex = mortonHittables[i].hittableIndex;
+            bounds = bounds + hittableInfo[hittableIndex].bounds;
+            orderedHittables[i] = m_hittables[hittableIndex];
+        }
+        node->InitLeaf(start, nHittables, bounds);
+        return node;
+    }
+
+    // skip the bits where the whole range agrees
+    while (bitIndex >= 0 && ((mortonHittables[start].mortonCode ^ mortonHittables[end - 1].mortonCode) & (1ull << bitIndex)) == 0)
+        bitIndex--;
+
+    int mid, axis;
+    if (bitIndex < 0)
+    {
+        // identical codes, split in the middle
+        mid = (start + end) / 2;
+        axis = 0;
+    }
+    else
+    {
+        // the codes are sorted, so the split is where the bit flips to 1
+        const uint64_t  mask = 1ull << bitIndex;
+        mid = std::partition_point(mortonHittables.begin() + start, mortonHittables.begin() + end,
+            [mask](const SMortonHittable &m) { return (m.mortonCode & mask) == 0; }) - mortonHittables.begin();
+        axis = bitIndex % 3;
+    }
+
+    SBVHBuildNode   *children[2];
+    if (nHittables > _BVH_TASK_CUTOFF)
+    {
+#pragma omp task shared(children, hittableInfo, mortonHittables, orderedHittables)
+        children[0] = _EmitLBVH(hittableInfo, mortonHittables, start, mid, bitIndex - 1, orderedHittables);
+        children[1] = _EmitLBVH(hittableInfo, mortonHittables, mid, end, bitIndex - 1, orderedHittables);
+#pragma omp taskwait
+    }
+    else
+    {
+        children[0] = _EmitLBVH(hittableInfo, mortonHittables, start, mid, bitIndex - 1, orderedHittables);
+        children[1] = _EmitLBVH(hittableInfo, mortonHittables, mid, end, bitIndex - 1, orderedHittables);
+    }
+    node->InitInterior(axis, children[0], children[1]);
+
+    return node;
+}
+
+//----------------------------------------------------
+
+CBVHAccel::SBVHBuildNode*   CBVHAccel::_BuildUpperSAH(std::vector<SHittableInfo> &treeletInfo, int start, int end, const std::vector<SBVHBuildNode*> &treeletRoots)
+{
+    if (end - start == 1)
+        return treeletRoots[treeletInfo[start].hittableNum];
+
+    CAABB   bounds, centroidBounds;
+    _ComputeRangeBounds(treeletInfo, start, end, bounds, centroidBounds);
+
+    // always split, the treelets are the leaves of this level
+    const bool  isSweep = (end - start) <= m_setting.nFullSweepThreshold;
+    SSAHSplit   split = isSweep ? _SweepSAHSplit(treeletInfo, start, end, bounds)
+                                : _FindBinnedSAHSplit(treeletInfo, start, end, bounds, centroidBounds);
+    int         mid;
+    int         axis = split.axis;
+
+    if (split.axis < 0)
+    {
+        axis = centroidBounds.MaxExtent();
+        mid = (start + end) / 2;
+        std::nth_element(&treeletInfo[start], &treeletInfo[mid], &treeletInfo[end - 1] + 1,
+            [axis](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[axis] < b.centroid[axis]; });
+    }
+    else if (isSweep)
+    {
+        mid = start + split.index;
+    }
+    else
+    {
+        const int   nBuckets = m_setting.nBuckets;
+        mid = std::partition(&treeletInfo[start], &treeletInfo[end - 1] + 1, [&](const SHittableInfo &t) {
+            return _BucketIndex(nBuckets, centroidBounds.Offset(t.centroid)[axis]) <= split.index; }) - &treeletInfo[0];
+    }
+
+    SBVHBuildNode   *node = _AllocBuildNode();
+    node->InitInterior(axis, _BuildUpperSAH(treeletInfo, start, mid, treeletRoots), _BuildUpperSAH(treeletInfo, mid, end, treeletRoots));
+
+    return node;
+}
+
+//----------------------------------------------------
+
+// LSD radix sort on the morton codes, 8 bits per pass. every pass counts
+// the digits of each chunk in parallel, then scatters the chunks in parallel
+// to their offsets, which keeps the sort stable.
+void    CBVHAccel::_RadixSort(std::vector<SMortonHittable> &mortonHittables, int nBits)
+{
+    constexpr int   nBitsPerPass = 8;
+    constexpr int   nDigits = 1 << nBitsPerPass;
+
+    const int   n = mortonHittables.size();
+    const int   nPasses = (nBits + nBitsPerPass - 1) / nBitsPerPass;
+    const int   nChunks = std::max(1, (n + _BVH_CHUNK_SIZE - 1) / _BVH_CHUNK_SIZE);
+
+    std::vector<SMortonHittable>    temp(n);
+    std::vector<int>                offsets(nChunks * nDigits);
+
+    for (int pass = 0; pass < nPasses; pass++)
+    {
+        const int                       lowBit = pass * nBitsPerPass;
+        const std::vector<SMortonHittable>  &in = (pass & 1) ? temp : mortonHittables;
+        std::vector<SMortonHittable>        &out = (pass & 1) ? mortonHittables : temp;
+        auto                            digitOf = [lowBit](const SMortonHittable &m) { return (int)((m.mortonCode >> lowBit) & (nDigits - 1)); };
+
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+#pragma omp parallel for
+        for (int c = 0; c < nChunks; c++)
+        {
+            const int   cEnd = std::min(n, (c + 1) * _BVH_CHUNK_SIZE);
+            for (int i = c * _BVH_CHUNK_SIZE; i < cEnd; i++)
+                offsets[c * nDigits + digitOf(in[i])]++;
+        }
+
+        // exclusive scan, digit-major and chunk-minor
+        int offset = 0;
+        for (int d = 0; d < nDigits; d++)
+        {
+            for (int c = 0; c < nChunks; c++)
+            {
+                const int   count = offsets[c * nDigits + d];
+                offsets[c * nDigits + d] = offset;
+                offset += count;
+            }
+        }
+
+#pragma omp parallel for
+        for (int c = 0; c < nChunks; c++)
+        {
+            const int   cEnd = std::min(n, (c + 1) * _BVH_CHUNK_SIZE);
+            for (int i = c * _BVH_CHUNK_SIZE; i < cEnd; i++)
+                out[offsets[c * nDigits + digitOf(in[i])]++] = in[i];
+        }
+    }
+
+    if (nPasses & 1)
+        mortonHittables.swap(temp);
+}
+
+//----------------------------------------------------
+
+// Fills "sahCost" of every node in the subtree, with the same unit costs as
+// GetSAHCost() before normalizing by the root area.
+float   CBVHAccel::_ComputeSubtreeCost(SBVHBuildNode *node) const
+{
+    if (node->nHittables > 0)
+        node->sahCost = node->bounds.SurfaceArea() * node->nHittables;
+    else
+        node->sahCost = node->bounds.SurfaceArea() + _ComputeSubtreeCost(node->children[0]) + _ComputeSubtreeCost(node->children[1]);
+
+    return node->sahCost;
+}
+
+//----------------------------------------------------
+
+// Bottom-up pass that restructures a treelet rooted at every interior node.
+// Children are optimized before their parent, and disjoint subtrees run as
+// separate tasks.
+void    CBVHAccel::_OptimizeTreelets(SBVHBuildNode *node) const
+{
+    if (node->nHittables > 0)
+    {
+        node->sahCost = node->bounds.SurfaceArea() * node->nHittables;
+        return;
+    }
+
+    if (node->nNodes > _BVH_TASK_CUTOFF)
+    {
+#pragma omp task
+        _OptimizeTreelets(node->children[0]);
+        _OptimizeTreelets(node->children[1]);
+#pragma omp taskwait
+    }
+    else
+    {
+        _OptimizeTreelets(node->children[0]);
+        _OptimizeTreelets(node->children[1]);
+    }
+
+    _RestructureTreelet(node);
+}
+
+//----------------------------------------------------
+
+// "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+// (Karras, Aila 2013). The treelet is grown from "root" by expanding the
+// leaf with the largest area, then the optimal topology over its leaves is
+// found by dynamic programming over all leaf subsets.
+void    CBVHAccel::_RestructureTreelet(SBVHBuildNode *root) const
+{
+    const float currentCost = root->bounds.SurfaceArea() + root->children[0]->sahCost + root->children[1]->sahCost;
+    const int   maxLeaves = std::max(3, std::min(m_setting.treeletSize, (int)STreelet::kMaxLeaves));
+
+    // 1. form the treelet
+    STreelet    treelet;
+    treelet.interiors[treelet.nInteriors++] = root;
+    treelet.leaves[treelet.nLeaves++] = root->children[0];
+    treelet.leaves[treelet.nLeaves++] = root->children[1];
+
+    while (treelet.nLeaves < maxLeaves)
+    {
+        int     largest = -1;
+        float   largestArea = -1;
+        for (int i = 0; i < treelet.nLeaves; i++)
+        {
+            const float area = treelet.leaves[i]->bounds.SurfaceArea();
+            if (treelet.leaves[i]->nHittables == 0 && area > largestArea)
+            {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest < 0)
+            break;
+
+        SBVHBuildNode   *expanded = treelet.leaves[largest];
+        treelet.interiors[treelet.nInteriors++] = expanded;
+        treelet.leaves[largest] = expanded->children[0];
+        treelet.leaves[treelet.nLeaves++] = expanded->children[1];
+    }
+
+    // two leaves can only be arranged one way
+    if (treelet.nLeaves < 3)
+    {
+        root->sahCost = currentCost;
+        return;
+    }
+
+    // 2. optimal cost of every subset. subsets are visited in increasing
+    // order, so all of their proper subsets are already solved.
+    const int   nSubsets = 1 << treelet.nLeaves;
+    CAABB       subsetBounds[1 << STreelet::kMaxLeaves];
+
+    for (int subset = 1; subset < nSubsets; subset++)
+    {
+        const int   lowestBit = subset & -subset;
+        const int   rest = subset ^ lowestBit;
+
+        int     lowestIndex = 0;
+        while ((1 << lowestIndex) != lowestBit)
+            lowestIndex++;
+
+        subsetBounds[subset] = subsetBounds[rest] + treelet.leaves[lowestIndex]->bounds;
+
+        if (rest == 0)
+        {
+            treelet.cost[subset] = treelet.leaves[lowestIndex]->sahCost;
+            treelet.partition[subset] = subset;
+            continue;
+        }
+
+        // the side holding the lowest leaf is enumerated, which skips mirrored splits
+        float   bestCost = _INFINITY;
+        int     bestPartition = lowestBit;
+        for (int sub = (rest - 1) & rest; ; sub = (sub - 1) & rest)
+        {
+            const int   left = lowestBit | sub;
+            const float cost = treelet.cost[left] + treelet.cost[subset ^ left];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestPartition = left;
+            }
+            if (sub == 0)
+                break;
+        }
+
+        treelet.cost[subset] = subsetBounds[subset].SurfaceArea() + bestCost;
+        treelet.partition[subset] = bestPartition;
+    }
+
+    // 3. rewrite the treelet if the optimal topology is cheaper
+    const int   allLeaves = nSubsets - 1;
+    if (treelet.cost[allLeaves] >= currentCost * (1.f - 1e-5f))
+    {
+        root->sahCost = currentCost;
+        return;
+    }
+
+    int     nextInterior = 1;
+    _EmitTreelet(treelet, root, allLeaves, nextInterior);
+}
+
+//----------------------------------------------------
+
+void    CBVHAccel::_EmitTreelet(STreelet &treelet, SBVHBuildNode *node, int subset, int &nextInterior) const
+{
+    SBVHBuildNode   *children[2];
+    const int       sides[2] = { treelet.partition[subset], subset ^ treelet.partition[subset] };
+
+    for (int c = 0; c < 2; c++)
+    {
+        if ((sides[c] & (sides[c] - 1)) == 0)
+        {
+            int     leafIndex = 0;
+            while ((1 << leafIndex) != sides[c])
+                leafIndex++;
+            children[c] = treelet.leaves[leafIndex];
+        }
+        else
+        {
+            children[c] = treelet.interiors[nextInterior++];
+            _EmitTreelet(treelet, children[c], sides[c], nextInterior);
+        }
+    }
+
+    // split axis along the largest centroid offset, the near child first
+    const glm::vec3 c0 = (children[0]->bounds.pMin + children[0]->bounds.pMax) * 0.5f;
+    const glm::vec3 c1 = (children[1]->bounds.pMin + children[1]->bounds.pMax) * 0.5f;
+    const glm::vec3 offset = glm::abs(c1 - c0);
+    const int       axis = (offset.x > offset.y && offset.x > offset.z) ? 0 : (offset.y > offset.z ? 1 : 2);
+
+    if (c0[axis] > c1[axis])
+        std::swap(children[0], children[1]);
+
+    node->InitInterior(axis, children[0], children[1]);
+    node->sahCost = treelet.cost[subset];
 }
 
 //----------------------------------------------------
 
-CBVHAccel::CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, int maxHittablesInNode, EPartitionType partitionType)
-: m_hittables(hittables)
-, m_maxHittablesInNode(std::min(255, maxHittablesInNode))
-, m_partitionMethod(partitionType)
+// this method converts BVH tree into compact structure.
+// the second child is placed right after the subtree of the first child,
+// so its offset is known up front and both subtrees can be written in parallel.
+void    CBVHAccel::_FlattenBVHTree(SBVHBuildNode *node, int offset)
 {
-    _BuildTree();
+    SLinearBVHNode  *linearNode = &m_nodes[offset];
+    linearNode->bounds = node->bounds;
+
+    if (node->nHittables > 0)
+    {
+        linearNode->hittablesOffset = node->firstHittableOffset;
+        linearNode->nHittables = node->nHittables;
+    }
+    else
+    {
+        // create interior flattened BVH node
+        const int   secondChildOffset = offset + 1 + node->children[0]->nNodes;
+
+        linearNode->axis = node->splitAxis;
+        linearNode->nHittables = 0;
+        linearNode->secondChildOffset = secondChildOffset;
+
+        if (node->nNodes > _BVH_TASK_CUTOFF)
+        {
+#pragma omp task
+            _FlattenBVHTree(node->children[0], offset + 1);
+            _FlattenBVHTree(node->children[1], secondChildOffset);
+#pragma omp taskwait
+        }
+        else
+        {
+            _FlattenBVHTree(node->children[0], offset + 1);
+            _FlattenBVHTree(node->children[1], secondChildOffset);
+        }
+    }
 }
 
 //----------------------------------------------------
 
-CBVHAccel::~CBVHAccel()
+void    CBVHAccel::_BuildWideTree()
 {
-    // delete[] m_nodes;    Why not working?
+    m_wideNodes4.reset();
+    m_wideNodes8.reset();
+    m_nWideNodes = 0;
+    m_wideVisitCounts.reset();
+
+    // quantized trees replace the float nodes, a wide copy would defeat them
+    if (m_nodes == nullptr || m_setting.quantizedBits != 0 || (m_setting.width != 4 && m_setting.width != 8))
+        return;
+
+    if (m_setting.width == 4)
+    {
+        std::vector<SWideBVHNode<4>>    wideNodes;
+        _CollapseWideNode<4>(0, wideNodes);
+        m_wideNodes4.reset(AllocAligned<SWideBVHNode<4>>(wideNodes.size()));
+        std::copy(wideNodes.begin(), wideNodes.end(), m_wideNodes4.get());
+        m_nWideNodes = wideNodes.size();
+    }
+    else
+    {
+        std::vector<SWideBVHNode<8>>    wideNodes;
+        _CollapseWideNode<8>(0, wideNodes);
+        m_wideNodes8.reset(AllocAligned<SWideBVHNode<8>>(wideNodes.size()));
+        std::copy(wideNodes.begin(), wideNodes.end(), m_wideNodes8.get());
+        m_nWideNodes = wideNodes.size();
+    }
 }
 
 //----------------------------------------------------
 
-bool CBVHAccel::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
+// The children of a wide node are found by repeatedly opening the interior
+// child with the largest surface area, until there are N of them.
+template <int N>
+int     CBVHAccel::_CollapseWideNode(int binaryIndex, std::vector<SWideBVHNode<N>> &wideNodes) const
 {
-    SHitRec     hitTmp;
-    bool        isHit = false;
-    float       tClosest = t_max;
+    const int   wideIndex = wideNodes.size();
+    wideNodes.emplace_back();
 
-    // follow ray through BVH nodes to find primitive intersections
-    int     toVisitOffset = 0;
-    int     currentNodeIndex = 0;
-    int     nodesToVisit[64];
+    int     slots[N];
+    int     nSlots = 0;
 
-    while (true) {
-        const SLinearBVHNode    *node = &m_nodes[currentNodeIndex];
+    if (m_nodes[binaryIndex].nHittables > 0)
+        slots[nSlots++] = binaryIndex;      // the root is a leaf
+    else
+    {
+        slots[nSlots++] = binaryIndex + 1;
+        slots[nSlots++] = m_nodes[binaryIndex].secondChildOffset;
 
-        // check ray against BVH node
-        if (node->bounds.Hit(ray)) {
-            if (node->nHittables > 0)
+        while (nSlots < N)
+        {
+            int     largest = -1;
+            float   largestArea = -1;
+            for (int i = 0; i < nSlots; i++)
             {
-                // intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->nHittables; i++) {
-                    if (m_hittables[node->hittablesOffset + i]->Hit(ray, t_min, tClosest, hitTmp))
-                    {
-                        hitRec = hitTmp;
-                        tClosest = hitTmp.t;
-                        isHit = true;
-                    }
+                const SLinearBVHNode    *node = &m_nodes[slots[i]];
+                if (node->nHittables == 0 && node->bounds.SurfaceArea() > largestArea)
+                {
+                    largest = i;
+                    largestArea = node->bounds.SurfaceArea();
                 }
-                if (toVisitOffset == 0)
-                    break;
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
             }
-            else 
-            {
-                // put far BVH node on nodesToVisit stack, advance to near node
-                const glm::vec3 invDir = 1.f / ray.m_dir;
-                int             dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+            if (largest < 0)
+                break;
 
-                if (dirIsNeg[node->axis])
-                {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
-                }
-                else
-                {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
-                }
+            const int   opened = slots[largest];
+            slots[largest] = opened + 1;
+            slots[nSlots++] = m_nodes[opened].secondChildOffset;
+        }
+    }
+
+    for (int i = 0; i < N; i++)
+    {
+        // empty slots get inverted bounds, which no ray can hit
+        CAABB       bounds;
+        int32_t     child = -1;
+        uint16_t    nHittables = 0;
+
+        if (i < nSlots)
+        {
+            const SLinearBVHNode    *node = &m_nodes[slots[i]];
+            bounds = node->bounds;
+            if (node->nHittables > 0)
+            {
+                child = node->hittablesOffset;
+                nHittables = node->nHittables;
             }
+            else
+                child = _CollapseWideNode<N>(slots[i], wideNodes);
         }
-        else {
-            if (toVisitOffset == 0)
-                break;
-            currentNodeIndex = nodesToVisit[--toVisitOffset];
+
+        // "wideNodes" may have grown, so index it only now
+        SWideBVHNode<N> &wideNode = wideNodes[wideIndex];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            wideNode.bounds[axis][i] = bounds.pMin[axis];
+            wideNode.bounds[axis + 3][i] = bounds.pMax[axis];
         }
+        wideNode.children[i] = child;
+        wideNode.nHittables[i] = nHittables;
     }
 
-    return isHit;
+    return wideIndex;
 }
 
 //----------------------------------------------------
 
-bool CBVHAccel::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const
+// Refit() for the wide nodes. Children are stored after their parent in the
+// collapsed and in the relaid order, so a backwards pass works here as well.
+template <int N>
+void    CBVHAccel::_RefitWideTree(SWideBVHNode<N> *nodes) const
 {
-    // follow ray through BVH nodes to find primitive intersections
-    int     toVisitOffset = 0;
-    int     currentNodeIndex = 0;
-    int     nodesToVisit[64];
-
-    while (true) {
-        const SLinearBVHNode    *node = &m_nodes[currentNodeIndex];
+    for (int i = m_nWideNodes - 1; i >= 0; i--)
+    {
+        SWideBVHNode<N> &node = nodes[i];
+        for (int c = 0; c < N; c++)
+        {
+            // empty slots keep their inverted bounds
+            if (node.children[c] < 0)
+                continue;
 
-        // check ray against BVH node
-        if (node->bounds.Hit(ray)) {
-            if (node->nHittables > 0)
+            CAABB   bounds;
+            if (node.nHittables[c] > 0)
             {
-                // intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->nHittables; i++)
-                    m_hittables[node->hittablesOffset + i]->HitAll(ray, t_min, t_max, hits);
-                if (toVisitOffset == 0)
-                    break;
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
+                for (int j = 0; j < node.nHittables[c]; j++)
+                    bounds = bounds + m_hittables[node.children[c] + j]->m_aabb;
             }
             else
             {
-                // put far BVH node on nodesToVisit stack, advance to near node
-                const glm::vec3 invDir = 1.f / ray.m_dir;
-                int             dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
-
-                if (dirIsNeg[node->axis])
-                {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
-                }
-                else
+                const SWideBVHNode<N>   &child = nodes[node.children[c]];
+                for (int k = 0; k < N; k++)
                 {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
+                    if (child.children[k] >= 0)
+                        bounds = bounds + CAABB(glm::vec3(child.bounds[0][k], child.bounds[1][k], child.bounds[2][k]), glm::vec3(child.bounds[3][k], child.bounds[4][k], child.bounds[5][k]));
                 }
             }
-        }
-        else {
-            if (toVisitOffset == 0)
-                break;
-            currentNodeIndex = nodesToVisit[--toVisitOffset];
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                node.bounds[axis][c] = bounds.pMin[axis];
+                node.bounds[axis + 3][c] = bounds.pMax[axis];
+            }
         }
     }
-
-    return hits.size() > 0;
 }
 
 //----------------------------------------------------
 
-void    CBVHAccel::Clear()
+// Relayout() for the wide or quantized nodes, which only know their children
+// by index. A chain continues with the hottest interior child, the others
+// start new chains. The root stays first, where the traversal starts.
+template <int N, typename TNode>
+void    CBVHAccel::_RelayoutNodes(std::unique_ptr<TNode[], SAlignedDeleter> &nodes, int nNodes, const uint32_t *visitCounts)
 {
-    m_hittables.clear();
-    delete[] m_nodes;
-}
+    typedef std::pair<uint32_t, int>    SChainHead;
+    auto    isColder = [](const SChainHead &a, const SChainHead &b) {
+        return (a.first < b.first) || (a.first == b.first && a.second > b.second);
+    };
+    std::priority_queue<SChainHead, std::vector<SChainHead>, decltype(isColder)>    chainHeads(isColder);
 
-//----------------------------------------------------
+    // 1. new position of every node
+    std::vector<int>    newIndex(nNodes);
+    int                 nPlaced = 0;
 
-bool   CBVHAccel:: _BuildTree()
-{
-    if (m_hittables.size() == 0)
-        return true;
+    chainHeads.push({ visitCounts[0], 0 });
+    while (!chainHeads.empty())
+    {
+        int     index = chainHeads.top().second;
+        chainHeads.pop();
 
-    // BVH-Tree construction
-    printf("[BVH] Start bvh-tree construction...\n");
+        while (index >= 0)
+        {
+            newIndex[index] = nPlaced++;
 
-    // 1. initialize primitive info
-    std::vector<SHittableInfo>     hittableInfo(m_hittables.size());
-    for (size_t i = 0; i < hittableInfo.size(); i++)
-    {
-        hittableInfo[i] = { i, m_hittables[i]->m_aabb };
-    };
+            int     hottest = -1;
+            for (int c = 0; c < N; c++)
+            {
+                int     child = nodes[index].children[c];
+                if (child < 0 || nodes[index].nHittables[c] > 0)
+                    continue;
 
-    // 2. build BVH tree
-    int     totalNodes = 0;
-    std::vector<std::shared_ptr<IHittable>>     orderedHittables;
-    orderedHittables.reserve(m_hittables.size());
+                // the colder one of the two starts a new chain
+                if (hottest >= 0 && isColder({ visitCounts[hottest], hottest }, { visitCounts[child], child }))
+                    std::swap(hottest, child);
+                if (hottest >= 0)
+                    chainHeads.push({ visitCounts[child], child });
+                else
+                    hottest = child;
+            }
+            index = hottest;
+        }
+    }
 
-    SBVHBuildNode   *root = _RecursiveBuild(hittableInfo, 0, m_hittables.size(), &totalNodes, orderedHittables);
-    m_hittables.swap(orderedHittables);
-    hittableInfo.resize(0);
-    
-    // 3. compute representation of depth-first traversal
-    m_nodes = new SLinearBVHNode[totalNodes];
-    int offset = 0;
-    _FlattenBVHTree(root, &offset);
+    // 2. move the nodes
+    std::unique_ptr<TNode[], SAlignedDeleter>   relaidNodes(AllocAligned<TNode>(std::max(1, nNodes)));
 
-    if (this->IsEmpty())
+#pragma omp parallel for
+    for (int i = 0; i < nNodes; i++)
     {
-        printf("[BVH] Error: Failed to construct bvh-tree.\n");
-        return false;
+        TNode   &node = relaidNodes[newIndex[i]];
+        node = nodes[i];
+        for (int c = 0; c < N; c++)
+        {
+            if (node.children[c] >= 0 && node.nHittables[c] == 0)
+                node.children[c] = newIndex[node.children[c]];
+        }
     }
-    
-    printf("[BVH] Done.\n");
-    return true;
+
+    nodes = std::move(relaidNodes);
 }
 
 //----------------------------------------------------
 
-CBVHAccel::SBVHBuildNode*   CBVHAccel::_RecursiveBuild(std::vector<SHittableInfo> &bvHHittableInfo, int start, int end, int *totalNodes, std::vector<std::shared_ptr<IHittable>> &orderedHittables)
+void    CBVHAccel::_QuantizeTree()
 {
-    // create node
-    SBVHBuildNode   *node = new SBVHBuildNode();
-    (*totalNodes)++;
-    
-    // compute bounds for all hittables in BVH node
-    CAABB   topBound;
-    for (int i = start; i < end; i++) 
-        topBound = topBound + bvHHittableInfo[i].bounds;
-    
-    int nHittables = end - start;
+    m_quantizedNodes8.reset();
+    m_quantizedNodes16.reset();
+    m_nQuantizedNodes = 0;
+    m_wideVisitCounts.reset();
 
-    if (nHittables == 1)
-    {
-        // create leaf node
+    if (m_nodes == nullptr || (m_setting.quantizedBits != 8 && m_setting.quantizedBits != 16))
+        return;
 
-        int firstPrimOffset = orderedHittables.size();
-        for (int i = start; i < end; i++)
-        {
-            int hittableNum = bvHHittableInfo[i].hittableNum;
-            orderedHittables.push_back(m_hittables[hittableNum]);
-        }
-        node->InitLeaf(firstPrimOffset, nHittables, topBound);
+    // the root box stays in full precision
+    const SLinearBVHNode    *root = &m_nodes[0];
+    m_quantizedRootBounds = root->bounds;
+    m_quantizedRootChild = (root->nHittables > 0) ? root->hittablesOffset : 0;
+    m_quantizedRootHittables = root->nHittables;
 
-        return node;
+    if (m_setting.quantizedBits == 8)
+    {
+        std::vector<SQuantizedBVHNode<uint8_t>>     quantizedNodes;
+        if (root->nHittables == 0)
+            _QuantizeNode<uint8_t>(0, root->bounds, quantizedNodes);
+        m_quantizedNodes8.reset(AllocAligned<SQuantizedBVHNode<uint8_t>>(std::max<size_t>(1, quantizedNodes.size())));
+        std::copy(quantizedNodes.begin(), quantizedNodes.end(), m_quantizedNodes8.get());
+        m_nQuantizedNodes = quantizedNodes.size();
     }
     else
     {
-        // compute bound of hittable centroids, choose split dimension dim
-        // the split axis is chosen by axis with the largest extent
-        CAABB   centroidBounds;
-        for (int i = start; i < end; i++)
-        {
-            centroidBounds = centroidBounds + bvHHittableInfo[i].centroid;
-        }
-        int dim = centroidBounds.MaxExtent();
+        std::vector<SQuantizedBVHNode<uint16_t>>    quantizedNodes;
+        if (root->nHittables == 0)
+            _QuantizeNode<uint16_t>(0, root->bounds, quantizedNodes);
+        m_quantizedNodes16.reset(AllocAligned<SQuantizedBVHNode<uint16_t>>(std::max<size_t>(1, quantizedNodes.size())));
+        std::copy(quantizedNodes.begin(), quantizedNodes.end(), m_quantizedNodes16.get());
+        m_nQuantizedNodes = quantizedNodes.size();
+    }
 
-        // partition hittables into two sets and build children
-        int mid = (start + end) / 2;
-        if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
-            // create leaf node
-            int firstHittableOffset = orderedHittables.size();
-            for (int i = start; i < end; i++)
-            {
-                int hittableNum = bvHHittableInfo[i].hittableNum;
-                orderedHittables.push_back(m_hittables[hittableNum]);
-            }
-            node->InitLeaf(firstHittableOffset, nHittables, topBound);
-            return node;
-        }
-        else 
-        {
-            // partition by method
-            switch (m_partitionMethod) 
-            {
-                // partition hittables using midpoints
-            case MIDPOINT:
-            {
-                float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
-                SHittableInfo *midPtr =
-                    std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1, [dim, pmid](const SHittableInfo &pi) { return pi.centroid[dim] < pmid; });
-                mid = midPtr - &bvHHittableInfo[0];
+    const size_t    floatBytes = m_nNodes * sizeof(SLinearBVHNode);
+    const size_t    quantizedBytes = m_nQuantizedNodes * (m_quantizedNodes8 ? sizeof(SQuantizedBVHNode<uint8_t>) : sizeof(SQuantizedBVHNode<uint16_t>));
+    printf("[BVH] Quantized nodes to %d bits: %zu -> %zu bytes\n", m_setting.quantizedBits, floatBytes, quantizedBytes);
 
-                // if there is too many overlapping boxes, it may fail to construct.
-                // in that case, we split using equally subset method.
-                if (mid != start && mid != end) break;
-            }
-            case EQUALSUBSET:
-            {
-                mid = (start + end) / 2;
-                std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
-                    [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; }
-                );
-                break;
-            }
-            case SAH:
-            default:
-            {
-                if (nHittables <= 2)
-                {
-                    // partition primitives into equally sized subsets
-                    mid = (start + end) / 2;
-                    std::nth_element(&bvHHittableInfo[start], &bvHHittableInfo[mid], &bvHHittableInfo[end - 1] + 1,
-                        [dim](const SHittableInfo &a, const SHittableInfo &b) { return a.centroid[dim] < b.centroid[dim]; });
-                }
-                else 
-                {
-                    // allocate BucketInfo for SAH partition buckets
-                    constexpr int nBuckets = 12;
-                    SBucketInfo buckets[nBuckets];
+    // the float nodes are not needed by the traversal anymore
+    m_nodes.reset();
+    m_cacheFile.reset();
+}
 
-                    // init. BucketInfo for SAH partition buckets
-                    for (int i = start; i < end; i++)
-                    {
-                        int b = nBuckets * centroidBounds.Offset(bvHHittableInfo[i].centroid)[dim];
-                        
-                        if (b == nBuckets)
-                            b = nBuckets - 1;
-                        buckets[b].count++;
-                        buckets[b].bounds = buckets[b].bounds + bvHHittableInfo[i].bounds;
-                    }
+//----------------------------------------------------
 
-                    // Compute costs for splitting after each bucket
-                    float   cost[nBuckets - 1];
-                    for (int i = 0; i < nBuckets - 1; i++)
-                    {
-                        CAABB b0, b1;
-                        int count0 = 0, count1 = 0;
-                        for (int j = 0; j <= i; j++)
-                        {
-                            b0 = b0 + buckets[j].bounds;
-                            count0 += buckets[j].count;
-                        }
-                        for (int j = i + 1; j < nBuckets; j++)
-                        {
-                            b1 = b1 + buckets[j].bounds;
-                            count1 += buckets[j].count;
-                        }
-                        cost[i] = 1 + (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) / topBound.SurfaceArea();
-                    }
+// Quantizes the children of an interior node inside "decodedBounds", the box
+// the traversal will have decoded for it. Offsets are rounded outwards, then
+// checked against the decoded values, so decoded boxes always contain the
+// original ones.
+template <typename T>
+int     CBVHAccel::_QuantizeNode(int binaryIndex, const CAABB &decodedBounds, std::vector<SQuantizedBVHNode<T>> &quantizedNodes) const
+{
+    constexpr int   maxOffset = std::numeric_limits<T>::max();
 
-                    // Find bucket to split at that minimizes SAH metric
-                    float   minCost = cost[0];
-                    int     minCostSplitBucket = 0;
-                    for (int i = 1; i < nBuckets - 1; i++)
-                    {
-                        if(cost[i] < minCost)
-                        {
-                            minCost = cost[i];
-                            minCostSplitBucket = i;
-                        }
-                    }
+    const int   quantizedIndex = quantizedNodes.size();
+    quantizedNodes.emplace_back();
 
-                    // Either create leaf or split primitives at selected SAH bucket
-                    float   leafCost = nHittables;
-                    if (nHittables > m_maxHittablesInNode || minCost < leafCost)
-                    {
-                        SHittableInfo *pmid = std::partition(&bvHHittableInfo[start], &bvHHittableInfo[end - 1] + 1, 
-                            [=](const SHittableInfo &pi) {
-                                int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim]; 
-                                if (b == nBuckets)
-                                    b = nBuckets - 1;
-                                return b <= minCostSplitBucket; });
-                        mid = pmid - &bvHHittableInfo[0];
-                    }
-                    // create leaf BVHBuild node
-                    else 
-                    {
-                        int     firstPrimOffset = orderedHittables.size();
-                        for (int i = start; i < end; i++)
-                        {
-                            int hittableNum = bvHHittableInfo[i].hittableNum;
-                            orderedHittables.push_back(m_hittables[hittableNum]);
-                        }
-                        node->InitLeaf(firstPrimOffset, nHittables, topBound);
-                        return node;
-                    }
-                }
-                break;
-            }}
+    const int   children[2] = { binaryIndex + 1, m_nodes[binaryIndex].secondChildOffset };
+    SQuantizedBVHNode<T>    node = {};
 
-            // build nodes
-            node->InitInterior(dim,
-                               _RecursiveBuild(bvHHittableInfo, start, mid, totalNodes, orderedHittables),
-                               _RecursiveBuild(bvHHittableInfo, mid, end, totalNodes, orderedHittables));
-        }
-    }
+    for (int c = 0; c < 2; c++)
+    {
+        const CAABB &bounds = m_nodes[children[c]].bounds;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float pMin = decodedBounds.pMin[axis];
+            const float pMax = decodedBounds.pMax[axis];
+            const float scale = _QuantizationScale<T>(pMin, pMax);
 
-    return node;
-};
+            int     minOffset = 0, maxOffsetFromTop = 0;
+            if (scale > 0)
+            {
+                minOffset = glm::clamp((int)std::floor((bounds.pMin[axis] - pMin) / scale), 0, maxOffset);
+                while (minOffset > 0 && pMin + minOffset * scale > bounds.pMin[axis])
+                    minOffset--;
 
-//----------------------------------------------------
+                maxOffsetFromTop = glm::clamp((int)std::floor((pMax - bounds.pMax[axis]) / scale), 0, maxOffset);
+                while (maxOffsetFromTop > 0 && pMax - maxOffsetFromTop * scale < bounds.pMax[axis])
+                    maxOffsetFromTop--;
+            }
+            node.offsets[c][axis] = (T)minOffset;
+            node.offsets[c][axis + 3] = (T)maxOffsetFromTop;
+        }
+    }
 
-// this method converts BVH tree into compact structure
-int CBVHAccel::_FlattenBVHTree(SBVHBuildNode *node, int *offset)
-{
-    SLinearBVHNode  *linearNode = &m_nodes[*offset];
-    linearNode->bounds = node->bounds;
-    int             myOffset = (*offset)++;
+    float   childBounds[6][2];
+    _DecodeQuantizedBounds(node.offsets, decodedBounds, childBounds);
 
-    if (node->nHittables > 0)
-    {
-        linearNode->hittablesOffset = node->firstHittableOffset;
-        linearNode->nHittables = node->nHittables;
-    }
-    else
+    for (int c = 0; c < 2; c++)
     {
-        // create interior flattened BVH node
-        linearNode->axis = node->splitAxis;
-        linearNode->nHittables = 0;
-        _FlattenBVHTree(node->children[0], offset);
-        linearNode->secondChildOffset = _FlattenBVHTree(node->children[1], offset);
+        const SLinearBVHNode    *child = &m_nodes[children[c]];
+        if (child->nHittables > 0)
+        {
+            node.children[c] = child->hittablesOffset;
+            node.nHittables[c] = child->nHittables;
+        }
+        else
+        {
+            const CAABB     decodedChild(glm::vec3(childBounds[0][c], childBounds[1][c], childBounds[2][c]), glm::vec3(childBounds[3][c], childBounds[4][c], childBounds[5][c]));
+            node.children[c] = _QuantizeNode<T>(children[c], decodedChild, quantizedNodes);
+            node.nHittables[c] = 0;
+        }
     }
 
-    return myOffset;
+    // "quantizedNodes" may have grown, so index it only now
+    quantizedNodes[quantizedIndex] = node;
+    return quantizedIndex;
 }
 
 //----------------------------------------------------
@@ -8,6 +8,25 @@
 *		acceleration structure. This is primitive based
 *		partition and consists 3 different partition algorithm - 
 *		midpoint, equal subset, surface area heuristic (sah).
+*		The SBVH mode extends sah with spatial splits, which clip
+*		straddling hittables and reference them from both sides.
+*		The LBVH mode sorts hittables along a morton curve and emits
+*		the tree from the code bits, for fast (re)builds.
+*		Any of them can be followed by treelet restructuring, which
+*		rewrites small subtrees into their SAH-optimal topology.
+*		Built trees can be cached on disk, keyed by a hash of the
+*		hittables and the build setting, and are mapped back in
+*		without a rebuild.
+*		Nodes can be relaid out after the build, hottest first, from
+*		visit counts measured by a profiling render.
+*		The binary tree can be collapsed into a 4 or 8-wide tree,
+*		whose children are tested with SSE/AVX in one go, or into
+*		quantized nodes that store child boxes in 8 or 16 bits.
+*		SAH leaves hold a single hittable type, and are intersected
+*		with one non-virtual loop per leaf. Triangle leaves are
+*		packed into SIMD groups, which are tested four at a time.
+*		Construction and flattening run as OpenMP tasks when
+*		OpenMP is enabled, and produce the same tree as serial.
 *
 *		This code referenced and modified the book "Physically Based
 *		Rendering" chaper4.3, Bounding Volume Hierarchies.
@@ -17,18 +36,21 @@
 
 #include "common.h"
 #include "aabb.h"
+#include "accel.h"
+#include "mapped_file.h"
+#include "memory.h"
 #include "ray.h"
 
+#include <atomic>
+
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
 
-struct SHitRec;
 class IHittable;
-typedef std::vector<SHitRec> VHits;
 
 //----------------------------------------------------
 
-class CBVHAccel
+class CBVHAccel : public IAccel
 {
     struct SHittableInfo
     {
@@ -52,6 +74,7 @@ class CBVHAccel
         {
             firstHittableOffset = first;
             nHittables = n;
+            nNodes = 1;
             bounds = b;
             children[0] = children[1] = nullptr;	// leaf node is determined by nullptr
         }
@@ -63,14 +86,18 @@ class CBVHAccel
             bounds = c0->bounds + c1->bounds;
             splitAxis = axis;
             nHittables = 0;
+            nNodes = 1 + c0->nNodes + c1->nNodes;
         }
 
         SBVHBuildNode   *children[2];
         int             splitAxis, firstHittableOffset, nHittables;
+        int             nNodes;         // # of nodes in this subtree, including itself
+        float           sahCost;        // unnormalized SAH cost of this subtree, only set by the treelet optimizer
         CAABB           bounds;
     };
 
-    struct SLinearBVHNode
+    // aligned, so that a node never straddles two cache lines
+    struct alignas(32) SLinearBVHNode
     {
         union 
         {
@@ -89,28 +116,272 @@ class CBVHAccel
         CAABB   bounds;
     };
 
+    struct SMortonHittable
+    {
+        uint64_t    mortonCode;
+        int         hittableIndex;
+    };
+
+    // N-wide node collapsed from the binary tree, with the child bounds in
+    // structure-of-arrays form so that all children are tested at once.
+    template <int N>
+    struct alignas(64) SWideBVHNode
+    {
+        float       bounds[6][N];       // min x, y, z, max x, y, z
+        int32_t     children[N];        // interior: node index, leaf: hittable offset, -1: empty
+        uint16_t    nHittables[N];      // 0 -> interior child
+    };
+
+    // Binary node with both child boxes quantized to T (uint8_t or uint16_t)
+    // inside the decoded box of this node. Minimums are offsets from the box
+    // minimum and maximums from the box maximum, so both ends decode exactly.
+    template <typename T>
+    struct SQuantizedBVHNode
+    {
+        T           offsets[2][6];      // per child: min x, y, z from pMin, max x, y, z from pMax
+        int32_t     children[2];        // interior: node index, leaf: hittable offset
+        uint8_t     nHittables[2];      // 0 -> interior child
+    };
+
+    // leaf triangles copied into SIMD lanes, so that a leaf tests a group of
+    // them at once without a pointer chase or a virtual call
+    static constexpr int    kTriangleGroupSize = 4;
+    struct alignas(16) STriangleGroup
+    {
+        float       v0[3][kTriangleGroupSize];
+        float       e1[3][kTriangleGroupSize];      // v1 - v0
+        float       e2[3][kTriangleGroupSize];      // v2 - v0
+        float       n[3][kTriangleGroupSize];       // cross(e1, e2), not normalized
+        int32_t     hittables[kTriangleGroupSize];  // index into m_hittables, -1 -> empty lane
+    };
+
+    // best SAH split found for a range of hittables
+    struct SSAHSplit
+    {
+        int     axis = -1;          // -1 -> no valid split
+        int     index = -1;         // binned: last bucket on the left, sweep: # of hittables on the left
+        float   cost = _INFINITY;
+    };
+
+    // treelet being restructured. leaves are subtrees that keep their shape,
+    // the interior nodes are reused for the new topology.
+    struct STreelet
+    {
+        static constexpr int    kMaxLeaves = 8;
+
+        SBVHBuildNode   *leaves[kMaxLeaves];
+        SBVHBuildNode   *interiors[kMaxLeaves - 1];
+        int             nLeaves = 0;
+        int             nInteriors = 0;
+        float           cost[1 << kMaxLeaves];          // optimal cost of each leaf subset
+        uint8_t         partition[1 << kMaxLeaves];     // left side of the optimal split of each subset
+    };
+
 public:
-    enum EPartitionType { MIDPOINT, EQUALSUBSET, SAH };
+    enum EPartitionType { MIDPOINT, EQUALSUBSET, SAH, SBVH, LBVH };
+
+    struct SBuildSetting
+    {
+        int             maxHittablesInNode = 32;
+        EPartitionType  partitionMethod = SAH;
+
+        // SAH
+        int             nBuckets = 12;              // # of bins per axis
+        int             nFullSweepThreshold = 32;   // ranges up to this size use an exact sweep instead of binning
+        bool            typedLeaves = true;         // SAH and SBVH: split leaves that would mix hittable types
+
+        // SBVH
+        float           sbvhAlpha = 1e-5f;          // try spatial splits when object split overlap / root area exceeds this
+        float           sbvhMaxGrowth = 1.5f;       // max. # of references relative to # of hittables
+
+        // LBVH
+        int             lbvhMortonBits = 30;        // 30 or 63 bit morton codes
+        bool            lbvhUpperSAH = true;        // rebuild the levels above the morton treelets with SAH
+
+        // Treelet optimization
+        int             treeletPasses = 0;          // restructuring passes after the build, 0 -> off
+        int             treeletSize = 7;            // # of leaves per treelet, [3, 8]
+
+        // Wide BVH
+        int             width = 2;                  // 2 -> binary traversal, 4 or 8 -> wide SIMD traversal
+
+        // Packed triangles
+        bool            packTriangles = true;       // pack leaf triangles into SIMD groups for the traversal
+
+        // Quantized BVH
+        int             quantizedBits = 0;          // 0 -> float nodes, 8 or 16 -> quantized nodes (frees the float nodes, no refit)
+
+        // Refit
+        float           refitRebuildRatio = 1.5f;   // Refit() asks for a rebuild past this SAH cost / built SAH cost
+
+        // Cache
+        std::string     cacheDirectory;             // load/save built trees here, empty -> no caching
+    };
+
+    // tree quality and structure report
+    struct SStats
+    {
+        int                 nNodes = 0;
+        int                 nInteriors = 0;
+        int                 nLeaves = 0;
+        int                 nReferences = 0;        // hittables referenced by leaves, > # of hittables with SBVH
+        int                 maxDepth = 0;
+        float               avgLeafDepth = 0;
+        float               sahCost = 0;
+        float               epo = -1;               // -1 -> not computed
+        size_t              nodeBytes = 0;          // m_nodes, or the quantized nodes
+        int                 nWideNodes = 0;
+        size_t              wideNodeBytes = 0;      // wide nodes, if any
+        size_t              hittableBytes = 0;      // m_hittables, not counting the hittables themselves
+        size_t              packedTriangleBytes = 0;    // triangle groups and per-leaf lookup tables
+        std::vector<int>    leafSizeHistogram;      // # of leaves by # of hittables
+
+        std::string         ToJson() const;
+    };
 
     //constructor
     CBVHAccel();
     CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, int maxHittablesInNode, EPartitionType partitionType);
+    CBVHAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const SBuildSetting &setting);
     ~CBVHAccel();
 
-    bool            Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const;
-    bool            HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const;
-    inline bool     IsEmpty() const { return (m_nodes == nullptr); }
+    // the tree owns its node array, so it can be moved but not copied.
+    // a moved-from tree is empty.
+    CBVHAccel(const CBVHAccel &) = delete;
+    CBVHAccel& operator=(const CBVHAccel &) = delete;
+    CBVHAccel(CBVHAccel &&other);
+    CBVHAccel& operator=(CBVHAccel &&other);
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
+    virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+    // Number of surfaces the ray crosses within [t_min, t_max], e.g. odd when
+    // a ray from outside a closed mesh ends inside it.
+    int             CountCrossings(const CRay &ray, float t_min, float t_max) const;
+    // Length of [t_min, t_max] inside closed geometry, counted once per
+    // surface around it, from the entering and exiting crossings. Inside is
+    // behind the hit normal, so closed meshes need an outward winding.
+    float           Thickness(const CRay &ray, float t_min, float t_max) const;
+    // Traverses the binary nodes once for the whole packet: a node is
+    // visited while any ray still hits it, starting from the first such ray,
+    // and large packets cull it with their frustum first, packets with an
+    // apex with their cone. Quantized trees trace the rays one at a time.
+    virtual void    HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs) const override;
+    virtual void    HitAllPacket(CRayPacket &packet, int first, VHits *hits) const override;
+    virtual bool    IsEmpty() const override { return (m_nNodes == 0); }
     void            Clear();
 
+    // Recompute the node bounds from the current hittable bounds, keeping the
+    // topology. Returns false when the SAH cost degraded past "refitRebuildRatio"
+    // of the cost at build time, in which case the tree should be rebuilt.
+    // Quantized trees cannot be refitted and always ask for a rebuild.
+    virtual bool    Refit() override;
+    float           GetSAHCost() const;
+
+    // Node relayout for cache locality. Nodes are emitted as chains (a node,
+    // its first child, its first child...), so the first child stays next to
+    // its parent, and chains are ordered hottest first. The heat is the visit
+    // count between BeginProfile() and EndProfile(), or the surface area
+    // (geometric hit probability) when there is no profile. The wide or
+    // quantized nodes are relaid the same way by their own visit counts.
+    // Refit() keeps either layout, a rebuild starts over in depth-first order.
+    virtual void    BeginProfile() override;
+    virtual void    EndProfile() override;
+    void            Relayout(const uint32_t *visitCounts = nullptr);
+
+    // EPO is the most expensive statistic (a box query per node), so it is optional
+    SStats          GetStats(bool computeEPO = true) const;
+    bool            WriteStats(const std::string &path, bool computeEPO = true) const;
+    virtual std::string GetStatsJson() const override { return GetStats().ToJson(); }
+
 private:
+    // query policies of the traversal kernels (_Traverse), see bvh.cpp
+    struct SClosestHitQuery;
+    struct SAnyHitQuery;
+    struct SAllHitsQuery;
+    struct SCountCrossingsQuery;
+    struct SThicknessQuery;
+
     bool            _BuildTree();
-    SBVHBuildNode*  _RecursiveBuild(std::vector<SHittableInfo> &hittableInfo, int start, int end, int *totalNodes, std::vector<std::shared_ptr<IHittable>> &orderedHittables);
-    int             _FlattenBVHTree(SBVHBuildNode *node, int *offset);
+    SBVHBuildNode*  _AllocBuildNode() { return m_buildArena->Alloc<SBVHBuildNode>(); }
+    SBVHBuildNode*  _RecursiveBuild(std::vector<SHittableInfo> &hittableInfo, int start, int end, std::vector<std::shared_ptr<IHittable>> &orderedHittables);
+    void            _ComputeRangeBounds(const std::vector<SHittableInfo> &hittableInfo, int start, int end, CAABB &bounds, CAABB &centroidBounds) const;
+    void            _InitLeaf(SBVHBuildNode *node, const std::vector<SHittableInfo> &hittableInfo, int start, int end, const CAABB &bounds, std::vector<std::shared_ptr<IHittable>> &orderedHittables) const;
+    SSAHSplit       _FindBinnedSAHSplit(const std::vector<SHittableInfo> &hittableInfo, int start, int end, const CAABB &bounds, const CAABB &centroidBounds) const;
+    SSAHSplit       _SweepSAHSplit(std::vector<SHittableInfo> &hittableInfo, int start, int end, const CAABB &bounds) const;
+    SBVHBuildNode*  _RecursiveBuildSBVH(std::vector<SHittableInfo> &refs, int depth, float rootArea, int &nSplitBudget, std::vector<std::shared_ptr<IHittable>> &orderedHittables);
+    SSAHSplit       _FindSpatialSplit(const std::vector<SHittableInfo> &refs, const CAABB &bounds) const;
+    SBVHBuildNode*  _BuildLBVH(const std::vector<SHittableInfo> &hittableInfo, std::vector<std::shared_ptr<IHittable>> &orderedHittables);
+    SBVHBuildNode*  _EmitLBVH(const std::vector<SHittableInfo> &hittableInfo, const std::vector<SMortonHittable> &mortonHittables, int start, int end, int bitIndex, std::vector<std::shared_ptr<IHittable>> &orderedHittables);
+    SBVHBuildNode*  _BuildUpperSAH(std::vector<SHittableInfo> &treeletInfo, int start, int end, const std::vector<SBVHBuildNode*> &treeletRoots);
+    static void     _RadixSort(std::vector<SMortonHittable> &mortonHittables, int nBits);
+    float           _ComputeSubtreeCost(SBVHBuildNode *node) const;
+    void            _OptimizeTreelets(SBVHBuildNode *node) const;
+    void            _RestructureTreelet(SBVHBuildNode *root) const;
+    void            _EmitTreelet(STreelet &treelet, SBVHBuildNode *node, int subset, int &nextInterior) const;
+    void            _FlattenBVHTree(SBVHBuildNode *node, int offset);
+    void            _BuildWideTree();
+    template <int N>
+    int             _CollapseWideNode(int binaryIndex, std::vector<SWideBVHNode<N>> &wideNodes) const;
+    template <int N>
+    void            _RefitWideTree(SWideBVHNode<N> *nodes) const;
+    template <int N, typename TNode>
+    void            _RelayoutNodes(std::unique_ptr<TNode[], SAlignedDeleter> &nodes, int nNodes, const uint32_t *visitCounts);
+    template <typename Q>
+    void            _Traverse(const CRay &ray, float t_min, float t_max, Q &query) const;
+    template <typename Q>
+    void            _TraverseBinary(const CRay &ray, float t_min, float t_max, Q &query) const;
+    template <int N, typename Q>
+    void            _TraverseWide(const SWideBVHNode<N> *nodes, const CRay &ray, float t_min, float t_max, Q &query) const;
+    template <typename T, typename Q>
+    void            _TraverseQuantized(const SQuantizedBVHNode<T> *nodes, const CRay &ray, float t_min, float t_max, Q &query) const;
+    void            _RemoveDuplicateHits(VHits &hits, size_t firstNewHit) const;
+    bool            _PartitionByType(std::vector<SHittableInfo> &hittableInfo, int start, int end, int &mid) const;
+    void            _PackLeaves();
+    bool            _HitLeaf(int offset, int nHittables, const CRay &ray, float t_min, float &tClosest, SHitRec &hitRec) const;
+    void            _HitAllLeaf(int offset, int nHittables, const CRay &ray, float t_min, float t_max, VHits &hits) const;
+    bool            _OccludedLeaf(int offset, int nHittables, const CRay &ray, float t_min, float t_max) const;
+    template <typename F>
+    void            _CrossingsLeaf(int offset, int nHittables, const CRay &ray, float t_min, float t_max, F &&onCrossing) const;
+    void            _HitPacketLeaf(const SLinearBVHNode &node, CRayPacket &packet, int first, SHitRec *hitRecs) const;
+    void            _HitAllPacketLeaf(const SLinearBVHNode &node, CRayPacket &packet, int first, VHits *hits) const;
+    void            _FillTriangleHit(int index, const CRay &ray, float t, SHitRec &hitRec) const;
+    void            _QuantizeTree();
+    template <typename T>
+    int             _QuantizeNode(int binaryIndex, const CAABB &decodedBounds, std::vector<SQuantizedBVHNode<T>> &quantizedNodes) const;
+    float           _ComputeEPO() const;
+    uint64_t        _ComputeCacheKey() const;
+    bool            _LoadCache(const std::string &path, uint64_t key);
+    bool            _SaveCache(const std::string &path, uint64_t key, const std::vector<std::shared_ptr<IHittable>> &inputHittables) const;
 
-    int                                     m_maxHittablesInNode;
-    EPartitionType                          m_partitionMethod;
+    SBuildSetting                           m_setting;
     std::vector<std::shared_ptr<IHittable>> m_hittables;
-    SLinearBVHNode*                         m_nodes = nullptr;
+    std::unique_ptr<SLinearBVHNode[], SAlignedDeleter>  m_nodes;
+    int                                     m_nNodes = 0;
+    std::unique_ptr<SWideBVHNode<4>[], SAlignedDeleter> m_wideNodes4;
+    std::unique_ptr<SWideBVHNode<8>[], SAlignedDeleter> m_wideNodes8;
+    int                                     m_nWideNodes = 0;
+    std::vector<STriangleGroup>             m_triangleGroups;       // leaf order
+    std::vector<int>                        m_leafGroups;           // leaf at offset o -> groups [m_leafGroups[o], m_leafGroups[o + n])
+    std::vector<uint8_t>                    m_leafTypes;            // leaf at offset o -> EHittableType of all its hittables, HITTABLE_OTHER if mixed
+    std::unique_ptr<SQuantizedBVHNode<uint8_t>[], SAlignedDeleter>  m_quantizedNodes8;
+    std::unique_ptr<SQuantizedBVHNode<uint16_t>[], SAlignedDeleter> m_quantizedNodes16;
+    int                                     m_nQuantizedNodes = 0;
+    CAABB                                   m_quantizedRootBounds;
+    int32_t                                 m_quantizedRootChild = 0;       // like SQuantizedBVHNode::children
+    int                                     m_quantizedRootHittables = 0;
+    float                                   m_buildSAHCost = 0;
+
+    // build nodes only live until the tree is flattened
+    std::unique_ptr<CMemoryArena>           m_buildArena;
+
+    // owns "m_nodes" when the tree was loaded from the cache
+    std::unique_ptr<CMappedFile>            m_cacheFile;
+
+    // node visit counts, only while profiling. the single ray queries of wide
+    // and quantized trees visit those nodes instead of "m_nodes".
+    std::unique_ptr<std::atomic<uint32_t>[]>    m_visitCounts;
+    std::unique_ptr<std::atomic<uint32_t>[]>    m_wideVisitCounts;
 
 };
 
@@ -13,3 +13,12 @@
 // constants
 const float     _INFINITY = std::numeric_limits<float>::infinity();
 const float     _EPSILON = 1e-8;
+
+// FNV-1a hash, chain calls by passing the previous hash
+inline uint64_t HashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    const uint8_t   *bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
@@ -0,0 +1,448 @@
+#include "dynamic_bvh.h"
+#include "hittable.h"
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// Traversal stack size. Rotations keep the tree shallow, but it is not
+// balanced like a full build, so this is larger than CBVHAccel's.
+static constexpr int    _DYNAMIC_BVH_STACK_SIZE = 256;
+
+// Traversal stack, local up to _DYNAMIC_BVH_STACK_SIZE entries and on the
+// heap past that, as incremental insertion does not bound the tree depth.
+template <typename T>
+struct SNodeStack
+{
+    inline bool IsEmpty() const { return size == 0; }
+
+    inline void Push(const T &entry)
+    {
+        if (size < _DYNAMIC_BVH_STACK_SIZE)
+            local[size] = entry;
+        else
+            overflow.push_back(entry);
+        size++;
+    }
+
+    inline T    Pop()
+    {
+        if (--size < _DYNAMIC_BVH_STACK_SIZE)
+            return local[size];
+
+        const T entry = overflow.back();
+        overflow.pop_back();
+        return entry;
+    }
+
+    T               local[_DYNAMIC_BVH_STACK_SIZE];
+    std::vector<T>  overflow;
+    int             size = 0;
+};
+
+//----------------------------------------------------
+
+CDynamicBVH::CDynamicBVH()
+{
+}
+
+//----------------------------------------------------
+
+CDynamicBVH::CDynamicBVH(const std::vector<std::shared_ptr<IHittable>> &hittables)
+{
+    m_nodes.reserve(hittables.size() * 2);
+    for (const auto &hittable : hittables)
+        Insert(hittable);
+}
+
+//----------------------------------------------------
+
+bool    CDynamicBVH::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
+{
+    if (IsEmpty())
+        return false;
+
+    CTraversalRay   traversalRay(ray, t_min, t_max);
+    SHitRec         hitTmp;
+    bool            isHit = false;
+
+    float   tRoot;
+    if (!m_nodes[m_root].bounds.Hit(traversalRay, tRoot))
+        return false;
+
+    // nodes with their entry distance, only boxes the ray hits are pushed
+    SNodeStack<std::pair<int, float>>   nodesToVisit;
+    nodesToVisit.Push({ m_root, tRoot });
+
+    while (!nodesToVisit.IsEmpty())
+    {
+        const auto  entry = nodesToVisit.Pop();
+        const SNode &node = m_nodes[entry.first];
+
+        // a closer hit was found since this entry was pushed
+        if (entry.second > traversalRay.m_tMax)
+            continue;
+
+        if (node.IsLeaf())
+        {
+            if (node.hittable->Hit(ray, t_min, traversalRay.m_tMax, hitTmp))
+            {
+                hitRec = hitTmp;
+                traversalRay.m_tMax = hitTmp.t;
+                isHit = true;
+            }
+        }
+        else
+        {
+            // visit the nearer child first
+            float       tNear[2];
+            const bool  isChildHit[2] = { m_nodes[node.children[0]].bounds.Hit(traversalRay, tNear[0]),
+                                          m_nodes[node.children[1]].bounds.Hit(traversalRay, tNear[1]) };
+
+            const int   near = (tNear[1] < tNear[0]) ? 1 : 0;
+            for (int c : { 1 - near, near })
+            {
+                if (isChildHit[c])
+                    nodesToVisit.Push({ node.children[c], tNear[c] });
+            }
+        }
+    }
+
+    return isHit;
+}
+
+//----------------------------------------------------
+
+bool    CDynamicBVH::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const
+{
+    if (IsEmpty())
+        return false;
+
+    const CTraversalRay traversalRay(ray, t_min, t_max);
+
+    SNodeStack<int> nodesToVisit;
+    nodesToVisit.Push(m_root);
+
+    while (!nodesToVisit.IsEmpty())
+    {
+        const SNode &node = m_nodes[nodesToVisit.Pop()];
+
+        if (!node.bounds.Hit(traversalRay))
+            continue;
+
+        if (node.IsLeaf())
+            node.hittable->HitAll(ray, t_min, t_max, hits);
+        else
+        {
+            nodesToVisit.Push(node.children[1]);
+            nodesToVisit.Push(node.children[0]);
+        }
+    }
+
+    return hits.size() > 0;
+}
+
+//----------------------------------------------------
+
+bool    CDynamicBVH::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    if (IsEmpty())
+        return false;
+
+    const CTraversalRay traversalRay(ray, t_min, t_max);
+
+    // any hit ends the query, so the children are not ordered
+    SNodeStack<int> nodesToVisit;
+    nodesToVisit.Push(m_root);
+
+    while (!nodesToVisit.IsEmpty())
+    {
+        const SNode &node = m_nodes[nodesToVisit.Pop()];
+
+        if (!node.bounds.Hit(traversalRay))
+            continue;
+
+        if (node.IsLeaf())
+        {
+            if (node.hittable->Occluded(ray, t_min, t_max))
+                return true;
+        }
+        else
+        {
+            nodesToVisit.Push(node.children[1]);
+            nodesToVisit.Push(node.children[0]);
+        }
+    }
+
+    return false;
+}
+
+//----------------------------------------------------
+
+void    CDynamicBVH::Clear()
+{
+    m_nodes.clear();
+    m_leaves.clear();
+    m_root = -1;
+    m_freeList = -1;
+}
+
+//----------------------------------------------------
+
+bool    CDynamicBVH::Insert(const std::shared_ptr<IHittable> &hittable)
+{
+    // a second leaf would be orphaned when the map entry is overwritten
+    if (m_leaves.count(hittable.get()) > 0)
+        return false;
+
+    const int   leaf = _AllocNode();
+    m_nodes[leaf].bounds = hittable->m_aabb;
+    m_nodes[leaf].hittable = hittable;
+    m_leaves[hittable.get()] = leaf;
+
+    if (m_root < 0)
+    {
+        m_root = leaf;
+        return true;
+    }
+
+    // 1. find the sibling that increases the SAH cost the least
+    const int   sibling = _FindBestSibling(m_nodes[leaf].bounds);
+
+    // 2. put a new parent in the place of the sibling
+    const int   oldParent = m_nodes[sibling].parent;
+    const int   newParent = _AllocNode();
+
+    m_nodes[newParent].parent = oldParent;
+    m_nodes[newParent].children[0] = sibling;
+    m_nodes[newParent].children[1] = leaf;
+    m_nodes[newParent].bounds = m_nodes[sibling].bounds + m_nodes[leaf].bounds;
+    m_nodes[sibling].parent = newParent;
+    m_nodes[leaf].parent = newParent;
+
+    if (oldParent < 0)
+        m_root = newParent;
+    else
+    {
+        SNode   &p = m_nodes[oldParent];
+        p.children[p.children[0] == sibling ? 0 : 1] = newParent;
+    }
+
+    // 3. refit and rotate up to the root
+    _RefitAncestors(oldParent);
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CDynamicBVH::Remove(const std::shared_ptr<IHittable> &hittable)
+{
+    auto    it = m_leaves.find(hittable.get());
+    if (it == m_leaves.end())
+        return false;
+
+    const int   leaf = it->second;
+    m_leaves.erase(it);
+
+    const int   parent = m_nodes[leaf].parent;
+    _FreeNode(leaf);
+
+    if (parent < 0)
+    {
+        m_root = -1;
+        return true;
+    }
+
+    // the sibling takes the place of the parent
+    const int   sibling = m_nodes[parent].children[m_nodes[parent].children[0] == leaf ? 1 : 0];
+    const int   grandParent = m_nodes[parent].parent;
+
+    m_nodes[sibling].parent = grandParent;
+    if (grandParent < 0)
+        m_root = sibling;
+    else
+    {
+        SNode   &g = m_nodes[grandParent];
+        g.children[g.children[0] == parent ? 0 : 1] = sibling;
+    }
+    _FreeNode(parent);
+
+    _RefitAncestors(grandParent);
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CDynamicBVH::Update(const std::shared_ptr<IHittable> &hittable)
+{
+    if (!Remove(hittable))
+        return false;
+
+    Insert(hittable);
+    return true;
+}
+
+//----------------------------------------------------
+
+void    CDynamicBVH::Refit()
+{
+    if (IsEmpty())
+        return;
+
+    // post-order walk, so children are refitted before their parent
+    std::vector<std::pair<int, bool>>   stack = { { m_root, false } };
+    while (!stack.empty())
+    {
+        auto    [index, isExpanded] = stack.back();
+        stack.pop_back();
+
+        SNode   &node = m_nodes[index];
+        if (node.IsLeaf())
+            node.bounds = node.hittable->m_aabb;
+        else if (isExpanded)
+            node.bounds = m_nodes[node.children[0]].bounds + m_nodes[node.children[1]].bounds;
+        else
+        {
+            stack.push_back({ index, true });
+            stack.push_back({ node.children[0], false });
+            stack.push_back({ node.children[1], false });
+        }
+    }
+}
+
+//----------------------------------------------------
+
+int     CDynamicBVH::_AllocNode()
+{
+    if (m_freeList < 0)
+    {
+        m_nodes.emplace_back();
+        return m_nodes.size() - 1;
+    }
+
+    const int   index = m_freeList;
+    m_freeList = m_nodes[index].parent;
+    m_nodes[index] = SNode();
+    return index;
+}
+
+//----------------------------------------------------
+
+void    CDynamicBVH::_FreeNode(int index)
+{
+    m_nodes[index].hittable.reset();
+    m_nodes[index].parent = m_freeList;
+    m_freeList = index;
+}
+
+//----------------------------------------------------
+
+// Branch and bound search. Placing the leaf next to node N costs
+// SA(N + leaf) for the new parent, plus the growth of every ancestor of N
+// ("inherited" cost). Subtrees are skipped when even a perfect fit below
+// them could not beat the best cost so far.
+int     CDynamicBVH::_FindBestSibling(const CAABB &bounds) const
+{
+    const float leafArea = bounds.SurfaceArea();
+
+    int     bestSibling = m_root;
+    float   bestCost = (m_nodes[m_root].bounds + bounds).SurfaceArea();
+
+    std::vector<std::pair<int, float>>  stack = { { m_root, 0.f } };
+    while (!stack.empty())
+    {
+        const auto  [index, inheritedCost] = stack.back();
+        stack.pop_back();
+
+        const SNode &node = m_nodes[index];
+        const float combinedArea = (node.bounds + bounds).SurfaceArea();
+        const float cost = combinedArea + inheritedCost;
+
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            bestSibling = index;
+        }
+
+        if (node.IsLeaf())
+            continue;
+
+        const float childInheritedCost = inheritedCost + combinedArea - node.bounds.SurfaceArea();
+        if (leafArea + childInheritedCost < bestCost)
+        {
+            stack.push_back({ node.children[0], childInheritedCost });
+            stack.push_back({ node.children[1], childInheritedCost });
+        }
+    }
+
+    return bestSibling;
+}
+
+//----------------------------------------------------
+
+void    CDynamicBVH::_RefitAncestors(int index)
+{
+    while (index >= 0)
+    {
+        SNode   &node = m_nodes[index];
+        node.bounds = m_nodes[node.children[0]].bounds + m_nodes[node.children[1]].bounds;
+
+        _Rotate(index);
+        index = m_nodes[index].parent;
+    }
+}
+
+//----------------------------------------------------
+
+// Tries swapping a child of "index" with a grandchild on the other side,
+// and applies the swap that reduces the area of the affected child the most.
+void    CDynamicBVH::_Rotate(int index)
+{
+    SNode   &node = m_nodes[index];
+    if (node.IsLeaf())
+        return;
+
+    int     bestChild = -1;
+    int     bestGrandChild = -1;
+    float   bestDelta = 0;
+
+    for (int side = 0; side < 2; side++)
+    {
+        const int   child = node.children[side];
+        const int   other = node.children[1 - side];
+        const SNode &otherNode = m_nodes[other];
+
+        if (otherNode.IsLeaf())
+            continue;
+
+        // swapping "child" with grandchild g leaves "other" with child + the remaining grandchild
+        for (int g = 0; g < 2; g++)
+        {
+            const int   grandChild = otherNode.children[g];
+            const int   remaining = otherNode.children[1 - g];
+            const float delta = (m_nodes[child].bounds + m_nodes[remaining].bounds).SurfaceArea() - otherNode.bounds.SurfaceArea();
+
+            if (delta < bestDelta)
+            {
+                bestDelta = delta;
+                bestChild = child;
+                bestGrandChild = grandChild;
+            }
+        }
+    }
+
+    if (bestChild < 0)
+        return;
+
+    const int   other = m_nodes[bestGrandChild].parent;
+    SNode       &otherNode = m_nodes[other];
+
+    node.children[node.children[0] == bestChild ? 0 : 1] = bestGrandChild;
+    otherNode.children[otherNode.children[0] == bestGrandChild ? 0 : 1] = bestChild;
+    m_nodes[bestGrandChild].parent = index;
+    m_nodes[bestChild].parent = other;
+
+    otherNode.bounds = m_nodes[otherNode.children[0]].bounds + m_nodes[otherNode.children[1]].bounds;
+}
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
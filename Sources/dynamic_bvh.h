@@ -0,0 +1,78 @@
+#pragma once
+
+/*************************************************************************
+*
+*		dynamic_bvh.h
+*
+*		Incrementally updatable BVH. Hittables are inserted next to
+*		the sibling that increases the SAH cost the least (branch and
+*		bound), and tree rotations on the way back to the root keep
+*		the quality close to a full rebuild. Removing a hittable
+*		collapses its parent node.
+*
+*		Based on "Fast, Effective BVH Updates for Animated Scenes"
+*		(Kopta et al. 2012), and "Fast Insertion-Based Optimization of
+*		Bounding Volume Hierarchies" (Bittner et al. 2013).
+*
+**************************************************************************/
+
+#include "common.h"
+#include "aabb.h"
+#include "ray.h"
+
+#include <unordered_map>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+struct SHitRec;
+class IHittable;
+typedef std::vector<SHitRec> VHits;
+
+//----------------------------------------------------
+
+class CDynamicBVH
+{
+    struct SNode
+    {
+        inline bool IsLeaf() const { return children[0] < 0; }
+
+        CAABB                       bounds;
+        int                         parent = -1;                // next free node, if freed
+        int                         children[2] = { -1, -1 };   // -1 -> leaf
+        std::shared_ptr<IHittable>  hittable;                   // leaf only
+    };
+
+public:
+    CDynamicBVH();
+    CDynamicBVH(const std::vector<std::shared_ptr<IHittable>> &hittables);
+
+    bool            Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const;
+    bool            HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const;
+    bool            Occluded(const CRay &ray, float t_min, float t_max) const;
+    inline bool     IsEmpty() const { return (m_root < 0); }
+    void            Clear();
+
+    // returns false if the hittable is already in the tree
+    bool            Insert(const std::shared_ptr<IHittable> &hittable);
+    bool            Remove(const std::shared_ptr<IHittable> &hittable);
+    // reinserts a hittable that moved
+    bool            Update(const std::shared_ptr<IHittable> &hittable);
+    // recompute all bounds after many hittables moved
+    void            Refit();
+
+private:
+    int             _AllocNode();
+    void            _FreeNode(int index);
+    int             _FindBestSibling(const CAABB &bounds) const;
+    void            _RefitAncestors(int index);
+    void            _Rotate(int index);
+
+    std::vector<SNode>                          m_nodes;
+    int                                         m_root = -1;
+    int                                         m_freeList = -1;
+    std::unordered_map<const IHittable*, int>   m_leaves;       // hittable -> leaf node
+};
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
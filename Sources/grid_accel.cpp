@@ -0,0 +1,459 @@
+#include "grid_accel.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <chrono>   // steady_clock
+#include <cmath>
+#include <cstdint>  // SIZE_MAX
+#include <cstdio>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// Hittable bounds are grown by this fraction of a cell before they are
+// binned, so that rounding never leaves a hit in a cell that does not list
+// the hittable.
+static constexpr float  _GRID_CELL_PADDING = 1e-4f;
+static constexpr int    _GRID_MAX_SUBGRID_REFERENCES = 8;     // per hittable of the cell, beyond that a nested grid costs more than it saves
+static constexpr float  _GRID_SUBGRID_MAX_EXTENT = 0.5f;      // hittables wider than this fraction of a cell stay in the cell's own list
+
+//----------------------------------------------------
+
+CGridAccel::CGridAccel()
+{
+}
+
+//----------------------------------------------------
+
+CGridAccel::CGridAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const SBuildSetting &setting)
+: m_setting(setting)
+, m_hittables(std::make_shared<std::vector<std::shared_ptr<IHittable>>>(hittables))
+{
+    if (hittables.empty())
+        return;
+
+    printf("[Grid] Start grid construction...\n");
+    auto    begin = std::chrono::steady_clock::now();
+
+    std::vector<int>    indices(hittables.size());
+    CAABB               bounds;
+    for (size_t i = 0; i < hittables.size(); i++)
+    {
+        indices[i] = i;
+        bounds = bounds + hittables[i]->m_aabb;
+    }
+    _Build(indices, bounds, 1, SIZE_MAX);
+
+    m_buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+    const SStats    stats = GetStats();
+    printf("[Grid] Done. resolution: %dx%dx%d, empty cells: %d / %d, references: %d, nested grids: %d, %.1f ms\n",
+            stats.resolution[0], stats.resolution[1], stats.resolution[2], stats.nEmptyCells, stats.nCells,
+            stats.nReferences, stats.nSubGrids, stats.buildMs);
+}
+
+//----------------------------------------------------
+
+bool    CGridAccel::_Build(const std::vector<int> &hittables, const CAABB &bounds, int level, size_t maxReferences)
+{
+    // padded like the cells, so that grazing rays are not clipped away
+    const float     padding = _GRID_CELL_PADDING * bounds.Diagonal()[bounds.MaxExtent()];
+    m_bounds = CAABB(bounds.pMin - padding, bounds.pMax + padding);
+
+    // cells of roughly cubic shape, "density" * cbrt(n) along the longest axis
+    const glm::vec3 extent = m_bounds.Diagonal();
+    const float     maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+    const float     cellsPerUnit = (maxExtent > 0) ? m_setting.density * std::cbrt((float)hittables.size()) / maxExtent : 0;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        m_resolution[axis] = std::max(1, std::min(m_setting.maxResolution, (int)std::lround(extent[axis] * cellsPerUnit)));
+        m_cellSize[axis] = extent[axis] / m_resolution[axis];
+        m_invCellSize[axis] = (m_cellSize[axis] > 0) ? 1.f / m_cellSize[axis] : 0;
+    }
+
+    // range of cells overlapped by a box, inclusive
+    auto    cellRange = [&](const CAABB &box, int axis, int &first, int &last) {
+        const float padding = _GRID_CELL_PADDING * m_cellSize[axis];
+        first = (int)std::floor((box.pMin[axis] - padding - m_bounds.pMin[axis]) * m_invCellSize[axis]);
+        last = (int)std::floor((box.pMax[axis] + padding - m_bounds.pMin[axis]) * m_invCellSize[axis]);
+        first = std::max(0, std::min(m_resolution[axis] - 1, first));
+        last = std::max(0, std::min(m_resolution[axis] - 1, last));
+    };
+
+    // 1. count the hittables of every cell, 2. fill the cell lists
+    const int   nCells = m_resolution[0] * m_resolution[1] * m_resolution[2];
+    m_cellStart.assign(nCells + 1, 0);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int hittable : hittables)
+        {
+            int     first[3], last[3];
+            for (int axis = 0; axis < 3; axis++)
+                cellRange((*m_hittables)[hittable]->m_aabb, axis, first[axis], last[axis]);
+
+            for (int z = first[2]; z <= last[2]; z++)
+                for (int y = first[1]; y <= last[1]; y++)
+                    for (int x = first[0]; x <= last[0]; x++)
+                    {
+                        const int   cell = (z * m_resolution[1] + y) * m_resolution[0] + x;
+                        if (pass == 0)
+                            m_cellStart[cell + 1]++;
+                        else
+                            m_cellHittables[m_cellStart[cell]++] = hittable;
+                    }
+        }
+
+        if (pass == 0)
+        {
+            // prefix sum, then start offsets that the fill pass advances
+            for (int cell = 0; cell < nCells; cell++)
+                m_cellStart[cell + 1] += m_cellStart[cell];
+            if ((size_t)m_cellStart[nCells] > maxReferences)
+                return false;
+            m_cellHittables.resize(m_cellStart[nCells]);
+        }
+        else
+        {
+            // the fill advanced every start to the next cell's start
+            for (int cell = nCells; cell > 0; cell--)
+                m_cellStart[cell] = m_cellStart[cell - 1];
+            m_cellStart[0] = 0;
+        }
+    }
+
+    // nested grids for crowded cells
+    if (level >= m_setting.maxLevels)
+        return true;
+
+    for (int cell = 0; cell < nCells; cell++)
+    {
+        const int   nCellHittables = m_cellStart[cell + 1] - m_cellStart[cell];
+        if (nCellHittables <= m_setting.subGridThreshold)
+            continue;
+
+        // cell box, tightened to its hittables
+        const int   x = cell % m_resolution[0];
+        const int   y = (cell / m_resolution[0]) % m_resolution[1];
+        const int   z = cell / (m_resolution[0] * m_resolution[1]);
+        const CAABB cellBounds(m_bounds.pMin + glm::vec3(x, y, z) * m_cellSize, m_bounds.pMin + glm::vec3(x + 1, y + 1, z + 1) * m_cellSize);
+
+        // hittables that are large next to the cell would end up in most nested
+        // cells, they stay in the cell's own list
+        std::vector<int>    cellHittables;
+        CAABB               hittableBounds;
+        for (int i = m_cellStart[cell]; i < m_cellStart[cell + 1]; i++)
+        {
+            const CAABB     clipped = (*m_hittables)[m_cellHittables[i]]->m_aabb - cellBounds;
+            const glm::vec3 extent = clipped.Diagonal();
+            if (extent.x > _GRID_SUBGRID_MAX_EXTENT * m_cellSize.x || extent.y > _GRID_SUBGRID_MAX_EXTENT * m_cellSize.y ||
+                extent.z > _GRID_SUBGRID_MAX_EXTENT * m_cellSize.z)
+                continue;
+
+            cellHittables.push_back(m_cellHittables[i]);
+            hittableBounds = hittableBounds + clipped;
+        }
+        if ((int)cellHittables.size() <= m_setting.subGridThreshold)
+            continue;
+
+        auto    subGrid = std::make_unique<CGridAccel>();
+        subGrid->m_setting = m_setting;
+        subGrid->m_hittables = m_hittables;
+
+        if (!subGrid->_Build(cellHittables, hittableBounds, level + 1, (size_t)_GRID_MAX_SUBGRID_REFERENCES * cellHittables.size()) ||
+            subGrid->m_cellStart.size() == 2)
+            continue;
+
+        // moved to the nested grid, removed below; cell lists are in ascending order
+        for (int i = m_cellStart[cell]; i < m_cellStart[cell + 1]; i++)
+            if (std::binary_search(cellHittables.begin(), cellHittables.end(), m_cellHittables[i]))
+                m_cellHittables[i] = -1;
+
+        if (m_cellSubGrid.empty())
+            m_cellSubGrid.assign(nCells, -1);
+        m_cellSubGrid[cell] = m_subGrids.size();
+        m_subGrids.push_back(std::move(subGrid));
+    }
+
+    // compact the cell lists
+    if (!m_subGrids.empty())
+    {
+        int     nKept = 0;
+        for (int cell = 0; cell < nCells; cell++)
+        {
+            const int   begin = m_cellStart[cell];
+            m_cellStart[cell] = nKept;
+            for (int i = begin; i < m_cellStart[cell + 1]; i++)
+                if (m_cellHittables[i] >= 0)
+                    m_cellHittables[nKept++] = m_cellHittables[i];
+        }
+        m_cellStart[nCells] = nKept;
+        m_cellHittables.resize(nKept);
+        m_cellHittables.shrink_to_fit();
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CGridAccel::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
+{
+    if (this->IsEmpty())
+        return false;
+
+    SCounters   *counters = m_counters.get();
+    if (counters)
+        counters->nRays.fetch_add(1, std::memory_order_relaxed);
+
+    float   tClosest = t_max;
+    return _Traverse(ray, t_min, tClosest, &hitRec, nullptr, counters);
+}
+
+//----------------------------------------------------
+
+bool    CGridAccel::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const
+{
+    if (this->IsEmpty())
+        return false;
+
+    SCounters   *counters = m_counters.get();
+    if (counters)
+        counters->nRays.fetch_add(1, std::memory_order_relaxed);
+
+    // a hittable is listed in every cell it overlaps, test each one once
+    std::vector<int>    candidates;
+    float               tMax = t_max;
+    _Traverse(ray, t_min, tMax, nullptr, &candidates, counters);
+
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    if (counters)
+        counters->nHittableTests.fetch_add(candidates.size(), std::memory_order_relaxed);
+
+    const size_t    nHits = hits.size();
+    for (int hittable : candidates)
+        (*m_hittables)[hittable]->HitAll(ray, t_min, t_max, hits);
+
+    return hits.size() > nHits;
+}
+
+//----------------------------------------------------
+
+bool    CGridAccel::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    if (this->IsEmpty())
+        return false;
+
+    SCounters   *counters = m_counters.get();
+    if (counters)
+        counters->nRays.fetch_add(1, std::memory_order_relaxed);
+
+    float   tMax = t_max;
+    return _Traverse(ray, t_min, tMax, nullptr, nullptr, counters);
+}
+
+//----------------------------------------------------
+
+bool    CGridAccel::_Traverse(const CRay &ray, float t_min, float &tClosest, SHitRec *hitRec, std::vector<int> *candidates, SCounters *counters) const
+{
+    // clip the ray to the grid bounds
+    float   t0, t1;
+    if (!m_bounds.Hit(CTraversalRay(ray, t_min, tClosest), t0, t1))
+        return false;
+
+    // 3D-DDA setup
+    const glm::vec3 start = ray.At(t0);
+    int             cell[3], step[3], outCell[3];
+    float           tNext[3], tDelta[3];
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        cell[axis] = (int)std::floor((start[axis] - m_bounds.pMin[axis]) * m_invCellSize[axis]);
+        cell[axis] = std::max(0, std::min(m_resolution[axis] - 1, cell[axis]));
+
+        if (m_resolution[axis] == 1 || ray.m_dir[axis] == 0)
+        {
+            // never crosses a cell boundary on this axis
+            tNext[axis] = _INFINITY;
+            tDelta[axis] = _INFINITY;
+            step[axis] = 0;
+            outCell[axis] = -1;
+        }
+        else if (ray.m_dir[axis] > 0)
+        {
+            const float boundary = m_bounds.pMin[axis] + (cell[axis] + 1) * m_cellSize[axis];
+            tNext[axis] = t0 + (boundary - start[axis]) / ray.m_dir[axis];
+            tDelta[axis] = m_cellSize[axis] / ray.m_dir[axis];
+            step[axis] = 1;
+            outCell[axis] = m_resolution[axis];
+        }
+        else
+        {
+            const float boundary = m_bounds.pMin[axis] + cell[axis] * m_cellSize[axis];
+            tNext[axis] = t0 + (boundary - start[axis]) / ray.m_dir[axis];
+            tDelta[axis] = -m_cellSize[axis] / ray.m_dir[axis];
+            step[axis] = -1;
+            outCell[axis] = -1;
+        }
+    }
+
+    SHitRec     hitTmp;
+    bool        isHit = false;
+
+    while (true)
+    {
+        const int   cellIndex = (cell[2] * m_resolution[1] + cell[1]) * m_resolution[0] + cell[0];
+        const int   axis = (tNext[0] < tNext[1]) ? ((tNext[0] < tNext[2]) ? 0 : 2) : ((tNext[1] < tNext[2]) ? 1 : 2);
+        const float tCellExit = std::min(tNext[axis], t1);
+
+        if (counters)
+            counters->nCellVisits.fetch_add(1, std::memory_order_relaxed);
+
+        // a crowded cell has a nested grid, and keeps its large hittables
+        if (!m_cellSubGrid.empty() && m_cellSubGrid[cellIndex] >= 0)
+        {
+            if (m_subGrids[m_cellSubGrid[cellIndex]]->_Traverse(ray, t_min, tClosest, hitRec, candidates, counters))
+            {
+                if (!hitRec && !candidates)
+                    return true;
+                isHit = true;
+            }
+        }
+
+        if (candidates)
+            candidates->insert(candidates->end(), m_cellHittables.begin() + m_cellStart[cellIndex], m_cellHittables.begin() + m_cellStart[cellIndex + 1]);
+        else if (!hitRec)
+        {
+            // any hit ends an occlusion query
+            for (int i = m_cellStart[cellIndex]; i < m_cellStart[cellIndex + 1]; i++)
+            {
+                if (counters)
+                    counters->nHittableTests.fetch_add(1, std::memory_order_relaxed);
+                if ((*m_hittables)[m_cellHittables[i]]->Occluded(ray, t_min, tClosest))
+                    return true;
+            }
+        }
+        else
+        {
+            for (int i = m_cellStart[cellIndex]; i < m_cellStart[cellIndex + 1]; i++)
+            {
+                if ((*m_hittables)[m_cellHittables[i]]->Hit(ray, t_min, tClosest, hitTmp))
+                {
+                    *hitRec = hitTmp;
+                    tClosest = hitTmp.t;
+                    isHit = true;
+                }
+            }
+
+            if (counters)
+                counters->nHittableTests.fetch_add(m_cellStart[cellIndex + 1] - m_cellStart[cellIndex], std::memory_order_relaxed);
+        }
+
+        // hits of later cells are farther than this cell
+        if (isHit && tClosest <= tCellExit)
+            break;
+
+        if (tNext[axis] > t1)
+            break;
+        cell[axis] += step[axis];
+        if (cell[axis] == outCell[axis])
+            break;
+        tNext[axis] += tDelta[axis];
+    }
+
+    return isHit;
+}
+
+//----------------------------------------------------
+
+void    CGridAccel::BeginProfile()
+{
+    m_counters = std::make_shared<SCounters>();
+}
+
+//----------------------------------------------------
+
+void    CGridAccel::EndProfile()
+{
+    if (!m_counters)
+        return;
+
+    m_profiledStats.nRays = m_counters->nRays.load(std::memory_order_relaxed);
+    m_profiledStats.nCellVisits = m_counters->nCellVisits.load(std::memory_order_relaxed);
+    m_profiledStats.nHittableTests = m_counters->nHittableTests.load(std::memory_order_relaxed);
+    m_counters.reset();
+}
+
+//----------------------------------------------------
+
+CGridAccel::SStats  CGridAccel::GetStats() const
+{
+    SStats  stats;
+    if (this->IsEmpty())
+        return stats;
+
+    for (int axis = 0; axis < 3; axis++)
+        stats.resolution[axis] = m_resolution[axis];
+    stats.buildMs = m_buildMs;
+    _AccumulateStats(stats);
+
+    stats.nRays = m_profiledStats.nRays;
+    stats.nCellVisits = m_profiledStats.nCellVisits;
+    stats.nHittableTests = m_profiledStats.nHittableTests;
+
+    return stats;
+}
+
+//----------------------------------------------------
+
+void    CGridAccel::_AccumulateStats(SStats &stats) const
+{
+    const int   nCells = m_cellStart.size() - 1;
+
+    stats.nCells += nCells;
+    stats.nReferences += m_cellHittables.size();
+    stats.nSubGrids += m_subGrids.size();
+    stats.cellBytes += m_cellStart.size() * sizeof(int) + m_cellHittables.size() * sizeof(int) + m_cellSubGrid.size() * sizeof(int);
+
+    for (int cell = 0; cell < nCells; cell++)
+    {
+        const int   nCellHittables = m_cellStart[cell + 1] - m_cellStart[cell];
+        stats.nEmptyCells += (nCellHittables == 0);
+        stats.maxCellHittables = std::max(stats.maxCellHittables, nCellHittables);
+    }
+
+    for (const auto &subGrid : m_subGrids)
+        subGrid->_AccumulateStats(stats);
+}
+
+//----------------------------------------------------
+
+std::string CGridAccel::SStats::ToJson() const
+{
+    char    buffer[512];
+    snprintf(buffer, sizeof(buffer),
+        "{\n"
+        "  \"accel\": \"grid\",\n"
+        "  \"resolution\": [%d, %d, %d],\n"
+        "  \"cells\": %d,\n"
+        "  \"emptyCells\": %d,\n"
+        "  \"references\": %d,\n"
+        "  \"maxCellHittables\": %d,\n"
+        "  \"subGrids\": %d,\n"
+        "  \"cellBytes\": %zu,\n"
+        "  \"buildMs\": %.3f,\n"
+        "  \"rays\": %llu,\n"
+        "  \"cellVisits\": %llu,\n"
+        "  \"hittableTests\": %llu\n"
+        "}\n",
+        resolution[0], resolution[1], resolution[2], nCells, nEmptyCells, nReferences, maxCellHittables, nSubGrids,
+        cellBytes, buildMs, (unsigned long long)nRays, (unsigned long long)nCellVisits, (unsigned long long)nHittableTests);
+
+    return buffer;
+}
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
@@ -0,0 +1,113 @@
+#pragma once
+
+/*************************************************************************
+*
+*		grid_accel.h
+*
+*		Uniform grid acceleration structure. The scene bounds are
+*		split into cells of roughly equal size, sized from the
+*		hittable density, and every cell lists the hittables that
+*		overlap it. Rays walk the cells in order with a 3D-DDA, and
+*		stop at the first cell that holds a hit. Cells that hold many
+*		hittables get a nested grid (two-level grid), which keeps
+*		clustered geometry from degenerating into long cell lists.
+*		Grids are fastest on scenes of many evenly spread hittables.
+*
+*		Based on "A Fast Voxel Traversal Algorithm for Ray Tracing"
+*		(Amanatides and Woo 1987), and "Physically Based Rendering"
+*		1st edition, chapter 4.3 (grid accelerator).
+*
+**************************************************************************/
+
+#include "accel.h"
+#include "aabb.h"
+
+#include <atomic>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class IHittable;
+
+//----------------------------------------------------
+
+class CGridAccel : public IAccel
+{
+public:
+    struct SBuildSetting
+    {
+        float       density = 3.f;              // # of cells along the longest axis = density * cbrt(# of hittables)
+        int         maxResolution = 128;        // max. # of cells per axis
+        int         maxLevels = 2;              // 1 -> uniform grid, 2 -> cells can hold a nested grid
+        int         subGridThreshold = 64;      // cells with more hittables than this get a nested grid
+    };
+
+    struct SStats
+    {
+        int         resolution[3] = { 0, 0, 0 };
+        int         nCells = 0;
+        int         nEmptyCells = 0;
+        int         nReferences = 0;            // hittables referenced by cells, a hittable is listed in every cell it overlaps
+        int         maxCellHittables = 0;
+        int         nSubGrids = 0;              // nested grids, counted over all levels
+        size_t      cellBytes = 0;              // cell lists of all levels
+        double      buildMs = 0;
+
+        // traversal, between BeginProfile() and EndProfile()
+        uint64_t    nRays = 0;
+        uint64_t    nCellVisits = 0;
+        uint64_t    nHittableTests = 0;
+
+        std::string ToJson() const;
+    };
+
+    CGridAccel();
+    CGridAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const SBuildSetting &setting);
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
+    virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+    virtual bool    IsEmpty() const override { return !m_hittables || m_hittables->empty(); }
+
+    // Counts rays, cell visits and hittable tests, see SStats.
+    virtual void    BeginProfile() override;
+    virtual void    EndProfile() override;
+
+    virtual std::string GetStatsJson() const override { return GetStats().ToJson(); }
+    SStats          GetStats() const;
+
+private:
+    // traversal counters, allocated while profiling only
+    struct SCounters
+    {
+        std::atomic<uint64_t>   nRays{0}, nCellVisits{0}, nHittableTests{0};
+    };
+
+    // hittables are indices into the top level "m_hittables", shared by all levels.
+    // Returns false, and stops, if the cells would reference more than "maxReferences".
+    bool            _Build(const std::vector<int> &hittables, const CAABB &bounds, int level, size_t maxReferences);
+    // closest hit into "hitRec", or all hittables whose cells the ray crosses into "candidates"
+    // With neither, returns at the first hit (any-hit query).
+    bool            _Traverse(const CRay &ray, float t_min, float &tClosest, SHitRec *hitRec, std::vector<int> *candidates, SCounters *counters) const;
+    void            _AccumulateStats(SStats &stats) const;
+
+    SBuildSetting                           m_setting;
+    std::shared_ptr<std::vector<std::shared_ptr<IHittable>>>    m_hittables;    // shared with the nested grids
+    CAABB                                   m_bounds;
+    int                                     m_resolution[3] = { 0, 0, 0 };
+    glm::vec3                               m_cellSize;
+    glm::vec3                               m_invCellSize;
+
+    // cell c lists m_cellHittables[m_cellStart[c], m_cellStart[c + 1])
+    std::vector<int>                        m_cellStart;
+    std::vector<int>                        m_cellHittables;
+    std::vector<int>                        m_cellSubGrid;      // cell -> index into m_subGrids, -1 -> none
+    std::vector<std::unique_ptr<CGridAccel>>    m_subGrids;
+    double                                  m_buildMs = 0;
+
+    std::shared_ptr<SCounters>              m_counters;
+    SStats                                  m_profiledStats;        // traversal counters of the last profile
+};
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
@@ -7,6 +7,38 @@
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
 
+bool    IHittable::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    SHitRec     hitRec;
+    return Hit(ray, t_min, t_max, hitRec);
+}
+
+//----------------------------------------------------
+
+void    IHittable::HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs)
+{
+    SHitRec     hitTmp;
+    for (int i = first; i < packet.Size(); i++)
+    {
+        if (Hit(packet.m_rays[i], packet.m_tMin, packet.m_tMax[i], hitTmp))
+        {
+            hitRecs[i] = hitTmp;
+            packet.m_tMax[i] = hitTmp.t;
+            packet.m_isHit[i] = 1;
+        }
+    }
+}
+
+//----------------------------------------------------
+
+void    IHittable::HitAllPacket(CRayPacket &packet, int first, VHits *hits)
+{
+    for (int i = first; i < packet.Size(); i++)
+        HitAll(packet.m_rays[i], packet.m_tMin, packet.m_tMax[i], hits[i]);
+}
+
+//----------------------------------------------------
+
 CHittableSphere::CHittableSphere(const glm::vec3 &origin, float radius, const std::shared_ptr<IMaterial> &material)
 : m_origin(origin)
 , m_radius(radius)
@@ -88,6 +120,32 @@ bool    CHittableSphere::HitAll(const CRay &ray, float t_min, float t_max, VHits
 
 //----------------------------------------------------
 
+bool    CHittableSphere::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    glm::vec3   oc = ray.m_origin - m_origin;
+    float       b = glm::dot(oc, ray.m_dir);
+    float       c = glm::dot(oc, oc) - m_radius * m_radius;
+    float       h = b * b - c;
+
+    if (h < 0.0)
+        return false;
+
+    float       t = -b - glm::sqrt(h);
+    if (t < t_min)
+        t = -b + glm::sqrt(h);
+    return !(t < t_min || t > t_max);
+}
+
+//----------------------------------------------------
+
+void    CHittableSphere::Translate(const glm::vec3 &offset)
+{
+    m_origin += offset;
+    m_aabb = m_aabb.Translate(offset);
+}
+
+//----------------------------------------------------
+
 CHittableTriangle::CHittableTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const std::shared_ptr<IMaterial> &material)
 : m_v0(v0)
 , m_v1(v1)
@@ -150,6 +208,90 @@ bool    CHittableTriangle::HitAll(const CRay &ray, float t_min, float t_max, VHi
 
 //----------------------------------------------------
 
+bool    CHittableTriangle::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    glm::vec3   v1v0 = m_v1 - m_v0;
+    glm::vec3   v2v0 = m_v2 - m_v0;
+    glm::vec3   rov0 = ray.m_origin - m_v0;
+    glm::vec3   n = glm::cross( v1v0, v2v0 );
+    glm::vec3   q = glm::cross( rov0, ray.m_dir );
+    float       d = 1.0f / dot( ray.m_dir, n );
+    float       u = d * glm::dot( -q, v2v0 );
+    float       v = d * glm::dot(  q, v1v0 );
+    float       t = d * glm::dot( -n, rov0 );
+
+    return !(u < 0.0f || v < 0.0f || (u + v) > 1.0f || t < t_min || t > t_max);
+}
+
+//----------------------------------------------------
+
+CAABB   CHittableTriangle::ClipBounds(const CAABB &box) const
+{
+    // clip the triangle against the six planes of the box (Sutherland-Hodgman).
+    // every plane adds at most one vertex, so 9 vertices are enough.
+    glm::vec3   poly[2][9] = { { m_v0, m_v1, m_v2 } };
+    int         nVerts = 3;
+    int         cur = 0;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        for (int side = 0; side < 2; side++)
+        {
+            const float     plane = box[side][axis];
+            const glm::vec3 *in = poly[cur];
+            glm::vec3       *out = poly[1 - cur];
+            int             nOut = 0;
+
+            for (int i = 0; i < nVerts; i++)
+            {
+                const glm::vec3 &a = in[i];
+                const glm::vec3 &b = in[(i + 1) % nVerts];
+                // signed distance to the plane, positive inside the box
+                const float     da = side ? plane - a[axis] : a[axis] - plane;
+                const float     db = side ? plane - b[axis] : b[axis] - plane;
+
+                if (da >= 0)
+                    out[nOut++] = a;
+                if ((da >= 0) != (db >= 0))
+                    out[nOut++] = a + (b - a) * (da / (da - db));
+            }
+
+            nVerts = nOut;
+            cur = 1 - cur;
+            if (nVerts == 0)
+                return CAABB();
+        }
+    }
+
+    CAABB   bounds;
+    for (int i = 0; i < nVerts; i++)
+        bounds = bounds + poly[cur][i];
+
+    // intersection points may round slightly outside of the box
+    return bounds - box;
+}
+
+//----------------------------------------------------
+
+void    CHittableTriangle::Translate(const glm::vec3 &offset)
+{
+    m_v0 += offset;
+    m_v1 += offset;
+    m_v2 += offset;
+    m_aabb = m_aabb.Translate(offset);
+}
+
+//----------------------------------------------------
+
+// spatial splits clip the triangle itself, so the bounds are not enough
+uint64_t    CHittableTriangle::HashGeometry(uint64_t hash) const
+{
+    const glm::vec3 vertices[3] = { m_v0, m_v1, m_v2 };
+    return HashBytes(vertices, sizeof(vertices), hash);
+}
+
+//----------------------------------------------------
+
 CHittablePlane::CHittablePlane(const glm::vec3 &origin, const glm::vec3 &normal, const glm::vec3 &up, float sx, float sy, const std::shared_ptr<IMaterial> &material)
 : m_origin(origin)
 , m_vz(glm::normalize(normal))
@@ -217,17 +359,46 @@ bool    CHittablePlane::HitAll(const CRay &ray, float t_min, float t_max, VHits
 
 //----------------------------------------------------
 
+bool    CHittablePlane::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    const glm::vec3     oc = m_origin - ray.m_origin;
+    const float         dotNL = glm::dot(ray.m_dir, m_vz);
+    const float         t = dot(oc, m_vz) / dotNL;
+
+    if (t < t_min || t > t_max)
+        return false;
+
+    const glm::vec3     projected_vector = ray.m_origin + ray.m_dir * t - m_origin;
+    const float         dotPNX = dot(projected_vector, m_vx);
+    const float         dotPNY = dot(projected_vector, m_vy);
+
+    return t > _EPSILON
+        && dotPNX >= -0.5 * m_sx && dotPNX < m_sx * 0.5
+        && dotPNY >= -0.5 * m_sy && dotPNY < m_sy * 0.5;
+}
+
+//----------------------------------------------------
+
+void    CHittablePlane::Translate(const glm::vec3 &offset)
+{
+    m_origin += offset;
+    m_aabb = m_aabb.Translate(offset);
+}
+
+//----------------------------------------------------
+
 CHittableMesh::CHittableMesh(const glm::vec3 &origin, const std::shared_ptr<IMaterial> &material)
 : m_origin(origin)
 , m_triangles(std::make_shared<CHittableList>())
 , m_isMeshLoaded(false)
+, m_isBVHBuilt(false)
 {
     m_material = material;
 }
 
 //----------------------------------------------------
 
-bool    CHittableMesh::Load(const char* file)
+bool    CHittableMesh::Load(const char* file, const char* bvhCacheDirectory, bool buildBVHLazily)
 {
     // load obj
     tinyobj::attrib_t                   attrib;
@@ -315,7 +486,16 @@ bool    CHittableMesh::Load(const char* file)
         m_aabb.pMax.z = glm::max(m_aabb.pMax.z, triangle->m_aabb.pMax.z);
     }
 
-    m_triangles->BuildBVHTree();
+    if (buildBVHLazily)
+    {
+        m_bvhCacheDirectory = (bvhCacheDirectory != nullptr) ? bvhCacheDirectory : "";
+        printf("[Mesh] bvh-tree is built on the first hit\n");
+    }
+    else
+    {
+        m_triangles->BuildBVHTree(bvhCacheDirectory);
+        m_isBVHBuilt = true;
+    }
 
     printf("[Mesh] Finished loading obj \"%s\"\n", file);
 
@@ -326,9 +506,53 @@ bool    CHittableMesh::Load(const char* file)
 
 //----------------------------------------------------
 
+void    CHittableMesh::BeginBVHProfile()
+{
+    std::lock_guard<std::mutex>     lock(m_bvhMutex);
+    m_isProfiling = true;
+    if (m_isBVHBuilt)
+        m_triangles->BeginBVHProfile();
+}
+
+//----------------------------------------------------
+
+void    CHittableMesh::EndBVHProfile()
+{
+    std::lock_guard<std::mutex>     lock(m_bvhMutex);
+    m_isProfiling = false;
+    if (m_isBVHBuilt)
+        m_triangles->EndBVHProfile();
+}
+
+//----------------------------------------------------
+
+bool    CHittableMesh::_PrepareBVH(const CRay &ray, float t_min, float t_max)
+{
+    if (m_isBVHBuilt.load(std::memory_order_acquire))
+        return true;
+
+    // rays that miss the mesh do not need the tree
+    if (!m_aabb.Hit(CTraversalRay(ray, t_min, t_max)))
+        return false;
+
+    std::lock_guard<std::mutex>     lock(m_bvhMutex);
+    if (!m_isBVHBuilt.load(std::memory_order_relaxed))
+    {
+        m_triangles->BuildBVHTree(m_bvhCacheDirectory.empty() ? nullptr : m_bvhCacheDirectory.c_str());
+        if (m_isProfiling)
+            m_triangles->BeginBVHProfile();
+
+        m_isBVHBuilt.store(true, std::memory_order_release);
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
 bool    CHittableMesh::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec)
 {
-    if (!m_isMeshLoaded)
+    if (!m_isMeshLoaded || !_PrepareBVH(ray, t_min, t_max))
         return false;
 
     return m_triangles->Hit(ray, t_min, t_max, hitRec);
@@ -338,7 +562,7 @@ bool    CHittableMesh::Hit(const CRay &ray, float t_min, float t_max, SHitRec &h
 
 bool    CHittableMesh::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits)
 {
-    if (!m_isMeshLoaded)
+    if (!m_isMeshLoaded || !_PrepareBVH(ray, t_min, t_max))
         return false;
 
     return m_triangles->HitAll(ray, t_min, t_max, hits);
@@ -346,4 +570,172 @@ bool    CHittableMesh::HitAll(const CRay &ray, float t_min, float t_max, VHits &
 
 //----------------------------------------------------
 
+bool    CHittableMesh::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    if (!m_isMeshLoaded || !_PrepareBVH(ray, t_min, t_max))
+        return false;
+
+    return m_triangles->Occluded(ray, t_min, t_max);
+}
+
+//----------------------------------------------------
+
+void    CHittableMesh::HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs)
+{
+    if (!m_isMeshLoaded)
+        return;
+
+    // any ray of the packet that reaches the mesh needs the tree
+    int     i = first;
+    while (i < packet.Size() && !_PrepareBVH(packet.m_rays[i], packet.m_tMin, packet.m_tMax[i]))
+        i++;
+    if (i == packet.Size())
+        return;
+
+    m_triangles->HitPacket(packet, first, hitRecs);
+}
+
+//----------------------------------------------------
+
+void    CHittableMesh::HitAllPacket(CRayPacket &packet, int first, VHits *hits)
+{
+    if (!m_isMeshLoaded)
+        return;
+
+    int     i = first;
+    while (i < packet.Size() && !_PrepareBVH(packet.m_rays[i], packet.m_tMin, packet.m_tMax[i]))
+        i++;
+    if (i == packet.Size())
+        return;
+
+    m_triangles->HitAllPacket(packet, first, hits);
+}
+
+//----------------------------------------------------
+
+void    CHittableMesh::Translate(const glm::vec3 &offset)
+{
+    m_origin += offset;
+    for (glm::vec3 &v : m_vertices)
+        v += offset;
+    m_aabb = m_aabb.Translate(offset);
+
+    // moves the triangles, and refits their bvh-tree. A deferred tree stays
+    // deferred, it is built from the moved triangles.
+    if (m_isBVHBuilt)
+        m_triangles->Translate(offset);
+    else
+    {
+        for (const auto &triangle : m_triangles->m_hittables)
+            triangle->Translate(offset);
+    }
+}
+
+//----------------------------------------------------
+
+CHittableInstance::CHittableInstance(const std::shared_ptr<IHittable> &object, const glm::mat4 &transform, const std::shared_ptr<IMaterial> &material)
+: m_object(object)
+{
+    m_material = material;
+    SetTransform(transform);
+}
+
+//----------------------------------------------------
+
+void    CHittableInstance::SetTransform(const glm::mat4 &transform)
+{
+    m_transform = transform;
+    m_invTransform = glm::inverse(transform);
+
+    // bounds of the transformed object bounds
+    m_aabb = CAABB();
+    for (int corner = 0; corner < 8; corner++)
+        m_aabb = m_aabb + glm::vec3(m_transform * glm::vec4(m_object->m_aabb.Corner(corner), 1.f));
+}
+
+//----------------------------------------------------
+
+// CRay keeps its direction normalized, which scales distances by the length
+// of the object space direction. "tScale" converts world to object distances.
+CRay    CHittableInstance::_ToObject(const CRay &ray, float &tScale) const
+{
+    const glm::vec3 origin = glm::vec3(m_invTransform * glm::vec4(ray.m_origin, 1.f));
+    const glm::vec3 dir = glm::vec3(m_invTransform * glm::vec4(ray.m_dir, 0.f));
+
+    tScale = glm::length(dir);
+    return CRay(origin, dir);
+}
+
+//----------------------------------------------------
+
+void    CHittableInstance::_ToWorld(const CRay &ray, float tScale, SHitRec &hitRec)
+{
+    // normals transform with the inverse transpose, which keeps their side
+    // relative to the ray, so the face orientation carries over.
+    hitRec.t /= tScale;
+    hitRec.p = ray.At(hitRec.t);
+    hitRec.n = glm::normalize(glm::vec3(glm::transpose(m_invTransform) * glm::vec4(hitRec.n, 0.f)));
+    hitRec.p_hittable = shared_from_this();
+    if (m_material)
+        hitRec.p_material = m_material;
+}
+
+//----------------------------------------------------
+
+bool    CHittableInstance::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec)
+{
+    float       tScale;
+    const CRay  objectRay = _ToObject(ray, tScale);
+
+    if (!m_object->Hit(objectRay, t_min * tScale, t_max * tScale, hitRec))
+        return false;
+
+    _ToWorld(ray, tScale, hitRec);
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittableInstance::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits)
+{
+    float       tScale;
+    const CRay  objectRay = _ToObject(ray, tScale);
+    const size_t    firstHit = hits.size();
+
+    m_object->HitAll(objectRay, t_min * tScale, t_max * tScale, hits);
+
+    for (size_t i = firstHit; i < hits.size(); i++)
+        _ToWorld(ray, tScale, hits[i]);
+    return hits.size() > firstHit;
+}
+
+//----------------------------------------------------
+
+bool    CHittableInstance::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    float       tScale;
+    const CRay  objectRay = _ToObject(ray, tScale);
+
+    return m_object->Occluded(objectRay, t_min * tScale, t_max * tScale);
+}
+
+//----------------------------------------------------
+
+// Moves the placement only, the shared object stays where it is.
+void    CHittableInstance::Translate(const glm::vec3 &offset)
+{
+    glm::mat4   transform = m_transform;
+    transform[3] += glm::vec4(offset, 0.f);
+    SetTransform(transform);
+}
+
+//----------------------------------------------------
+
+uint64_t    CHittableInstance::HashGeometry(uint64_t hash) const
+{
+    return m_object->HashGeometry(HashBytes(&m_transform, sizeof(glm::mat4), hash));
+}
+
+//----------------------------------------------------
+
 _CD_NAMESPACE_END
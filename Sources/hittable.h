@@ -3,6 +3,9 @@
 #include "common.h"
 #include "aabb.h"
 
+#include <atomic>
+#include <mutex>
+
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
 
@@ -10,6 +13,7 @@ class CHittableList;
 class IHittable;
 class IMaterial;
 class CRay;
+class CRayPacket;
 
 //----------------------------------------------------
 
@@ -35,6 +39,9 @@ typedef std::vector<SHitRec> VHits;
 // comparator
 static bool     cmpHitRec(const SHitRec &hr1, const SHitRec &hr2) { return hr1.t < hr2.t; };
 
+// concrete hittable types, acceleration structures batch hittables by them
+enum EHittableType : uint8_t { HITTABLE_OTHER, HITTABLE_SPHERE, HITTABLE_TRIANGLE, HITTABLE_PLANE, HITTABLE_MESH, HITTABLE_INSTANCE };
+
 //----------------------------------------------------
 
 class IHittable : public std::enable_shared_from_this<IHittable>
@@ -43,6 +50,43 @@ public:
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) = 0;
     virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) = 0;
 
+    // Any-hit query, for shadow and visibility rays: true if anything lies
+    // within [t_min, t_max]. Returns at the first intersection found, and
+    // builds no hit record. The default falls back to Hit().
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max);
+
+    // Closest hits of the rays [first, packet.Size()) of a coherent packet.
+    // A ray that hits something closer than its packet.m_tMax[i] updates it,
+    // sets packet.m_isHit[i] and writes hitRecs[i]. The default traces the
+    // rays one at a time.
+    virtual void    HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs);
+    // All hits of each ray [first, packet.Size()) within [packet.m_tMin,
+    // packet.m_tMax[i]], appended to hits[i]. The default traces the rays one
+    // at a time.
+    virtual void    HitAllPacket(CRayPacket &packet, int first, VHits *hits);
+
+    // Bounds of the part of this hittable that lies inside "box". Used by
+    // spatial split BVH builds; the default clips the bounding box only.
+    virtual CAABB   ClipBounds(const CAABB &box) const { return m_aabb - box; }
+
+    // Type of the hittable. Subclasses of the concrete hittables that override
+    // Hit(), HitAll() or Occluded() must not report the type of their base,
+    // since leaves of a single type call the base implementation directly.
+    virtual EHittableType   Type() const { return HITTABLE_OTHER; }
+
+    // Move the hittable. Acceleration structures holding it must be refitted
+    // (CHittableList::UpdateBVHTree) afterwards.
+    virtual void    Translate(const glm::vec3 &offset) = 0;
+
+    // Hash of everything an acceleration structure build depends on, chained
+    // onto "hash". Used to key cached bvh-trees; the default hashes the bounds.
+    virtual uint64_t    HashGeometry(uint64_t hash) const { return HashBytes(&m_aabb, sizeof(CAABB), hash); }
+
+    // Count acceleration structure node visits between the two calls, and
+    // relayout the nodes for the measured access pattern at the end.
+    virtual void    BeginBVHProfile() {}
+    virtual void    EndBVHProfile() {}
+
 public:
     std::shared_ptr<IMaterial>  m_material;
     CAABB                       m_aabb;
@@ -57,6 +101,9 @@ public:
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override;
     virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override;
+    virtual EHittableType   Type() const override { return HITTABLE_SPHERE; }
+    virtual void    Translate(const glm::vec3 &offset) override;
 
 public:
     glm::vec3   m_origin;
@@ -72,6 +119,11 @@ public:
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override;
     virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override;
+    virtual CAABB   ClipBounds(const CAABB &box) const override;
+    virtual EHittableType   Type() const override { return HITTABLE_TRIANGLE; }
+    virtual void    Translate(const glm::vec3 &offset) override;
+    virtual uint64_t    HashGeometry(uint64_t hash) const override;
 
 public:
     glm::vec3   m_v0, m_v1, m_v2;
@@ -87,6 +139,9 @@ public:
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override;
     virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override;
+    virtual EHittableType   Type() const override { return HITTABLE_PLANE; }
+    virtual void    Translate(const glm::vec3 &offset) override;
 
 public:
     glm::vec3   m_origin;
@@ -103,18 +158,71 @@ public:
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override;
     virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override;
-    bool            Load(const char* file);
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override;
+    virtual void    HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs) override;
+    virtual void    HitAllPacket(CRayPacket &packet, int first, VHits *hits) override;
+    virtual EHittableType   Type() const override { return HITTABLE_MESH; }
+    virtual void    Translate(const glm::vec3 &offset) override;
+    virtual void    BeginBVHProfile() override;
+    virtual void    EndBVHProfile() override;
+    // "bvhCacheDirectory" : load/save the triangle bvh-tree there, if given
+    // "buildBVHLazily"    : build the triangle bvh-tree on the first ray that hits
+    //                       the mesh bounds, instead of here. Meshes that are
+    //                       off-screen or occluded then never pay for it.
+    bool            Load(const char* file, const char* bvhCacheDirectory = nullptr, bool buildBVHLazily = true);
 
 public:
     glm::vec3                       m_origin;
 
 private:
+    // Builds the deferred bvh-tree if "ray" hits the mesh bounds. Thread-safe,
+    // the first thread builds and concurrent ones wait for it. Returns false
+    // when the ray misses the mesh.
+    bool            _PrepareBVH(const CRay &ray, float t_min, float t_max);
+
     // mesh data
     std::vector<glm::vec3>          m_vertices;
     std::vector<uint32_t>           m_indices;
     std::shared_ptr<CHittableList>  m_triangles;
 
     bool                            m_isMeshLoaded;
+
+    // deferred bvh-tree build
+    std::string                     m_bvhCacheDirectory;
+    std::atomic<bool>               m_isBVHBuilt;
+    std::mutex                      m_bvhMutex;
+    bool                            m_isProfiling = false;
+};
+
+//----------------------------------------------------
+
+// A placement of a shared hittable (typically a loaded CHittableMesh, with its
+// bvh-tree) under an affine transform. Rays are moved into object space on
+// entry, so any number of instances share the geometry and its bvh-tree. A
+// CHittableList of instances with a bvh-tree is the top level over them.
+class CHittableInstance : public IHittable
+{
+public:
+    // "material" : overrides the materials of the object, if given
+    CHittableInstance(const std::shared_ptr<IHittable> &object, const glm::mat4 &transform, const std::shared_ptr<IMaterial> &material = nullptr);
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override;
+    virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override;
+    virtual EHittableType   Type() const override { return HITTABLE_INSTANCE; }
+    virtual void    Translate(const glm::vec3 &offset) override;
+    virtual uint64_t    HashGeometry(uint64_t hash) const override;
+
+    void            SetTransform(const glm::mat4 &transform);
+
+public:
+    std::shared_ptr<IHittable>  m_object;
+    glm::mat4                   m_transform;        // object to world
+    glm::mat4                   m_invTransform;     // world to object
+
+private:
+    CRay            _ToObject(const CRay &ray, float &tScale) const;
+    void            _ToWorld(const CRay &ray, float tScale, SHitRec &hitRec);
 };
 
 //----------------------------------------------------
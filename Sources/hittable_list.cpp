@@ -1,5 +1,10 @@
 #include "hittable_list.h"
 #include "bvh.h"
+#include "dynamic_bvh.h"
+#include "grid_accel.h"
+#include "kdtree_accel.h"
+
+#include <algorithm>
 
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
@@ -7,7 +12,8 @@ _CD_NAMESPACE_BEGIN
 inline void     CHittableList::Clear()
 {
     m_hittables.clear(); 
-    m_bvhAccel->Clear();
+    m_accel.reset();
+    m_dynamicBvh.reset();
 }
 
 //----------------------------------------------------
@@ -15,15 +21,19 @@ inline void     CHittableList::Clear()
 bool    CHittableList::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec)
 {
     // BVH-Acceleration
-    if (!m_bvhAccel->IsEmpty())
+    if (m_dynamicBvh && !m_dynamicBvh->IsEmpty())
+    {
+        return m_dynamicBvh->Hit(ray, t_min, t_max, hitRec);
+    }
+    if (m_accel && !m_accel->IsEmpty())
     {
-        return m_bvhAccel->Hit(ray, t_min, t_max, hitRec);
+        return m_accel->Hit(ray, t_min, t_max, hitRec);
     }
 
     // Brute-Force
     SHitRec hitTmp;
     bool    isHit = false;
-    float   tClosest = _INFINITY;
+    float   tClosest = t_max;
 
     for (const auto &obj : m_hittables) {
         if (obj->Hit(ray, t_min, tClosest, hitTmp))
@@ -42,9 +52,13 @@ bool    CHittableList::Hit(const CRay &ray, float t_min, float t_max, SHitRec &h
 bool    CHittableList::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits)
 {
     // BVH-Acceleration
-    if (!m_bvhAccel->IsEmpty())
+    if (m_dynamicBvh && !m_dynamicBvh->IsEmpty())
     {
-        return m_bvhAccel->HitAll(ray, t_min, t_max, hits);
+        return m_dynamicBvh->HitAll(ray, t_min, t_max, hits);
+    }
+    if (m_accel && !m_accel->IsEmpty())
+    {
+        return m_accel->HitAll(ray, t_min, t_max, hits);
     }
 
     return false;
@@ -52,19 +66,188 @@ bool    CHittableList::HitAll(const CRay &ray, float t_min, float t_max, VHits &
 
 //----------------------------------------------------
 
-bool    CHittableList::BuildBVHTree()
+bool    CHittableList::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    // BVH-Acceleration
+    if (m_dynamicBvh && !m_dynamicBvh->IsEmpty())
+    {
+        return m_dynamicBvh->Occluded(ray, t_min, t_max);
+    }
+    if (m_accel && !m_accel->IsEmpty())
+    {
+        return m_accel->Occluded(ray, t_min, t_max);
+    }
+
+    // Brute-Force, any hit will do
+    for (const auto &obj : m_hittables) {
+        if (obj->Occluded(ray, t_min, t_max))
+            return true;
+    }
+
+    return false;
+}
+
+//----------------------------------------------------
+
+void    CHittableList::HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs)
+{
+    // only the static structures trace packets
+    if ((!m_dynamicBvh || m_dynamicBvh->IsEmpty()) && m_accel && !m_accel->IsEmpty())
+        m_accel->HitPacket(packet, first, hitRecs);
+    else
+        IHittable::HitPacket(packet, first, hitRecs);
+}
+
+//----------------------------------------------------
+
+void    CHittableList::HitAllPacket(CRayPacket &packet, int first, VHits *hits)
+{
+    if ((!m_dynamicBvh || m_dynamicBvh->IsEmpty()) && m_accel && !m_accel->IsEmpty())
+        m_accel->HitAllPacket(packet, first, hits);
+    else
+        IHittable::HitAllPacket(packet, first, hits);
+}
+
+//----------------------------------------------------
+
+void    CHittableList::Translate(const glm::vec3 &offset)
+{
+    for (const auto &obj : m_hittables)
+        obj->Translate(offset);
+    m_aabb = m_aabb.Translate(offset);
+
+    UpdateBVHTree();
+}
+
+//----------------------------------------------------
+
+void    CHittableList::BeginBVHProfile()
 {
-    // FIXME: not calling BuildBVHTree() will cause crash, because "m_bvhAccel" is not
-    // instanced at all. Perhaps create a "CBVHAccel::Construct" function that separtes
-    // the build process from instantiation.
-    m_bvhAccel = std::make_shared<CBVHAccel>(CBVHAccel(m_hittables, 32, CBVHAccel::SAH));
+    if (m_accel)
+        m_accel->BeginProfile();
+
+    for (const auto &obj : m_hittables)
+        obj->BeginBVHProfile();
+}
+
+//----------------------------------------------------
+
+void    CHittableList::EndBVHProfile()
+{
+    if (m_accel)
+        m_accel->EndProfile();
+
+    for (const auto &obj : m_hittables)
+        obj->EndBVHProfile();
+}
+
+//----------------------------------------------------
+
+bool    CHittableList::BuildAccel(EAccelType type, const char *cacheDirectory)
+{
+    // bounds of the whole list, for lists nested in other hittables
+    m_aabb = CAABB();
+    for (const auto &obj : m_hittables)
+        m_aabb = m_aabb + obj->m_aabb;
+
+    m_accelType = type;
+    if (cacheDirectory != nullptr)
+        m_cacheDirectory = cacheDirectory;
+    switch (type)
+    {
+    case ACCEL_BVH:
+    {
+        CBVHAccel::SBuildSetting    setting;
+        setting.maxHittablesInNode = 32;
+        setting.partitionMethod = CBVHAccel::SAH;
+        setting.width = 4;
+        setting.cacheDirectory = m_cacheDirectory;
+
+        // build in place, the tree is move-only
+        m_accel = std::make_shared<CBVHAccel>(m_hittables, setting);
+        break;
+    }
+    case ACCEL_GRID:
+        m_accel = std::make_shared<CGridAccel>(m_hittables, CGridAccel::SBuildSetting());
+        break;
+    case ACCEL_KDTREE:
+        m_accel = std::make_shared<CKdTreeAccel>(m_hittables, CKdTreeAccel::SBuildSetting());
+        break;
+    default:
+        printf("[Accel] Error: Unknown acceleration structure type %d.\n", (int)type);
+        m_accel.reset();
+        return false;
+    }
 
     // clear local hittable list which now is a dublicate data with the one in bvh-tree.
-    // if (!m_bvhAccel->IsEmpty())
+    // if (!m_accel->IsEmpty())
     //    m_hittables.clear();
 
     return true;
 }
 
+//----------------------------------------------------
+
+bool    CHittableList::UpdateBVHTree()
+{
+    if (m_dynamicBvh)
+    {
+        m_dynamicBvh->Refit();
+        return true;
+    }
+
+    // brute-force lists stay brute-force
+    if (!m_accel)
+        return true;
+
+    if (!m_accel->Refit())
+    {
+        if (m_accelType == ACCEL_BVH)
+            printf("[BVH] Refitted tree degraded, rebuilding...\n");
+        return BuildAccel(m_accelType);
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittableList::Insert(const std::shared_ptr<IHittable> &object)
+{
+    if (std::find(m_hittables.begin(), m_hittables.end(), object) != m_hittables.end())
+        return false;
+
+    m_hittables.push_back(object);
+
+    if (!m_dynamicBvh)
+    {
+        m_dynamicBvh = std::make_shared<CDynamicBVH>(m_hittables);
+        m_accel.reset();
+        return true;
+    }
+
+    return m_dynamicBvh->Insert(object);
+}
+
+//----------------------------------------------------
+
+bool    CHittableList::Remove(const std::shared_ptr<IHittable> &object)
+{
+    auto    it = std::find(m_hittables.begin(), m_hittables.end(), object);
+    if (it == m_hittables.end())
+        return false;
+
+    m_hittables.erase(it);
+
+    if (!m_dynamicBvh)
+    {
+        m_dynamicBvh = std::make_shared<CDynamicBVH>(m_hittables);
+        m_accel.reset();
+        return true;
+    }
+
+    return m_dynamicBvh->Remove(object);
+}
+
 //----------------------------------------------------
 _CD_NAMESPACE_END
@@ -1,11 +1,12 @@
 #pragma once
 
 #include "hittable.h"
+#include "accel.h"
 
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
 
-class CBVHAccel;
+class CDynamicBVH;
 
 //----------------------------------------------------
 
@@ -17,16 +18,39 @@ public:
 
     virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override;
     virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override;
-
-    // Construct bvh-tree from the loaded hittables. Call this once all the
-    // hittables are loaded in "m_hittables".
-    bool            BuildBVHTree();
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override;
+    virtual void    HitPacket(CRayPacket &packet, int first, SHitRec *hitRecs) override;
+    virtual void    HitAllPacket(CRayPacket &packet, int first, VHits *hits) override;
+    virtual void    Translate(const glm::vec3 &offset) override;
+    virtual void    BeginBVHProfile() override;
+    virtual void    EndBVHProfile() override;
+
+    // Construct the acceleration structure of "type" from the loaded hittables.
+    // Call this once all the hittables are loaded in "m_hittables". When
+    // "cacheDirectory" is given, a bvh-tree is loaded from there if the
+    // hittables did not change. The directory is kept for later rebuilds.
+    bool            BuildAccel(EAccelType type, const char *cacheDirectory = nullptr);
+    bool            BuildBVHTree(const char *cacheDirectory = nullptr) { return BuildAccel(ACCEL_BVH, cacheDirectory); }
+
+    // Update the acceleration structure after hittables moved. A bvh-tree is
+    // refitted, and only rebuilt when refitting degraded it too much; the
+    // other structures are rebuilt. Lists without one are left as they are.
+    bool            UpdateBVHTree();
+
+    // Incremental edits. These keep a dynamic bvh-tree up to date instead of
+    // rebuilding; the static bvh-tree is dropped on the first edit. Both
+    // return false if the object is already in / not in the list.
+    bool            Insert(const std::shared_ptr<IHittable> &object);
+    bool            Remove(const std::shared_ptr<IHittable> &object);
 
 public:
-    // Hittable list will first attempt to use "m_bvhAccel" is available, 
-    // otherwise uses "m_hittables" which is a brute-force traversal.
+    // Hittable list will first attempt to use "m_dynamicBvh" or "m_accel" if
+    // available, otherwise uses "m_hittables" which is a brute-force traversal.
     std::vector<std::shared_ptr<IHittable>>     m_hittables;
-    std::shared_ptr<CBVHAccel>                  m_bvhAccel;     // bvh-tree acceleration
+    std::shared_ptr<IAccel>                     m_accel;        // bvh-tree, grid or kd-tree acceleration
+    EAccelType                                  m_accelType = ACCEL_BVH;
+    std::string                                 m_cacheDirectory;   // bvh-tree cache, empty -> no caching
+    std::shared_ptr<CDynamicBVH>                m_dynamicBvh;   // incrementally updated bvh-tree
 };
 
 //----------------------------------------------------
@@ -0,0 +1,434 @@
+#include "kdtree_accel.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <chrono>   // steady_clock
+#include <cmath>
+#include <cstdio>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// Traversal stack, every level pushes at most one node. The tree depth is
+// clamped below it.
+static constexpr int    _KD_STACK_DEPTH = 64;
+
+//----------------------------------------------------
+
+CKdTreeAccel::CKdTreeAccel()
+{
+}
+
+//----------------------------------------------------
+
+CKdTreeAccel::CKdTreeAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const SBuildSetting &setting)
+: m_setting(setting)
+, m_hittables(hittables)
+{
+    if (m_hittables.empty())
+        return;
+
+    printf("[KdTree] Start kd-tree construction...\n");
+    auto    begin = std::chrono::steady_clock::now();
+
+    m_maxDepth = (m_setting.maxDepth >= 0) ? m_setting.maxDepth : (int)std::lround(8 + 1.3f * std::log2((float)m_hittables.size()));
+    m_maxDepth = std::min(m_maxDepth, _KD_STACK_DEPTH - 1);
+
+    std::vector<CAABB>  hittableBounds(m_hittables.size());
+    std::vector<int>    hittableNums(m_hittables.size());
+    for (size_t i = 0; i < m_hittables.size(); i++)
+    {
+        hittableBounds[i] = m_hittables[i]->m_aabb;
+        hittableNums[i] = i;
+        m_bounds = m_bounds + hittableBounds[i];
+    }
+
+    m_nodes.emplace_back();
+    _BuildTree(0, m_bounds, hittableBounds, hittableNums, m_maxDepth, 0);
+
+    m_buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+    const SStats    stats = GetStats();
+    printf("[KdTree] Done. nodes: %d, leaves: %d (%d empty), references: %d, max depth: %d, %.1f ms\n",
+            stats.nNodes, stats.nLeaves, stats.nEmptyLeaves, stats.nReferences, stats.maxDepth, stats.buildMs);
+}
+
+//----------------------------------------------------
+
+void    CKdTreeAccel::_InitLeaf(int nodeNum, const std::vector<int> &hittableNums)
+{
+    SKdNode &node = m_nodes[nodeNum];
+    node.hittablesOffset = m_hittableIndices.size();
+    node.flags = 3 | (hittableNums.size() << 2);
+    m_hittableIndices.insert(m_hittableIndices.end(), hittableNums.begin(), hittableNums.end());
+}
+
+//----------------------------------------------------
+
+// "hittableNums" is consumed, children get their own lists
+void    CKdTreeAccel::_BuildTree(int nodeNum, const CAABB &nodeBounds, const std::vector<CAABB> &hittableBounds, std::vector<int> &hittableNums, int depth, int nBadRefines)
+{
+    const int   nHittables = hittableNums.size();
+    if (nHittables <= m_setting.maxHittablesInNode || depth == 0)
+    {
+        _InitLeaf(nodeNum, hittableNums);
+        return;
+    }
+
+    // choose the split with the lowest SAH cost, trying the longest axis
+    // first and the others only if it has no usable split
+    const float     oldCost = m_setting.intersectCost * nHittables;
+    const float     invTotalArea = 1.f / nodeBounds.SurfaceArea();
+    const glm::vec3 diagonal = nodeBounds.Diagonal();
+
+    int                         bestAxis = -1, bestOffset = -1;
+    float                       bestCost = _INFINITY;
+    std::vector<SBoundEdge>     edges(2 * nHittables), bestEdges;
+    int                         axis = nodeBounds.MaxExtent();
+
+    for (int retries = 0; retries < 3 && bestAxis < 0; retries++, axis = (axis + 1) % 3)
+    {
+        for (int i = 0; i < nHittables; i++)
+        {
+            const CAABB &bounds = hittableBounds[hittableNums[i]];
+            edges[2 * i] = { bounds.pMin[axis], hittableNums[i], true };
+            edges[2 * i + 1] = { bounds.pMax[axis], hittableNums[i], false };
+        }
+        // at the same position, starts sort before ends, so that flat hittables
+        // always end up on at least one side
+        std::sort(edges.begin(), edges.end(), [](const SBoundEdge &a, const SBoundEdge &b) {
+            return (a.t == b.t) ? (a.isStart && !b.isStart) : (a.t < b.t); });
+
+        const int   otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+        int         nBelow = 0, nAbove = nHittables;
+
+        for (int i = 0; i < 2 * nHittables; i++)
+        {
+            if (!edges[i].isStart)
+                nAbove--;
+
+            const float edgeT = edges[i].t;
+            if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis])
+            {
+                const float belowArea = 2 * (diagonal[otherAxis0] * diagonal[otherAxis1] +
+                                             (edgeT - nodeBounds.pMin[axis]) * (diagonal[otherAxis0] + diagonal[otherAxis1]));
+                const float aboveArea = 2 * (diagonal[otherAxis0] * diagonal[otherAxis1] +
+                                             (nodeBounds.pMax[axis] - edgeT) * (diagonal[otherAxis0] + diagonal[otherAxis1]));
+                const float pBelow = belowArea * invTotalArea;
+                const float pAbove = aboveArea * invTotalArea;
+                const float emptyBonus = (nAbove == 0 || nBelow == 0) ? m_setting.emptyBonus : 0;
+                const float cost = m_setting.traversalCost +
+                                   m_setting.intersectCost * (1 - emptyBonus) * (pBelow * nBelow + pAbove * nAbove);
+
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = i;
+                }
+            }
+
+            if (edges[i].isStart)
+                nBelow++;
+        }
+
+        if (bestAxis == axis)
+            bestEdges.swap(edges);
+        edges.resize(2 * nHittables);
+    }
+
+    // leaf, if no split pays off for a while
+    if (bestCost > oldCost)
+        nBadRefines++;
+    if ((bestCost > 4 * oldCost && nHittables < 16) || bestAxis < 0 || nBadRefines == 3)
+    {
+        _InitLeaf(nodeNum, hittableNums);
+        return;
+    }
+
+    // hittables starting before the split go below, ending after it go above
+    std::vector<int>    below, above;
+    for (int i = 0; i < bestOffset; i++)
+    {
+        if (bestEdges[i].isStart)
+            below.push_back(bestEdges[i].hittableNum);
+    }
+    for (int i = bestOffset + 1; i < 2 * nHittables; i++)
+    {
+        if (!bestEdges[i].isStart)
+            above.push_back(bestEdges[i].hittableNum);
+    }
+
+    const float split = bestEdges[bestOffset].t;
+    std::vector<SBoundEdge>().swap(bestEdges);
+    std::vector<int>().swap(hittableNums);
+
+    CAABB   belowBounds = nodeBounds, aboveBounds = nodeBounds;
+    belowBounds.pMax[bestAxis] = split;
+    aboveBounds.pMin[bestAxis] = split;
+
+    // the below child follows its parent, the above child goes after the below subtree
+    m_nodes.emplace_back();
+    _BuildTree(nodeNum + 1, belowBounds, hittableBounds, below, depth - 1, nBadRefines);
+
+    const int   aboveChild = m_nodes.size();
+    m_nodes.emplace_back();
+    _BuildTree(aboveChild, aboveBounds, hittableBounds, above, depth - 1, nBadRefines);
+
+    SKdNode &node = m_nodes[nodeNum];
+    node.split = split;
+    node.flags = bestAxis | (aboveChild << 2);
+}
+
+//----------------------------------------------------
+
+bool    CKdTreeAccel::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
+{
+    if (this->IsEmpty())
+        return false;
+
+    SCounters   *counters = m_counters.get();
+    if (counters)
+        counters->nRays.fetch_add(1, std::memory_order_relaxed);
+
+    return _Traverse(ray, t_min, t_max, &hitRec, nullptr, counters);
+}
+
+//----------------------------------------------------
+
+bool    CKdTreeAccel::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const
+{
+    if (this->IsEmpty())
+        return false;
+
+    SCounters   *counters = m_counters.get();
+    if (counters)
+        counters->nRays.fetch_add(1, std::memory_order_relaxed);
+
+    // straddling hittables are listed on both sides, test each one once
+    std::vector<int>    candidates;
+    _Traverse(ray, t_min, t_max, nullptr, &candidates, counters);
+
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    if (counters)
+        counters->nHittableTests.fetch_add(candidates.size(), std::memory_order_relaxed);
+
+    const size_t    nHits = hits.size();
+    for (int hittable : candidates)
+        m_hittables[hittable]->HitAll(ray, t_min, t_max, hits);
+
+    return hits.size() > nHits;
+}
+
+//----------------------------------------------------
+
+bool    CKdTreeAccel::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    if (this->IsEmpty())
+        return false;
+
+    SCounters   *counters = m_counters.get();
+    if (counters)
+        counters->nRays.fetch_add(1, std::memory_order_relaxed);
+
+    return _Traverse(ray, t_min, t_max, nullptr, nullptr, counters);
+}
+
+//----------------------------------------------------
+
+bool    CKdTreeAccel::_Traverse(const CRay &ray, float t_min, float t_max, SHitRec *hitRec, std::vector<int> *candidates, SCounters *counters) const
+{
+    // clip the ray to the tree bounds
+    const CTraversalRay traversalRay(ray, t_min, t_max);
+    const glm::vec3     &invDir = traversalRay.m_invDir;
+    float               tMin, tMax;
+    if (!m_bounds.Hit(traversalRay, tMin, tMax))
+        return false;
+
+    struct SKdToDo
+    {
+        int     node;
+        float   tMin, tMax;
+    };
+    SKdToDo     toDo[_KD_STACK_DEPTH];
+    int         toDoOffset = 0;
+
+    SHitRec     hitTmp;
+    bool        isHit = false;
+    float       tClosest = t_max;
+    int         nodeNum = 0;
+
+    while (true)
+    {
+        // nodes farther than the closest hit cannot hold a closer one
+        if (tClosest < tMin)
+            break;
+
+        const SKdNode   *node = &m_nodes[nodeNum];
+        if (counters)
+            counters->nNodeVisits.fetch_add(1, std::memory_order_relaxed);
+
+        if (!node->IsLeaf())
+        {
+            // visit the child on the ray origin's side first
+            const int   axis = node->SplitAxis();
+            const float tPlane = (node->split - ray.m_origin[axis]) * invDir[axis];
+            const bool  isBelowFirst = (ray.m_origin[axis] < node->split) ||
+                                       (ray.m_origin[axis] == node->split && ray.m_dir[axis] <= 0);
+            const int   firstChild = isBelowFirst ? nodeNum + 1 : node->AboveChild();
+            const int   secondChild = isBelowFirst ? node->AboveChild() : nodeNum + 1;
+
+            if (tPlane > tMax || tPlane <= 0)
+                nodeNum = firstChild;
+            else if (tPlane < tMin)
+                nodeNum = secondChild;
+            else
+            {
+                toDo[toDoOffset++] = { secondChild, tPlane, tMax };
+                nodeNum = firstChild;
+                tMax = tPlane;
+            }
+            continue;
+        }
+
+        const int   *hittableNums = &m_hittableIndices[node->hittablesOffset];
+        const int   nHittables = node->NumHittables();
+
+        if (candidates)
+            candidates->insert(candidates->end(), hittableNums, hittableNums + nHittables);
+        else if (!hitRec)
+        {
+            // any hit ends an occlusion query
+            for (int i = 0; i < nHittables; i++)
+            {
+                if (counters)
+                    counters->nHittableTests.fetch_add(1, std::memory_order_relaxed);
+                if (m_hittables[hittableNums[i]]->Occluded(ray, t_min, t_max))
+                    return true;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < nHittables; i++)
+            {
+                if (m_hittables[hittableNums[i]]->Hit(ray, t_min, tClosest, hitTmp))
+                {
+                    *hitRec = hitTmp;
+                    tClosest = hitTmp.t;
+                    isHit = true;
+                }
+            }
+
+            if (counters)
+                counters->nHittableTests.fetch_add(nHittables, std::memory_order_relaxed);
+        }
+
+        if (toDoOffset == 0)
+            break;
+        --toDoOffset;
+        nodeNum = toDo[toDoOffset].node;
+        tMin = toDo[toDoOffset].tMin;
+        tMax = toDo[toDoOffset].tMax;
+    }
+
+    return isHit;
+}
+
+//----------------------------------------------------
+
+void    CKdTreeAccel::BeginProfile()
+{
+    m_counters = std::make_shared<SCounters>();
+}
+
+//----------------------------------------------------
+
+void    CKdTreeAccel::EndProfile()
+{
+    if (!m_counters)
+        return;
+
+    m_profiledStats.nRays = m_counters->nRays.load(std::memory_order_relaxed);
+    m_profiledStats.nNodeVisits = m_counters->nNodeVisits.load(std::memory_order_relaxed);
+    m_profiledStats.nHittableTests = m_counters->nHittableTests.load(std::memory_order_relaxed);
+    m_counters.reset();
+}
+
+//----------------------------------------------------
+
+CKdTreeAccel::SStats    CKdTreeAccel::GetStats() const
+{
+    SStats  stats;
+    if (this->IsEmpty())
+        return stats;
+
+    stats.nNodes = m_nodes.size();
+    stats.nodeBytes = m_nodes.size() * sizeof(SKdNode);
+    stats.indexBytes = m_hittableIndices.size() * sizeof(int);
+    stats.buildMs = m_buildMs;
+
+    // depth-first walk, the root is at depth 0
+    std::vector<std::pair<int, int>>    stack = { { 0, 0 } };
+    while (!stack.empty())
+    {
+        const auto  [index, depth] = stack.back();
+        stack.pop_back();
+
+        const SKdNode   &node = m_nodes[index];
+        stats.maxDepth = std::max(stats.maxDepth, depth);
+        if (node.IsLeaf())
+        {
+            stats.nLeaves++;
+            stats.nEmptyLeaves += (node.NumHittables() == 0);
+            stats.nReferences += node.NumHittables();
+        }
+        else
+        {
+            stats.nInteriors++;
+            stack.push_back({ index + 1, depth + 1 });
+            stack.push_back({ node.AboveChild(), depth + 1 });
+        }
+    }
+
+    const int   nFilledLeaves = stats.nLeaves - stats.nEmptyLeaves;
+    stats.avgLeafHittables = (nFilledLeaves > 0) ? (float)stats.nReferences / nFilledLeaves : 0;
+
+    stats.nRays = m_profiledStats.nRays;
+    stats.nNodeVisits = m_profiledStats.nNodeVisits;
+    stats.nHittableTests = m_profiledStats.nHittableTests;
+
+    return stats;
+}
+
+//----------------------------------------------------
+
+std::string CKdTreeAccel::SStats::ToJson() const
+{
+    char    buffer[512];
+    snprintf(buffer, sizeof(buffer),
+        "{\n"
+        "  \"accel\": \"kdtree\",\n"
+        "  \"nodes\": %d,\n"
+        "  \"interiors\": %d,\n"
+        "  \"leaves\": %d,\n"
+        "  \"emptyLeaves\": %d,\n"
+        "  \"references\": %d,\n"
+        "  \"maxDepth\": %d,\n"
+        "  \"avgLeafHittables\": %.3f,\n"
+        "  \"nodeBytes\": %zu,\n"
+        "  \"indexBytes\": %zu,\n"
+        "  \"buildMs\": %.3f,\n"
+        "  \"rays\": %llu,\n"
+        "  \"nodeVisits\": %llu,\n"
+        "  \"hittableTests\": %llu\n"
+        "}\n",
+        nNodes, nInteriors, nLeaves, nEmptyLeaves, nReferences, maxDepth, avgLeafHittables, nodeBytes, indexBytes,
+        buildMs, (unsigned long long)nRays, (unsigned long long)nNodeVisits, (unsigned long long)nHittableTests);
+
+    return buffer;
+}
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
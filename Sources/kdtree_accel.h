@@ -0,0 +1,129 @@
+#pragma once
+
+/*************************************************************************
+*
+*		kdtree_accel.h
+*
+*		SAH kd-tree acceleration structure. Space is split by axis
+*		aligned planes placed on hittable bound edges, chosen by the
+*		surface area heuristic, and hittables that straddle a plane
+*		are referenced from both sides. Nodes are 8 bytes, and rays
+*		visit them strictly front to back, so traversal stops at the
+*		first node that is farther than the closest hit.
+*
+*		This code referenced and modified the book "Physically Based
+*		Rendering" 3rd edition, chapter 4.4, Kd-Tree Accelerator.
+*		https://www.pbrt.org/
+*
+**************************************************************************/
+
+#include "accel.h"
+#include "aabb.h"
+
+#include <atomic>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class IHittable;
+
+//----------------------------------------------------
+
+class CKdTreeAccel : public IAccel
+{
+    struct SKdNode
+    {
+        inline bool     IsLeaf() const          { return (flags & 3) == 3; }
+        inline int      SplitAxis() const       { return flags & 3; }
+        inline int      NumHittables() const    { return flags >> 2; }
+        inline int      AboveChild() const      { return flags >> 2; }
+
+        union
+        {
+            float   split;              // interior
+            int     hittablesOffset;    // leaf, into m_hittableIndices
+        };
+        uint32_t    flags;              // low 2 bits: split axis or 3 for leaves, high 30 bits: above child or # of hittables
+    };
+
+    // start or end of a hittable's bounds along the axis being split
+    struct SBoundEdge
+    {
+        float   t;
+        int     hittableNum;
+        bool    isStart;
+    };
+
+    // traversal counters, allocated while profiling only
+    struct SCounters
+    {
+        std::atomic<uint64_t>   nRays{0}, nNodeVisits{0}, nHittableTests{0};
+    };
+
+public:
+    struct SBuildSetting
+    {
+        float       intersectCost = 80;         // SAH cost of a hittable test, relative to a node traversal
+        float       traversalCost = 1;
+        float       emptyBonus = 0.5f;          // cost reduction of splits that leave a side empty
+        int         maxHittablesInNode = 1;     // stop splitting at this # of hittables
+        int         maxDepth = -1;              // -1 -> 8 + 1.3 log2(# of hittables)
+    };
+
+    struct SStats
+    {
+        int         nNodes = 0;
+        int         nInteriors = 0;
+        int         nLeaves = 0;
+        int         nEmptyLeaves = 0;
+        int         nReferences = 0;            // hittables referenced by leaves, straddling hittables count once per side
+        int         maxDepth = 0;
+        float       avgLeafHittables = 0;       // over non-empty leaves
+        size_t      nodeBytes = 0;
+        size_t      indexBytes = 0;
+        double      buildMs = 0;
+
+        // traversal, between BeginProfile() and EndProfile()
+        uint64_t    nRays = 0;
+        uint64_t    nNodeVisits = 0;
+        uint64_t    nHittableTests = 0;
+
+        std::string ToJson() const;
+    };
+
+    CKdTreeAccel();
+    CKdTreeAccel(const std::vector<std::shared_ptr<IHittable>> &hittables, const SBuildSetting &setting);
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const override;
+    virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) const override;
+    virtual bool    IsEmpty() const override { return m_nodes.empty(); }
+
+    // Counts rays, node visits and hittable tests, see SStats.
+    virtual void    BeginProfile() override;
+    virtual void    EndProfile() override;
+
+    virtual std::string GetStatsJson() const override { return GetStats().ToJson(); }
+    SStats          GetStats() const;
+
+private:
+    void            _BuildTree(int nodeNum, const CAABB &nodeBounds, const std::vector<CAABB> &hittableBounds, std::vector<int> &hittableNums, int depth, int nBadRefines);
+    void            _InitLeaf(int nodeNum, const std::vector<int> &hittableNums);
+    // closest hit into "hitRec", or all hittables of the leaves the ray crosses into "candidates"
+    // With neither, returns at the first hit (any-hit query).
+    bool            _Traverse(const CRay &ray, float t_min, float t_max, SHitRec *hitRec, std::vector<int> *candidates, SCounters *counters) const;
+
+    SBuildSetting                           m_setting;
+    std::vector<std::shared_ptr<IHittable>> m_hittables;
+    std::vector<SKdNode>                    m_nodes;
+    std::vector<int>                        m_hittableIndices;      // leaf lists
+    CAABB                                   m_bounds;
+    int                                     m_maxDepth = 0;
+    double                                  m_buildMs = 0;
+
+    std::shared_ptr<SCounters>              m_counters;
+    SStats                                  m_profiledStats;        // traversal counters of the last profile
+};
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
@@ -56,6 +56,9 @@ void init()
     renderSetting.K_TOTAL_DR_S      = 1.f;
     renderSetting.EXP_TOTAL_DR_S    = 1.f;
 
+    renderSetting.nProfileRes       = 64;
+    renderSetting.tileSize          = 8;
+
     renderer.SetRenderSetting(renderSetting);
     renderer.InitScene();
 }
@@ -0,0 +1,125 @@
+#include "mapped_file.h"
+#include "memory.h"
+
+#include <stdio.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+CMappedFile::CMappedFile()
+{
+}
+
+//----------------------------------------------------
+
+CMappedFile::~CMappedFile()
+{
+    Close();
+}
+
+//----------------------------------------------------
+
+bool    CMappedFile::Open(const std::string &path)
+{
+    Close();
+
+    // 1. map the file
+#if defined(_WIN32)
+    HANDLE  file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER   fileSize;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+    {
+        m_mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if (m_mapping != nullptr)
+        {
+            m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0));
+            if (m_data == nullptr)
+            {
+                CloseHandle(m_mapping);
+                m_mapping = nullptr;
+            }
+        }
+        m_size = fileSize.QuadPart;
+    }
+    CloseHandle(file);
+#else
+    const int   fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void    *ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        m_data = (ptr != MAP_FAILED) ? static_cast<uint8_t*>(ptr) : nullptr;
+        m_size = st.st_size;
+    }
+    close(fd);
+#endif
+
+    if (m_data != nullptr)
+    {
+        m_isMapped = true;
+        return true;
+    }
+    if (m_size == 0)
+        return false;
+
+    // 2. fall back to reading the whole file
+    FILE    *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+
+    m_data = static_cast<uint8_t*>(AllocAligned(m_size));
+    const bool  isRead = (m_data != nullptr) && (fread(m_data, 1, m_size, file) == m_size);
+    fclose(file);
+
+    if (!isRead)
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+void    CMappedFile::Close()
+{
+    if (m_data != nullptr)
+    {
+        if (m_isMapped)
+        {
+#if defined(_WIN32)
+            UnmapViewOfFile(m_data);
+            CloseHandle(m_mapping);
+            m_mapping = nullptr;
+#else
+            munmap(m_data, m_size);
+#endif
+        }
+        else
+            FreeAligned(m_data);
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_isMapped = false;
+}
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
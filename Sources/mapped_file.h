@@ -0,0 +1,47 @@
+#pragma once
+
+/*************************************************************************
+*
+*		mapped_file.h
+*
+*		Read-only file mapped into memory (mmap / MapViewOfFile).
+*		Pages are copy-on-write, so the contents can be modified in
+*		place without touching the file. When the file cannot be
+*		mapped, it is read into an aligned buffer instead.
+*
+**************************************************************************/
+
+#include "common.h"
+
+#include <string>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class CMappedFile
+{
+public:
+    CMappedFile();
+    ~CMappedFile();
+
+    CMappedFile(const CMappedFile &) = delete;
+    CMappedFile& operator=(const CMappedFile &) = delete;
+
+    bool            Open(const std::string &path);
+    void            Close();
+
+    inline bool     IsOpen() const { return (m_data != nullptr); }
+    inline uint8_t* Data() const { return m_data; }
+    inline size_t   Size() const { return m_size; }
+
+private:
+    uint8_t     *m_data = nullptr;
+    size_t      m_size = 0;
+    bool        m_isMapped = false;     // false -> m_data is an AllocAligned() copy
+#if defined(_WIN32)
+    void        *m_mapping = nullptr;
+#endif
+};
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
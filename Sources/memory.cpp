@@ -0,0 +1,123 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+void*   AllocAligned(size_t size, size_t alignment)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, alignment);
+#else
+    void    *ptr = nullptr;
+    if (posix_memalign(&ptr, alignment, size) != 0)
+        return nullptr;
+    return ptr;
+#endif
+}
+
+//----------------------------------------------------
+
+void    FreeAligned(void *ptr)
+{
+    if (ptr == nullptr)
+        return;
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+//----------------------------------------------------
+
+CMemoryArena::CMemoryArena(size_t blockSize)
+: m_blockSize(blockSize)
+{
+#if defined(_OPENMP)
+    m_cursors.resize(omp_get_max_threads() + 1);
+#else
+    m_cursors.resize(1);
+#endif
+}
+
+//----------------------------------------------------
+
+CMemoryArena::~CMemoryArena()
+{
+    Release();
+}
+
+//----------------------------------------------------
+
+void*   CMemoryArena::Alloc(size_t nBytes)
+{
+    // keep every allocation 16-byte aligned
+    nBytes = (nBytes + 15) & ~(size_t)15;
+
+#if defined(_OPENMP)
+    const size_t    thread = omp_get_thread_num();
+    if (thread + 1 < m_cursors.size())
+        return _Alloc(m_cursors[thread], nBytes);
+#endif
+
+    // threads beyond the ones counted at construction share the last cursor
+    std::lock_guard<std::mutex>     lock(m_sharedMutex);
+    return _Alloc(m_cursors.back(), nBytes);
+}
+
+//----------------------------------------------------
+
+void*   CMemoryArena::_Alloc(SCursor &cursor, size_t nBytes)
+{
+    if (cursor.blockPos + nBytes > cursor.blockSize)
+    {
+        // start a new block, oversized requests get a block of their own
+        const size_t    blockSize = std::max(nBytes, m_blockSize);
+        uint8_t         *block = static_cast<uint8_t*>(AllocAligned(blockSize));
+        if (block == nullptr)
+        {
+            printf("[Memory] Failed to allocate an arena block of %zu bytes\n", blockSize);
+            throw std::bad_alloc();
+        }
+
+        {
+            std::lock_guard<std::mutex>     lock(m_mutex);
+            m_blocks.push_back(block);
+            m_totalAllocated += blockSize;
+        }
+
+        cursor.block = block;
+        cursor.blockPos = 0;
+        cursor.blockSize = blockSize;
+    }
+
+    void    *ptr = cursor.block + cursor.blockPos;
+    cursor.blockPos += nBytes;
+    return ptr;
+}
+
+//----------------------------------------------------
+
+void    CMemoryArena::Release()
+{
+    std::lock_guard<std::mutex>     lock(m_mutex);
+
+    for (uint8_t *block : m_blocks)
+        FreeAligned(block);
+
+    m_blocks.clear();
+    for (SCursor &cursor : m_cursors)
+        cursor = SCursor();
+    m_totalAllocated = 0;
+}
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
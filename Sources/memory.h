@@ -0,0 +1,105 @@
+#pragma once
+
+/*************************************************************************
+*
+*		memory.h
+*
+*		Aligned allocation and a bump (arena) allocator for
+*		short-lived objects that are freed all at once, e.g. the
+*		build nodes of an acceleration structure.
+*
+**************************************************************************/
+
+#include "common.h"
+
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+constexpr size_t    _CACHE_LINE_SIZE = 64;
+
+void*   AllocAligned(size_t size, size_t alignment = _CACHE_LINE_SIZE);
+void    FreeAligned(void *ptr);
+
+// allocates and default constructs "count" objects. objects are never
+// destructed, so only use this for trivially destructible types.
+template <typename T>
+T*      AllocAligned(size_t count, size_t alignment = _CACHE_LINE_SIZE)
+{
+    static_assert(std::is_trivially_destructible<T>::value, "AllocAligned() does not call destructors");
+
+    T   *ptr = static_cast<T*>(AllocAligned(count * sizeof(T), std::max(alignment, alignof(T))));
+    if (ptr != nullptr)
+    {
+        for (size_t i = 0; i < count; i++)
+            new (&ptr[i]) T();
+    }
+    return ptr;
+}
+
+// deleter for std::unique_ptr holding memory from AllocAligned(). a
+// non-owning deleter lets the same pointer type view memory owned elsewhere,
+// e.g. a mapped file.
+struct SAlignedDeleter
+{
+    void operator()(void *ptr) const { if (isOwner) FreeAligned(ptr); }
+
+    bool    isOwner = true;
+};
+
+//----------------------------------------------------
+
+class CMemoryArena
+{
+public:
+    CMemoryArena(size_t blockSize = 256 * 1024);
+    ~CMemoryArena();
+
+    CMemoryArena(const CMemoryArena &) = delete;
+    CMemoryArena& operator=(const CMemoryArena &) = delete;
+
+    // Thread-safe, build tasks may allocate concurrently. Every OpenMP thread
+    // bumps its own block, the lock is only taken to get a new block. Throws
+    // std::bad_alloc when a block cannot be allocated.
+    void*           Alloc(size_t nBytes);
+    template <typename T>
+    T*              Alloc(size_t count = 1)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "CMemoryArena does not call destructors");
+
+        T   *ptr = static_cast<T*>(Alloc(count * sizeof(T)));
+        for (size_t i = 0; i < count; i++)
+            new (&ptr[i]) T();
+        return ptr;
+    }
+
+    // frees every allocation at once, not while other threads allocate
+    void            Release();
+    size_t          TotalAllocated() const { return m_totalAllocated; }
+
+private:
+    // block being bumped by one thread, on a cache line of its own
+    struct alignas(_CACHE_LINE_SIZE) SCursor
+    {
+        uint8_t     *block = nullptr;
+        size_t      blockPos = 0;
+        size_t      blockSize = 0;
+    };
+
+    void*           _Alloc(SCursor &cursor, size_t nBytes);
+
+    const size_t            m_blockSize;
+    std::vector<SCursor>    m_cursors;          // one per thread, the last one is shared by the threads past them
+    std::vector<uint8_t*>   m_blocks;
+    size_t                  m_totalAllocated = 0;
+    std::mutex              m_mutex;            // guards "m_blocks" and "m_totalAllocated"
+    std::mutex              m_sharedMutex;      // guards the shared cursor
+};
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
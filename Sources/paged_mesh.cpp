@@ -0,0 +1,797 @@
+#include "paged_mesh.h"
+#include "bvh.h"
+#include "ray.h"
+
+#include "tiny_obj_loader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <random>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+// Paged file version. Bump this whenever the layout below changes.
+static constexpr uint32_t   _PAGED_MESH_VERSION = 1;
+// page bvh-trees are built to this depth at most, which bounds the traversal stack
+static constexpr int        _PAGE_STACK_DEPTH = 64;
+static constexpr int        _PAGE_N_BUCKETS = 12;
+static constexpr uint64_t   _PAGE_ALIGNMENT = 64;
+
+// File layout: header | SPageEntry[nPages] | pages. A page is
+// SPageNode[nNodes] | SPageTriangle[nTriangles], at a 64 byte aligned offset.
+struct SPagedMeshHeader
+{
+    char        magic[4];
+    uint32_t    version;
+    int32_t     nPages;
+    int32_t     nTriangles;
+    uint32_t    nodeSize;
+    uint32_t    entrySize;
+    CAABB       bounds;
+    uint8_t     pad[16];
+};
+static_assert(sizeof(SPagedMeshHeader) == 64, "paged mesh header must keep the page table aligned");
+
+// bvh-tree node of a page, in depth first order
+struct SPageNode
+{
+    CAABB       bounds;
+    int32_t     offset;         // interior: second child, leaf: first triangle
+    uint16_t    nTriangles;     // 0 -> interior
+    uint8_t     axis;           // interior: split axis
+    uint8_t     pad[1];
+};
+static_assert(sizeof(SPageNode) == 32, "page nodes are stored as is");
+
+struct SPageTriangle
+{
+    glm::vec3   v0, v1, v2;
+};
+
+//----------------------------------------------------
+
+struct CHittablePagedMesh::SPage
+{
+    std::vector<SPageNode>      nodes;
+    std::vector<SPageTriangle>  triangles;
+
+    bool            Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const;
+    bool            HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const;
+    bool            Occluded(const CRay &ray, float t_min, float t_max) const;
+    inline size_t   Bytes() const { return nodes.size() * sizeof(SPageNode) + triangles.size() * sizeof(SPageTriangle); }
+};
+
+//----------------------------------------------------
+
+class CHittablePagedMesh::CPageBounds : public IHittable
+{
+public:
+    CPageBounds(CHittablePagedMesh *mesh, int page)
+    : m_mesh(mesh)
+    , m_page(page)
+    {
+        m_aabb = mesh->m_pages[page].bounds;
+    }
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override
+    {
+        const std::shared_ptr<const SPage>  page = m_mesh->_FetchPage(m_page);
+        return page && page->Hit(ray, t_min, t_max, hitRec);
+    }
+    virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override
+    {
+        const std::shared_ptr<const SPage>  page = m_mesh->_FetchPage(m_page);
+        return page && page->HitAll(ray, t_min, t_max, hits);
+    }
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override
+    {
+        const std::shared_ptr<const SPage>  page = m_mesh->_FetchPage(m_page);
+        return page && page->Occluded(ray, t_min, t_max);
+    }
+
+    // pages never move, the mesh moves the rays instead
+    virtual void    Translate(const glm::vec3 &/*offset*/) override {}
+
+private:
+    CHittablePagedMesh  *m_mesh;
+    int                 m_page;
+};
+
+//----------------------------------------------------
+
+static inline glm::vec3 _Centroid(const SPageTriangle &triangle)
+{
+    return (triangle.v0 + triangle.v1 + triangle.v2) / 3.f;
+}
+
+//----------------------------------------------------
+
+static inline CAABB _Bounds(const SPageTriangle &triangle)
+{
+    return CAABB() + triangle.v0 + triangle.v1 + triangle.v2;
+}
+
+//----------------------------------------------------
+
+// same test as CHittableTriangle::Hit()
+static inline bool  _HitTriangle(const SPageTriangle &triangle, const CRay &ray, float t_min, float t_max, float &t)
+{
+    const glm::vec3 v1v0 = triangle.v1 - triangle.v0;
+    const glm::vec3 v2v0 = triangle.v2 - triangle.v0;
+    const glm::vec3 rov0 = ray.m_origin - triangle.v0;
+    const glm::vec3 n = glm::cross(v1v0, v2v0);
+    const glm::vec3 q = glm::cross(rov0, ray.m_dir);
+    const float     d = 1.0f / glm::dot(ray.m_dir, n);
+    const float     u = d * glm::dot(-q, v2v0);
+    const float     v = d * glm::dot(q, v1v0);
+    t = d * glm::dot(-n, rov0);
+
+    // written so that NaNs (rays parallel to the triangle) miss
+    return (u >= 0.0f && v >= 0.0f && (u + v) <= 1.0f && t >= t_min && t <= t_max);
+}
+
+//----------------------------------------------------
+
+static inline void  _FillHit(const SPageTriangle &triangle, const CRay &ray, float t, SHitRec &hitRec)
+{
+    hitRec.t = t;
+    hitRec.p = ray.At(t);
+    hitRec.n = glm::normalize(glm::cross(triangle.v1 - triangle.v0, triangle.v0 - triangle.v2));
+    hitRec.setFaceNormal(ray);
+}
+
+//----------------------------------------------------
+
+// Calls "visitLeaf(first, nTriangles, tMax)" for the leaves the ray reaches
+// before "tMax", nearest child first. "visitLeaf" returns the new "tMax",
+// -_INFINITY culls all the remaining nodes.
+template <typename F>
+static inline void  _TraversePage(const std::vector<SPageNode> &nodes, const CRay &ray, float t_min, float t_max, F visitLeaf)
+{
+    CTraversalRay   traversalRay(ray, t_min, t_max);
+
+    int     nodesToVisit[_PAGE_STACK_DEPTH];
+    int     toVisitOffset = 0;
+    int     currentNodeIndex = 0;
+
+    while (true)
+    {
+        const SPageNode &node = nodes[currentNodeIndex];
+
+        if (node.bounds.Hit(traversalRay))
+        {
+            if (node.nTriangles == 0)
+            {
+                if (traversalRay.m_dirIsNeg[node.axis])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.offset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node.offset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                continue;
+            }
+
+            traversalRay.m_tMax = visitLeaf(node.offset, node.nTriangles, traversalRay.m_tMax);
+        }
+
+        if (toVisitOffset == 0)
+            break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::SPage::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) const
+{
+    int     closest = -1;
+    float   tClosest = t_max;
+
+    _TraversePage(nodes, ray, t_min, t_max, [&](int first, int nTriangles, float /*tMax*/) {
+        for (int i = first; i < first + nTriangles; i++)
+        {
+            float   t;
+            if (_HitTriangle(triangles[i], ray, t_min, tClosest, t))
+            {
+                tClosest = t;
+                closest = i;
+            }
+        }
+        return tClosest;
+    });
+
+    if (closest < 0)
+        return false;
+
+    _FillHit(triangles[closest], ray, tClosest, hitRec);
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::SPage::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) const
+{
+    bool    isHit = false;
+
+    _TraversePage(nodes, ray, t_min, t_max, [&](int first, int nTriangles, float tMax) {
+        for (int i = first; i < first + nTriangles; i++)
+        {
+            float   t;
+            if (_HitTriangle(triangles[i], ray, t_min, t_max, t))
+            {
+                SHitRec hitRec;
+                _FillHit(triangles[i], ray, t, hitRec);
+                hits.push_back(hitRec);
+                isHit = true;
+            }
+        }
+        return tMax;
+    });
+
+    return isHit;
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::SPage::Occluded(const CRay &ray, float t_min, float t_max) const
+{
+    bool    isOccluded = false;
+
+    _TraversePage(nodes, ray, t_min, t_max, [&](int first, int nTriangles, float tMax) {
+        for (int i = first; i < first + nTriangles; i++)
+        {
+            float   t;
+            if (_HitTriangle(triangles[i], ray, t_min, t_max, t))
+            {
+                isOccluded = true;
+                return -_INFINITY;
+            }
+        }
+        return tMax;
+    });
+
+    return isOccluded;
+}
+
+//----------------------------------------------------
+
+// Splits the triangles [start, end) at the centroid median of the longest
+// axis until every range fits a page. Pages come out in depth first order,
+// so that pages close in space are close in the file.
+static void     _SplitPages(std::vector<SPageTriangle> &triangles, int start, int end, int trianglesPerPage, std::vector<std::pair<int, int>> &pages)
+{
+    if (end - start <= trianglesPerPage)
+    {
+        pages.emplace_back(start, end);
+        return;
+    }
+
+    CAABB   centroidBounds;
+    for (int i = start; i < end; i++)
+        centroidBounds = centroidBounds + _Centroid(triangles[i]);
+
+    const int   axis = centroidBounds.MaxExtent();
+    const int   mid = (start + end) / 2;
+    std::nth_element(triangles.begin() + start, triangles.begin() + mid, triangles.begin() + end,
+        [axis](const SPageTriangle &a, const SPageTriangle &b) { return _Centroid(a)[axis] < _Centroid(b)[axis]; });
+
+    _SplitPages(triangles, start, mid, trianglesPerPage, pages);
+    _SplitPages(triangles, mid, end, trianglesPerPage, pages);
+}
+
+//----------------------------------------------------
+
+// Builds the bvh-tree of the page triangles [start, end) with bucketed SAH
+// splits (see CBVHAccel::SAH), appending the nodes in depth first order.
+static void     _BuildPageTree(std::vector<SPageTriangle> &triangles, int start, int end, int maxTrianglesInLeaf, int depth, std::vector<SPageNode> &nodes)
+{
+    const int   nodeIndex = (int)nodes.size();
+    nodes.emplace_back();
+
+    CAABB   bounds, centroidBounds;
+    for (int i = start; i < end; i++)
+    {
+        bounds = bounds + _Bounds(triangles[i]);
+        centroidBounds = centroidBounds + _Centroid(triangles[i]);
+    }
+    nodes[nodeIndex].bounds = bounds;
+
+    const int   nTriangles = end - start;
+    const int   axis = centroidBounds.MaxExtent();
+    const float cMin = centroidBounds.pMin[axis];
+    const float cExtent = centroidBounds.pMax[axis] - cMin;
+
+    if (nTriangles <= maxTrianglesInLeaf || depth >= _PAGE_STACK_DEPTH - 1)
+    {
+        nodes[nodeIndex].offset = start;
+        nodes[nodeIndex].nTriangles = (uint16_t)nTriangles;
+        return;
+    }
+
+    int     mid = (start + end) / 2;
+    if (cExtent > 0)
+    {
+        auto    bucketOf = [&](const SPageTriangle &triangle) {
+            const int   b = (int)(_PAGE_N_BUCKETS * (_Centroid(triangle)[axis] - cMin) / cExtent);
+            return std::min(b, _PAGE_N_BUCKETS - 1);
+        };
+
+        int     counts[_PAGE_N_BUCKETS] = {};
+        CAABB   bucketBounds[_PAGE_N_BUCKETS];
+        for (int i = start; i < end; i++)
+        {
+            const int   b = bucketOf(triangles[i]);
+            counts[b]++;
+            bucketBounds[b] = bucketBounds[b] + _Bounds(triangles[i]);
+        }
+
+        // cost of splitting after each bucket
+        float   minCost = std::numeric_limits<float>::max();
+        int     minCostBucket = 0;
+        for (int i = 0; i < _PAGE_N_BUCKETS - 1; i++)
+        {
+            CAABB   b0, b1;
+            int     count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; j++)
+            {
+                b0 = b0 + bucketBounds[j];
+                count0 += counts[j];
+            }
+            for (int j = i + 1; j < _PAGE_N_BUCKETS; j++)
+            {
+                b1 = b1 + bucketBounds[j];
+                count1 += counts[j];
+            }
+            if (count0 == 0 || count1 == 0)
+                continue;
+
+            const float cost = count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea();
+            if (cost < minCost)
+            {
+                minCost = cost;
+                minCostBucket = i;
+            }
+        }
+
+        mid = (int)(std::partition(triangles.begin() + start, triangles.begin() + end,
+            [&](const SPageTriangle &triangle) { return bucketOf(triangle) <= minCostBucket; }) - triangles.begin());
+    }
+
+    nodes[nodeIndex].axis = (uint8_t)axis;
+    _BuildPageTree(triangles, start, mid, maxTrianglesInLeaf, depth + 1, nodes);
+    nodes[nodeIndex].offset = (int32_t)nodes.size();
+    _BuildPageTree(triangles, mid, end, maxTrianglesInLeaf, depth + 1, nodes);
+}
+
+//----------------------------------------------------
+
+static inline int   _Seek(FILE *file, uint64_t offset)
+{
+#if defined(_WIN32)
+    return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+// leaves the file position at the end
+static inline uint64_t  _FileSize(FILE *file)
+{
+#if defined(_WIN32)
+    return (_fseeki64(file, 0, SEEK_END) == 0) ? (uint64_t)std::max<__int64>(0, _ftelli64(file)) : 0;
+#else
+    return (fseeko(file, 0, SEEK_END) == 0) ? (uint64_t)std::max<off_t>(0, ftello(file)) : 0;
+#endif
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::Convert(const char *objFile, const char *pagedFile, const SBuildSetting &setting)
+{
+    // page leaves count their triangles in 16 bits
+    if (setting.trianglesPerPage < 1 || setting.trianglesPerPage > UINT16_MAX || setting.maxTrianglesInLeaf < 1)
+    {
+        printf("[PagedMesh] Error: Invalid build setting\n");
+        return false;
+    }
+
+    // load obj
+    tinyobj::attrib_t                   attrib;
+    std::vector<tinyobj::shape_t>       shapes;
+    std::vector<tinyobj::material_t>    materials;
+
+    std::string     warn;
+    std::string     err;
+
+    printf("[PagedMesh] Loading obj \"%s\"\n", objFile);
+    const bool  res = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, objFile, NULL, true);
+
+    if (!warn.empty())
+        printf("[PagedMesh] Warn: %s\n", warn.c_str());
+
+    if (!err.empty())
+        printf("[PagedMesh] Err: %s\n", err.c_str());
+
+    if (!res)
+    {
+        printf("[PagedMesh] Failed to load obj \"%s\"\n", objFile);
+        return false;
+    }
+
+    // tiny obj loader triangulated the faces, all shapes go into one mesh
+    std::vector<SPageTriangle>  triangles;
+    CAABB                       bounds;
+    for (const auto &shape : shapes)
+    {
+        for (size_t i = 0; i + 2 < shape.mesh.indices.size(); i += 3)
+        {
+            glm::vec3   v[3];
+            for (int k = 0; k < 3; k++)
+            {
+                const int   index = shape.mesh.indices[i + k].vertex_index;
+                v[k] = glm::vec3(attrib.vertices[3 * index + 0], attrib.vertices[3 * index + 1], attrib.vertices[3 * index + 2]);
+            }
+            triangles.push_back({ v[0], v[1], v[2] });
+            bounds = bounds + _Bounds(triangles.back());
+        }
+    }
+
+    if (triangles.empty() || triangles.size() > (size_t)std::numeric_limits<int32_t>::max())
+    {
+        printf("[PagedMesh] Error: Unsupported # of triangles %zu in \"%s\"\n", triangles.size(), objFile);
+        return false;
+    }
+
+    std::vector<std::pair<int, int>>    pageRanges;
+    _SplitPages(triangles, 0, (int)triangles.size(), setting.trianglesPerPage, pageRanges);
+
+    SPagedMeshHeader    header = {};
+    memcpy(header.magic, "CDPM", 4);
+    header.version = _PAGED_MESH_VERSION;
+    header.nPages = (int32_t)pageRanges.size();
+    header.nTriangles = (int32_t)triangles.size();
+    header.nodeSize = sizeof(SPageNode);
+    header.entrySize = sizeof(SPageEntry);
+    header.bounds = bounds;
+
+    // write to a temporary file first, so that readers never see a partial file
+    const std::string   tmpPath = std::string(pagedFile) + ".tmp" + std::to_string(std::random_device()());
+    FILE                *file = fopen(tmpPath.c_str(), "wb");
+    if (file == nullptr)
+    {
+        printf("[PagedMesh] Error: Failed to open \"%s\" for writing.\n", tmpPath.c_str());
+        return false;
+    }
+
+    // the page table is written last, once the page sizes are known
+    std::vector<SPageEntry> entries(pageRanges.size());
+    uint64_t                offset = sizeof(SPagedMeshHeader) + entries.size() * sizeof(SPageEntry);
+    bool                    isWritten = true;
+
+    for (size_t page = 0; page < pageRanges.size() && isWritten; page++)
+    {
+        std::vector<SPageTriangle>  pageTriangles(triangles.begin() + pageRanges[page].first, triangles.begin() + pageRanges[page].second);
+        std::vector<SPageNode>      nodes;
+        _BuildPageTree(pageTriangles, 0, (int)pageTriangles.size(), setting.maxTrianglesInLeaf, 0, nodes);
+
+        offset = (offset + _PAGE_ALIGNMENT - 1) / _PAGE_ALIGNMENT * _PAGE_ALIGNMENT;
+        entries[page].offset = offset;
+        entries[page].nNodes = (int32_t)nodes.size();
+        entries[page].nTriangles = (int32_t)pageTriangles.size();
+        entries[page].bounds = nodes[0].bounds;
+
+        isWritten = _Seek(file, offset) == 0;
+        isWritten = isWritten && fwrite(nodes.data(), sizeof(SPageNode), nodes.size(), file) == nodes.size();
+        isWritten = isWritten && fwrite(pageTriangles.data(), sizeof(SPageTriangle), pageTriangles.size(), file) == pageTriangles.size();
+        offset += nodes.size() * sizeof(SPageNode) + pageTriangles.size() * sizeof(SPageTriangle);
+    }
+
+    isWritten = isWritten && _Seek(file, 0) == 0;
+    isWritten = isWritten && fwrite(&header, sizeof(header), 1, file) == 1;
+    isWritten = isWritten && fwrite(entries.data(), sizeof(SPageEntry), entries.size(), file) == entries.size();
+    isWritten = (fclose(file) == 0) && isWritten;
+
+    std::remove(pagedFile);
+    if (!isWritten || std::rename(tmpPath.c_str(), pagedFile) != 0)
+    {
+        printf("[PagedMesh] Error: Failed to write \"%s\"\n", pagedFile);
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+
+    printf("[PagedMesh] Converted \"%s\": %d triangles in %d pages, %.1f MB\n",
+            objFile, header.nTriangles, header.nPages, offset / (1024.0 * 1024.0));
+
+    return true;
+}
+
+//----------------------------------------------------
+
+CHittablePagedMesh::CHittablePagedMesh(const std::shared_ptr<IMaterial> &material, size_t cacheBytes)
+: m_offset(0)
+, m_cacheBytes(cacheBytes)
+{
+    m_material = material;
+}
+
+//----------------------------------------------------
+
+CHittablePagedMesh::~CHittablePagedMesh()
+{
+    _Close();
+}
+
+//----------------------------------------------------
+
+void    CHittablePagedMesh::_Close()
+{
+    if (m_file != nullptr)
+        fclose(m_file);
+    m_file = nullptr;
+
+    m_topLevel.reset();
+    m_pages.clear();
+    m_residentPages.clear();
+    m_lru.clear();
+    m_stats = SStats();
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::Open(const char *pagedFile)
+{
+    _Close();
+
+    m_path = pagedFile;
+    m_file = fopen(pagedFile, "rb");
+    if (m_file == nullptr)
+    {
+        printf("[PagedMesh] Error: Failed to open \"%s\"\n", pagedFile);
+        return false;
+    }
+
+    SPagedMeshHeader    header;
+    if (fread(&header, sizeof(header), 1, m_file) != 1 || memcmp(header.magic, "CDPM", 4) != 0 ||
+        header.version != _PAGED_MESH_VERSION || header.nodeSize != sizeof(SPageNode) ||
+        header.entrySize != sizeof(SPageEntry) || header.nPages <= 0)
+    {
+        printf("[PagedMesh] Error: Invalid paged mesh \"%s\"\n", pagedFile);
+        _Close();
+        return false;
+    }
+
+    m_pages.resize(header.nPages);
+    if (fread(m_pages.data(), sizeof(SPageEntry), m_pages.size(), m_file) != m_pages.size())
+    {
+        printf("[PagedMesh] Error: Invalid paged mesh \"%s\"\n", pagedFile);
+        _Close();
+        return false;
+    }
+
+    // pages are read on the render threads, where a damaged entry could not
+    // be reported anymore, so all of them are checked up front
+    const uint64_t  fileSize = _FileSize(m_file);
+    for (const SPageEntry &entry : m_pages)
+    {
+        const bool  isValid = entry.nNodes > 0 && entry.nTriangles > 0 && entry.nTriangles <= UINT16_MAX && entry.offset <= fileSize &&
+                              (uint64_t)entry.nNodes * sizeof(SPageNode) + (uint64_t)entry.nTriangles * sizeof(SPageTriangle) <= fileSize - entry.offset;
+        if (!isValid)
+        {
+            printf("[PagedMesh] Error: Invalid page table in \"%s\"\n", pagedFile);
+            _Close();
+            return false;
+        }
+    }
+
+    m_offset = glm::vec3(0);
+    m_aabb = header.bounds;
+
+    // the top levels stay resident: a bvh-tree whose leaves are the pages
+    std::vector<std::shared_ptr<IHittable>>     pageBounds;
+    for (int page = 0; page < header.nPages; page++)
+        pageBounds.push_back(std::make_shared<CPageBounds>(this, page));
+
+    // the wide traversal culls pages behind the closest hit, so that
+    // occluded pages are not read in
+    CBVHAccel::SBuildSetting    setting;
+    setting.maxHittablesInNode = 1;
+    setting.partitionMethod = CBVHAccel::SAH;
+    setting.width = 4;
+    m_topLevel = std::make_unique<CBVHAccel>(pageBounds, setting);
+
+    m_residentPages.assign(m_pages.size(), SResidentPage());
+    m_stats.nPages = header.nPages;
+
+    printf("[PagedMesh] Opened \"%s\": %d triangles in %d pages\n", pagedFile, header.nTriangles, header.nPages);
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::_ReadPage(int page, SPage &data)
+{
+    // the entry sizes were checked by Open()
+    const SPageEntry    &entry = m_pages[page];
+    data.nodes.resize(entry.nNodes);
+    data.triangles.resize(entry.nTriangles);
+
+    {
+        std::lock_guard<std::mutex>     lock(m_fileMutex);
+        if (_Seek(m_file, entry.offset) != 0 ||
+            fread(data.nodes.data(), sizeof(SPageNode), data.nodes.size(), m_file) != data.nodes.size() ||
+            fread(data.triangles.data(), sizeof(SPageTriangle), data.triangles.size(), m_file) != data.triangles.size())
+        {
+            printf("[PagedMesh] Error: Failed to read page %d of \"%s\"\n", page, m_path.c_str());
+            return false;
+        }
+    }
+
+    // a damaged page must not send the traversal out of bounds
+    for (int i = 0; i < entry.nNodes; i++)
+    {
+        const SPageNode &node = data.nodes[i];
+        const bool      isValid = (node.nTriangles > 0) ? (node.offset >= 0 && node.offset + node.nTriangles <= entry.nTriangles)
+                                                        : (node.offset > i + 1 && node.offset < entry.nNodes && node.axis < 3);
+        if (!isValid)
+        {
+            printf("[PagedMesh] Error: Invalid page %d of \"%s\"\n", page, m_path.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//----------------------------------------------------
+
+std::shared_ptr<const CHittablePagedMesh::SPage>    CHittablePagedMesh::_FetchPage(int page)
+{
+    {
+        std::lock_guard<std::mutex>     lock(m_cacheMutex);
+        SResidentPage   &resident = m_residentPages[page];
+        if (resident.page)
+        {
+            m_lru.splice(m_lru.begin(), m_lru, resident.lruIt);
+            m_stats.nPageHits++;
+            return resident.page;
+        }
+    }
+
+    // read without holding the cache, so that other threads keep tracing
+    // through resident pages meanwhile
+    auto    data = std::make_shared<SPage>();
+    if (!_ReadPage(page, *data))
+        return nullptr;
+
+    std::lock_guard<std::mutex>     lock(m_cacheMutex);
+    SResidentPage   &resident = m_residentPages[page];
+    if (resident.page)
+    {
+        // another thread read it meanwhile
+        m_lru.splice(m_lru.begin(), m_lru, resident.lruIt);
+        m_stats.nPageHits++;
+        return resident.page;
+    }
+
+    resident.page = data;
+    m_lru.push_front(page);
+    resident.lruIt = m_lru.begin();
+    m_stats.nPageFaults++;
+    m_stats.residentBytes += data->Bytes();
+    m_stats.peakResidentBytes = std::max(m_stats.peakResidentBytes, m_stats.residentBytes);
+
+    // evict the least recently used pages, rays still tracing through an
+    // evicted page keep it alive until they are done
+    while (m_stats.residentBytes > m_cacheBytes && m_lru.size() > 1)
+    {
+        SResidentPage   &evicted = m_residentPages[m_lru.back()];
+        m_stats.residentBytes -= evicted.page->Bytes();
+        m_stats.nEvictions++;
+        evicted.page.reset();
+        m_lru.pop_back();
+    }
+
+    return data;
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec)
+{
+    if (!m_topLevel)
+        return false;
+
+    // the pages are stored untranslated, move the ray instead
+    CRay    pageRay = ray;
+    pageRay.m_origin -= m_offset;
+
+    if (!m_topLevel->Hit(pageRay, t_min, t_max, hitRec))
+        return false;
+
+    hitRec.p += m_offset;
+    hitRec.p_hittable = shared_from_this();
+    hitRec.p_material = m_material;
+
+    return true;
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::HitAll(const CRay &ray, float t_min, float t_max, VHits &hits)
+{
+    if (!m_topLevel)
+        return false;
+
+    CRay    pageRay = ray;
+    pageRay.m_origin -= m_offset;
+
+    const size_t    firstNewHit = hits.size();
+    m_topLevel->HitAll(pageRay, t_min, t_max, hits);
+
+    for (size_t i = firstNewHit; i < hits.size(); i++)
+    {
+        hits[i].p += m_offset;
+        hits[i].p_hittable = shared_from_this();
+        hits[i].p_material = m_material;
+    }
+
+    return hits.size() > firstNewHit;
+}
+
+//----------------------------------------------------
+
+bool    CHittablePagedMesh::Occluded(const CRay &ray, float t_min, float t_max)
+{
+    if (!m_topLevel)
+        return false;
+
+    CRay    pageRay = ray;
+    pageRay.m_origin -= m_offset;
+
+    return m_topLevel->Occluded(pageRay, t_min, t_max);
+}
+
+//----------------------------------------------------
+
+void    CHittablePagedMesh::Translate(const glm::vec3 &offset)
+{
+    m_offset += offset;
+    m_aabb = m_aabb.Translate(offset);
+}
+
+//----------------------------------------------------
+
+void    CHittablePagedMesh::BeginBVHProfile()
+{
+    if (m_topLevel)
+        m_topLevel->BeginProfile();
+}
+
+//----------------------------------------------------
+
+void    CHittablePagedMesh::EndBVHProfile()
+{
+    if (m_topLevel)
+        m_topLevel->EndProfile();
+}
+
+//----------------------------------------------------
+
+CHittablePagedMesh::SStats  CHittablePagedMesh::GetStats() const
+{
+    std::lock_guard<std::mutex>     lock(m_cacheMutex);
+
+    SStats  stats = m_stats;
+    stats.nResidentPages = (int)m_lru.size();
+    return stats;
+}
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
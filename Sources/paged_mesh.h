@@ -0,0 +1,111 @@
+#pragma once
+
+/*************************************************************************
+*
+*		paged_mesh.h
+*
+*		Out-of-core triangle mesh, for meshes larger than memory. A mesh
+*		is converted once into a paged file: its triangles are split
+*		into spatially coherent pages of a few thousand triangles, and
+*		every page stores its triangles together with its own bvh-tree.
+*		Opening the file only reads the page table. The top levels, a
+*		bvh-tree over the page bounds, stay resident, and a page is read
+*		into a bounded cache when a ray first reaches it. The least
+*		recently used pages are evicted when the cache is full.
+*
+**************************************************************************/
+
+#include "hittable.h"
+
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <string>
+
+_CD_NAMESPACE_BEGIN
+//----------------------------------------------------
+
+class CBVHAccel;
+
+//----------------------------------------------------
+
+class CHittablePagedMesh : public IHittable
+{
+public:
+    struct SBuildSetting
+    {
+        int         trianglesPerPage = 4096;    // max. # of triangles of a page
+        int         maxTrianglesInLeaf = 4;     // leaves of the page bvh-trees
+    };
+
+    struct SStats
+    {
+        int         nPages = 0;
+        int         nResidentPages = 0;
+        size_t      residentBytes = 0;
+        size_t      peakResidentBytes = 0;
+        uint64_t    nPageHits = 0;              // page requests served by the cache
+        uint64_t    nPageFaults = 0;            // page requests read from the file
+        uint64_t    nEvictions = 0;
+    };
+
+    // Converts the obj "objFile" into the paged file "pagedFile". The
+    // conversion holds the whole mesh in memory, so it is done once, on a
+    // machine that can; rendering then only needs the cache.
+    static bool     Convert(const char *objFile, const char *pagedFile, const SBuildSetting &setting);
+
+    // "cacheBytes" : memory budget of the resident pages. A page in use is
+    //                never evicted, so a single page may exceed it.
+    CHittablePagedMesh(const std::shared_ptr<IMaterial> &material, size_t cacheBytes = (size_t)256 << 20);
+    ~CHittablePagedMesh();
+
+    virtual bool    Hit(const CRay &ray, float t_min, float t_max, SHitRec &hitRec) override;
+    virtual bool    HitAll(const CRay &ray, float t_min, float t_max, VHits &hits) override;
+    virtual bool    Occluded(const CRay &ray, float t_min, float t_max) override;
+    virtual void    Translate(const glm::vec3 &offset) override;
+    virtual void    BeginBVHProfile() override;
+    virtual void    EndBVHProfile() override;
+
+    bool            Open(const char *pagedFile);
+    SStats          GetStats() const;
+
+private:
+    struct SPage;           // triangles and bvh-tree of a page, as stored in the file
+    class CPageBounds;      // leaf of the top level tree, faults its page in on a hit
+
+    struct SPageEntry
+    {
+        uint64_t    offset;         // in the file
+        int32_t     nNodes;
+        int32_t     nTriangles;
+        CAABB       bounds;
+    };
+
+    struct SResidentPage
+    {
+        std::shared_ptr<const SPage>    page;       // null -> not resident
+        std::list<int>::iterator        lruIt;
+    };
+
+    // Returns the page, reading it from the file if it is not resident.
+    std::shared_ptr<const SPage>    _FetchPage(int page);
+    bool            _ReadPage(int page, SPage &data);
+    void            _Close();
+
+    std::string                     m_path;
+    FILE                            *m_file = nullptr;
+    std::mutex                      m_fileMutex;
+    std::vector<SPageEntry>         m_pages;
+    std::unique_ptr<CBVHAccel>      m_topLevel;
+    glm::vec3                       m_offset;           // Translate(), the pages are stored untranslated
+
+    // page cache, most recently used page first in "m_lru"
+    mutable std::mutex              m_cacheMutex;
+    const size_t                    m_cacheBytes;
+    std::vector<SResidentPage>      m_residentPages;
+    std::list<int>                  m_lru;
+    SStats                          m_stats;
+};
+
+//----------------------------------------------------
+_CD_NAMESPACE_END
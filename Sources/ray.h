@@ -2,6 +2,10 @@
 
 #include "common.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 _CD_NAMESPACE_BEGIN
 //----------------------------------------------------
 
@@ -22,5 +26,151 @@ public:
     glm::vec3   m_dir;
 };
 
+//----------------------------------------------------
+
+// Ray prepared for acceleration structure traversal. The reciprocal direction
+// and its signs are computed once per query instead of once per box, and
+// [m_tMin, m_tMax] is the part of the ray left to search. Closest hit queries
+// shrink m_tMax to the closest hit found so far, which culls every box behind it.
+class CTraversalRay
+{
+public:
+    CTraversalRay(const CRay &ray, float t_min, float t_max)
+    : m_origin(ray.m_origin)
+    , m_invDir(1.f / ray.m_dir)
+    , m_tMin(t_min)
+    , m_tMax(t_max)
+    {
+        for (int axis = 0; axis < 3; axis++)
+            m_dirIsNeg[axis] = m_invDir[axis] < 0;
+    }
+
+public:
+    glm::vec3   m_origin;
+    glm::vec3   m_invDir;
+    int         m_dirIsNeg[3];      // 1 -> the box far side is its minimum on this axis
+    float       m_tMin;
+    float       m_tMax;
+};
+
+//----------------------------------------------------
+
+// Coherent rays traced together, such as the primary rays of a screen tile.
+// Each ray keeps its own [m_tMin, m_tMax[i]] interval, shrunk by its closest
+// hit. The rays are also stored as structure of arrays, padded to a multiple
+// of four with lanes that never hit, for SIMD box tests. When all directions
+// agree in sign on every axis, the packet keeps interval bounds of its
+// origins and reciprocal directions: a frustum that rejects a box for all
+// the rays in one test.
+class CRayPacket
+{
+public:
+    static constexpr int    kMaxRays = 256;         // a 16x16 tile
+    static constexpr int    kMaxSIMDRays = 16;      // larger packets test the frustum before the rays
+
+    CRayPacket(float t_min, float t_max)
+    : m_tMin(t_min)
+    , m_tMaxBound(t_max)
+    {
+    }
+
+    // returns the index of the ray, -1 when the packet is full
+    int     Add(const CRay &ray)
+    {
+        if (m_nRays == kMaxRays)
+            return -1;
+
+        const int   i = m_nRays++;
+        if ((i & 3) == 0)
+        {
+            // padding lanes, overwritten by the next rays
+            for (int lane = i + 1; lane < i + 4 && lane < kMaxRays; lane++)
+            {
+                m_tMax[lane] = -std::numeric_limits<float>::infinity();
+                for (int axis = 0; axis < 3; axis++)
+                    m_origin[axis][lane] = m_invDir[axis][lane] = 0;
+            }
+        }
+
+        const glm::vec3 invDir = 1.f / ray.m_dir;
+        m_rays[i] = ray;
+        m_isHit[i] = 0;
+        m_tMax[i] = m_tMaxBound;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            m_origin[axis][i] = ray.m_origin[axis];
+            m_invDir[axis][i] = invDir[axis];
+        }
+
+        // the frustum needs finite reciprocals of the same sign on every axis
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const int   isNeg = invDir[axis] < 0;
+            if (i == 0)
+                m_dirIsNeg[axis] = isNeg;
+            m_hasFrustum &= (m_dirIsNeg[axis] == isNeg) && std::isfinite(invDir[axis]);
+        }
+        m_originMin = (i == 0) ? ray.m_origin : glm::min(m_originMin, ray.m_origin);
+        m_originMax = (i == 0) ? ray.m_origin : glm::max(m_originMax, ray.m_origin);
+        m_invDirMin = (i == 0) ? invDir : glm::min(m_invDirMin, invDir);
+        m_invDirMax = (i == 0) ? invDir : glm::max(m_invDirMax, invDir);
+        return i;
+    }
+
+    // For rays whose lines all pass through "apex", such as rays converging
+    // on a light. They lie in a double cone around it, which culls boxes no
+    // ray line passes through, whatever the direction signs. Call it once
+    // all the rays are added.
+    void    SetApex(const glm::vec3 &apex)
+    {
+        if (m_nRays == 0)
+            return;
+
+        // the cone is symmetric, fold the directions onto one side
+        glm::vec3   axis(0);
+        for (int i = 0; i < m_nRays; i++)
+            axis += (glm::dot(m_rays[i].m_dir, m_rays[0].m_dir) < 0) ? -m_rays[i].m_dir : m_rays[i].m_dir;
+        if (glm::dot(axis, axis) == 0)
+            return;
+        axis = glm::normalize(axis);
+
+        // bounds of the half angle, kept apart as cross products stay accurate at small angles
+        m_coneCos = 1;
+        m_coneSin = 0;
+        for (int i = 0; i < m_nRays; i++)
+        {
+            m_coneCos = std::min(m_coneCos, std::abs(glm::dot(m_rays[i].m_dir, axis)));
+            m_coneSin = std::max(m_coneSin, glm::length(glm::cross(m_rays[i].m_dir, axis)));
+        }
+        m_apex = apex;
+        m_coneAxis = axis;
+        m_hasCone = true;
+    }
+
+    inline int  Size() const { return m_nRays; }
+
+public:
+    int         m_nRays = 0;
+    float       m_tMin;
+    float       m_tMaxBound;                        // t_max the rays started with
+    CRay        m_rays[kMaxRays];
+    uint8_t     m_isHit[kMaxRays];
+    alignas(16) float   m_tMax[kMaxRays];
+    alignas(16) float   m_origin[3][kMaxRays];
+    alignas(16) float   m_invDir[3][kMaxRays];
+
+    // frustum
+    bool        m_hasFrustum = true;
+    int         m_dirIsNeg[3];
+    glm::vec3   m_originMin, m_originMax;
+    glm::vec3   m_invDirMin, m_invDirMax;
+
+    // cone, see SetApex()
+    bool        m_hasCone = false;
+    glm::vec3   m_apex;
+    glm::vec3   m_coneAxis;
+    float       m_coneCos, m_coneSin;               // lower bound of the cosine, upper bound of the sine of the half angle
+};
+
 //----------------------------------------------------
 _CD_NAMESPACE_END
@@ -48,7 +48,7 @@ void    CRenderer::InitScene()
     // Hittables
     // OBJ Mesh
     auto    croissant = std::make_shared<cd::CHittableMesh>(glm::vec3(0, 0, 0), mat_lambertBrown);
-    croissant->Load("Model/Croissants_obj/Croissant.obj");
+    croissant->Load("Model/Croissants_obj/Croissant.obj", "Model/Croissants_obj");
     m_scene->Add(croissant);
 
     // some spheres
@@ -64,6 +64,31 @@ void    CRenderer::InitScene()
 
     // BVH-Tree Construction
     m_scene->BuildBVHTree();
+    _ProfileBVH();
+}
+
+//----------------------------------------------------
+
+// Short low resolution render that measures which bvh nodes are visited,
+// then lays the nodes out hottest first.
+void    CRenderer::_ProfileBVH()
+{
+    const u_int32_t res = m_renderSetting.nProfileRes;
+    if (res == 0)
+        return;
+
+    printf("[Render] Profiling bvh-tree at %ux%u...\n", res, res);
+    m_scene->BeginBVHProfile();
+
+#pragma omp parallel for
+    for (int i = 0; i < (int)(res * res); i++)
+    {
+        const float u = ((i % res) + 0.5f) / res;
+        const float v = ((i / res) + 0.5f) / res;
+        _Raycast(m_camera->GetRay(u, v));
+    }
+
+    m_scene->EndBVHProfile();
 }
 
 //----------------------------------------------------
@@ -79,20 +104,44 @@ glm::vec3   CRenderer::_Raycast(const CRay &ray)
 
 //----------------------------------------------------
 
+// Primary rays of a packet, traced together through the scene.
+void    CRenderer::_RaycastPacket(CRayPacket &packet, glm::vec3 *colors)
+{
+#if 1
+    SHitRec     hitRecs[CRayPacket::kMaxRays];
+    m_scene->HitPacket(packet, 0, hitRecs);
+
+    _ConvolutionShadePacket(packet, hitRecs, colors);
+#else
+    for (int i = 0; i < packet.Size(); i++)
+        colors[i] = _RecursivePathTrace(packet.m_rays[i], m_renderSetting.nMaxDepth);
+#endif
+}
+
+//----------------------------------------------------
+
 // Primary raycast for convoluation domain raytracing.
 // This is a camera -> object raycast.
 glm::vec3   CRenderer::_ConvolutionPrimaryRaycast(const CRay &ray)
-//color shader::_ConvolutionCast(const light *light, const hitrec &hit) const
 {
-    // Set of data to collect
-    float R0 = 0;
-    float RN = 0;
-
     // Primary Hit!
     SHitRec     hitRec;
     if (!m_scene->Hit(ray, _EPSILON, _INFINITY, hitRec))
         return glm::vec3(0);    // empty hit`
 
+    return _ConvolutionShade(ray, hitRec);
+}
+
+//----------------------------------------------------
+
+// Convolution domain shading of a primary hit.
+glm::vec3   CRenderer::_ConvolutionShade(const CRay &ray, const SHitRec &hitRec)
+//color shader::_ConvolutionCast(const light *light, const hitrec &hit) const
+{
+    // Set of data to collect
+    float R0 = 0;
+    float RN = 0;
+
     // ------------------------------------------------
     // 1. Compute R0 (Direct Illumination) Term
     // ------------------------------------------------
@@ -145,6 +194,69 @@ glm::vec3   CRenderer::_ConvolutionPrimaryRaycast(const CRay &ray)
         RN *= _ConvolutionThirdRaycast(ray, targetPoint, p_hittable, hitRec);
     }
 
+    return _ConvolutionCombine(R0, RN, hitRec);
+}
+
+//----------------------------------------------------
+
+// Convolution domain shading of the primary hits of a packet. All the RN
+// rays of the packet converge on the light, so per object they are traced
+// as one packet with the light as its apex. The R0 rays each target the
+// object of their own hit, and stay single rays.
+void    CRenderer::_ConvolutionShadePacket(const CRayPacket &primary, const SHitRec *hitRecs, glm::vec3 *colors)
+{
+    float   R0[CRayPacket::kMaxRays];
+    float   RN[CRayPacket::kMaxRays];
+    float   lightEnergy[CRayPacket::kMaxRays];
+
+    for (int i = 0; i < primary.Size(); i++)
+    {
+        if (!primary.m_isHit[i])
+            continue;
+
+        R0[i] = _ConvolutionSecondRaycast(primary.m_rays[i], m_light->Origin(), hitRecs[i].p_hittable, hitRecs[i]);
+        RN[i] = 0;
+        // the RN rays of a pixel are the same for every object
+        lightEnergy[i] = _ConvolutionThirdRaycast(primary.m_rays[i], m_light->Origin(), hitRecs[i].p_hittable, hitRecs[i]);
+    }
+
+    // per object, in the order of _ConvolutionShade(), as RN is not a plain sum
+    VHits   hits[CRayPacket::kMaxRays];
+    int     rayPixel[CRayPacket::kMaxRays];
+    for (auto &p_hittable : m_scene->m_hittables)
+    {
+        CRayPacket  packet(_EPSILON, _INFINITY);
+        for (int i = 0; i < primary.Size(); i++)
+        {
+            // pixels that hit this object already have it in R0
+            if (primary.m_isHit[i] && hitRecs[i].p_hittable != p_hittable)
+                rayPixel[packet.Add(_ConvolutionSecondRay(m_light->Origin(), hitRecs[i]))] = i;
+        }
+        if (packet.Size() == 0)
+            continue;
+        packet.SetApex(m_light->Origin());
+
+        for (int j = 0; j < packet.Size(); j++)
+            hits[j].clear();
+        p_hittable->HitAllPacket(packet, 0, hits);
+
+        for (int j = 0; j < packet.Size(); j++)
+        {
+            const int   i = rayPixel[j];
+            RN[i] += _ConvolutionDR(hits[j], false);
+            RN[i] *= lightEnergy[i];
+        }
+    }
+
+    for (int i = 0; i < primary.Size(); i++)
+        colors[i] = primary.m_isHit[i] ? _ConvolutionCombine(R0[i], RN[i], hitRecs[i]) : glm::vec3(0);
+}
+
+//----------------------------------------------------
+
+// Final color from the occlusion terms of a primary hit.
+glm::vec3   CRenderer::_ConvolutionCombine(float R0, float RN, const SHitRec &hitRec) const
+{
     // ------------------------------------------------
     // 3. Combine all together
     // ------------------------------------------------
@@ -168,14 +280,30 @@ glm::vec3   CRenderer::_ConvolutionPrimaryRaycast(const CRay &ray)
 float   CRenderer::_ConvolutionSecondRaycast(const CRay &primaryRay, const glm::vec3 &targetP, const std::shared_ptr<IHittable> &targetObj, const SHitRec &primaryHitRec)
 {
     // secondary ray
-    const glm::vec3 new_origin = primaryHitRec.p - primaryHitRec.n * m_renderSetting.K_DIG;;
-    const glm::vec3 new_direction = glm::normalize(targetP - new_origin);    // towards center of the light
-    const CRay      secondRay = {new_origin, new_direction};
+    const CRay      secondRay = _ConvolutionSecondRay(targetP, primaryHitRec);
 
     // hitqueue hits;
     VHits hits;
 
     targetObj->HitAll(secondRay, _EPSILON, _INFINITY, hits);
+
+    return _ConvolutionDR(hits, targetObj == primaryHitRec.p_hittable);
+}
+
+//----------------------------------------------------
+// Secondary ray from just below the primary hit towards "targetP".
+CRay    CRenderer::_ConvolutionSecondRay(const glm::vec3 &targetP, const SHitRec &primaryHitRec) const
+{
+    const glm::vec3 new_origin = primaryHitRec.p - primaryHitRec.n * m_renderSetting.K_DIG;
+    const glm::vec3 new_direction = glm::normalize(targetP - new_origin);    // towards center of the light
+    return {new_origin, new_direction};
+}
+
+//----------------------------------------------------
+// Length of the secondary ray spent inside objects, from its hits. The ray
+// starts inside when it computes R0.
+float   CRenderer::_ConvolutionDR(VHits &hits, bool isInside) const
+{
     std::sort(hits.begin(), hits.end(), cmpHitRec);
 
     // Data to collect
@@ -189,7 +317,6 @@ float   CRenderer::_ConvolutionSecondRaycast(const CRay &primaryRay, const glm::
     // HACK: This will ensure that 't_start' will initially set differently:
     //  - 0: If it's computing R0
     //  - t: If it's computing RN
-    bool  isInside = (targetObj == primaryHitRec.p_hittable);
     for (auto &hit : hits)
     {
         if (isInside)
@@ -212,9 +339,7 @@ float   CRenderer::_ConvolutionSecondRaycast(const CRay &primaryRay, const glm::
 // This third raycast computes the light energy from the given ray.
 float   CRenderer::_ConvolutionThirdRaycast(const CRay &primaryRay, const glm::vec3 &targetP, const std::shared_ptr<IHittable> &targetObj, const SHitRec &primaryHitRec)
 {
-    const glm::vec3 new_origin = primaryHitRec.p - primaryHitRec.n * m_renderSetting.K_DIG;
-    const glm::vec3 new_direction = glm::normalize(targetP - new_origin);    // towards center of the light
-    const CRay      secondRay = {new_origin, new_direction};
+    const CRay      secondRay = _ConvolutionSecondRay(targetP, primaryHitRec);
 
     const float     LIGHT_ENERGY = m_light->GetIntensityFromRay(secondRay);
 
@@ -267,27 +392,32 @@ void    CRenderer::Render()
     // Timer
     auto    begin = std::chrono::steady_clock::now();
 
-    for (size_t w = 0; w < m_renderSetting.render_w; w++) {
-        for (size_t h = 0; h < m_renderSetting.render_h; h++) {
+    if (m_renderSetting.tileSize > 0)
+        _RenderTiles(logEvery);
+    else
+    {
+        for (size_t w = 0; w < m_renderSetting.render_w; w++) {
+            for (size_t h = 0; h < m_renderSetting.render_h; h++) {
 #pragma omp parallel for
-            for (size_t s = 0; s < m_renderSetting.nSamples; s++)
-            {
-                const int   si = s % m_renderSetting.nSamplesW;
-                const int   sj = s / m_renderSetting.nSamplesH;
-                const float u = (w + (float)si / m_renderSetting.nSamplesW + m_renderSetting.nSamplesOffset) / m_renderSetting.render_w;
-                const float v = (h + (float)sj / m_renderSetting.nSamplesH + m_renderSetting.nSamplesOffset) / m_renderSetting.render_h;
-                const CRay  ray = m_camera->GetRay(u, v);
-
-                // Raycast!
-                glm::vec3   color = _Raycast(ray);
-
-                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 0] += color.r;
-                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 1] += color.g;
-                m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 2] += color.b;
+                for (size_t s = 0; s < m_renderSetting.nSamples; s++)
+                {
+                    const int   si = s % m_renderSetting.nSamplesW;
+                    const int   sj = s / m_renderSetting.nSamplesH;
+                    const float u = (w + (float)si / m_renderSetting.nSamplesW + m_renderSetting.nSamplesOffset) / m_renderSetting.render_w;
+                    const float v = (h + (float)sj / m_renderSetting.nSamplesH + m_renderSetting.nSamplesOffset) / m_renderSetting.render_h;
+                    const CRay  ray = m_camera->GetRay(u, v);
+
+                    // Raycast!
+                    glm::vec3   color = _Raycast(ray);
+
+                    m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 0] += color.r;
+                    m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 1] += color.g;
+                    m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 2] += color.b;
+                }
             }
+            if ((int)(w % logEvery) == 0)
+                printf("|");
         }
-        if ((int)(w % logEvery) == 0)
-            printf("|");
     }
     printf("\n");
 
@@ -302,6 +432,65 @@ void    CRenderer::Render()
 
 //----------------------------------------------------
 
+// Renders the image in square tiles, tracing the primary rays of a tile and
+// sample as one packet. The tiles of a column are rendered in parallel, and
+// each writes only its own pixels.
+void    CRenderer::_RenderTiles(int logEvery)
+{
+    const int   tileSize = glm::clamp((int)m_renderSetting.tileSize, 1, 16);   // 16x16 rays fill a packet
+    const int   render_w = m_renderSetting.render_w;
+    const int   render_h = m_renderSetting.render_h;
+
+    for (int x0 = 0; x0 < render_w; x0 += tileSize)
+    {
+        const int   x1 = std::min(x0 + tileSize, render_w);
+
+#pragma omp parallel for schedule(dynamic)
+        for (int y0 = 0; y0 < render_h; y0 += tileSize)
+        {
+            const int   y1 = std::min(y0 + tileSize, render_h);
+            glm::vec3   colors[CRayPacket::kMaxRays];
+
+            for (size_t s = 0; s < m_renderSetting.nSamples; s++)
+            {
+                const int   si = s % m_renderSetting.nSamplesW;
+                const int   sj = s / m_renderSetting.nSamplesH;
+
+                CRayPacket  packet(_EPSILON, _INFINITY);
+                for (int h = y0; h < y1; h++) {
+                    for (int w = x0; w < x1; w++)
+                    {
+                        const float u = (w + (float)si / m_renderSetting.nSamplesW + m_renderSetting.nSamplesOffset) / m_renderSetting.render_w;
+                        const float v = (h + (float)sj / m_renderSetting.nSamplesH + m_renderSetting.nSamplesOffset) / m_renderSetting.render_h;
+                        packet.Add(m_camera->GetRay(u, v));
+                    }
+                }
+
+                // Raycast!
+                _RaycastPacket(packet, colors);
+
+                int     i = 0;
+                for (int h = y0; h < y1; h++) {
+                    for (int w = x0; w < x1; w++, i++)
+                    {
+                        m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 0] += colors[i].r;
+                        m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 1] += colors[i].g;
+                        m_pixmap[(h * m_renderSetting.render_w + w) * 3 + 2] += colors[i].b;
+                    }
+                }
+            }
+        }
+
+        for (int w = x0; w < x1; w++)
+        {
+            if (w % logEvery == 0)
+                printf("|");
+        }
+    }
+}
+
+//----------------------------------------------------
+
 void    CRenderer::GetLastRender(float* &outMap)
 {
     if (outMap == nullptr)
@@ -10,7 +10,9 @@ class CHittableList;
 class ILight;
 class CCamera;
 class CRay;
+class CRayPacket;
 struct SHitRec;
+typedef std::vector<SHitRec> VHits;
 
 //----------------------------------------------------
 
@@ -31,6 +33,12 @@ struct SRenderSetting
     // AA
     u_int32_t   nSamplesW, nSamplesH;
     float       nSamplesOffset;
+
+    // BVH
+    u_int32_t   nProfileRes;    // resolution of the profiling render for bvh relayout, 0 -> off
+
+    // Packets
+    u_int32_t   tileSize;       // primary rays are traced in packets of tileSize x tileSize pixels (max. 16), 0 -> one by one
 };
 
 //----------------------------------------------------
@@ -51,13 +59,21 @@ public:
 private:
     // Different Raycast methods.
     glm::vec3   _Raycast(const CRay &ray);
+    void        _RaycastPacket(CRayPacket &packet, glm::vec3 *colors);
     glm::vec3   _ConvolutionPrimaryRaycast(const CRay &ray);
+    glm::vec3   _ConvolutionShade(const CRay &ray, const SHitRec &hitRec);
+    void        _ConvolutionShadePacket(const CRayPacket &primary, const SHitRec *hitRecs, glm::vec3 *colors);
+    glm::vec3   _ConvolutionCombine(float R0, float RN, const SHitRec &hitRec) const;
     float       _ConvolutionSecondRaycast(const CRay &primaryRay, const glm::vec3 &targetP,  const std::shared_ptr<IHittable> &targetObj, const SHitRec &primaryHitRec);
     float       _ConvolutionThirdRaycast(const CRay &primaryRay, const glm::vec3 &targetP, const std::shared_ptr<IHittable> &targetObj, const SHitRec &primaryHitRec);
+    CRay        _ConvolutionSecondRay(const glm::vec3 &targetP, const SHitRec &primaryHitRec) const;
+    float       _ConvolutionDR(VHits &hits, bool isInside) const;
     glm::vec3   _RecursivePathTrace(const CRay &ray, int depth);
 
 private:
     void        _ClearOldRender();
+    void        _RenderTiles(int logEvery);
+    void        _ProfileBVH();
 
 private:
     std::shared_ptr<CHittableList>  m_scene;
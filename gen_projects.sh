@@ -5,9 +5,11 @@ PREMAKE_DIR=Premake     # Replace this with your local premake directory
 cd $SCRIPT_DIR
 
 OS=`uname -s`
+OPTIONS=""
 if [ "$OS" == 'Windows' ]; then
     OS="windows"
     ACTION="vs2019"
+    OPTIONS="--openmp"
 elif [ "$OS" == 'Darwin' ]; then
     OS="macosx"
     ACTION="xcode4"
@@ -15,12 +17,13 @@ elif [ "$OS" == 'Darwin' ]; then
 elif [ "$OS" == 'Linux' ]; then
     OS="linux"
     ACTION="gmake"
+    OPTIONS="--openmp"
 else
     echo "Unknown system $OS!"
     exit 1
 fi
 
 # Run Premake (project generation)
-(cd $PREMAKE_DIR && ./premake5 --os=$OS $ACTION)
+(cd $PREMAKE_DIR && ./premake5 --os=$OS $OPTIONS $ACTION)
 
 exit 0